@@ -9,23 +9,29 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <TROOT.h>
 #include <TSystem.h>
 #include <TString.h>
 #include <TH2D.h> 
 #include <TFile.h> 
-#include <TCanvas.h> 
 #include <TStyle.h> 
 #include <Riostream.h>
 #include <TTree.h>
 #include <TGraph.h>
+#include <TMath.h> 
+#include <TVector3.h> 
+
+// -DRASER_BATCH builds raser without the graphics (no drift path
+// display, no IV plots), linked only against the compute libraries
+#ifndef RASER_BATCH
+#include <TCanvas.h> 
 #include <TMultiGraph.h>
 #include <TLegend.h>
 #include <TApplication.h> 
-#include <TMath.h> 
 #include <TLine.h> 
-#include <TVector3.h> 
+#endif
 
 // KDetSim 
 
@@ -69,6 +75,364 @@ void free_dvector(double *v, long nl, long nh)
 	free((FREE_ARG)(v + nl - NR_END));
 }
 
+
+// KCheckpoint
+
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <unistd.h>
+
+class KCheckpoint
+{
+	private:
+		std::string File;
+		std::vector<char> Buf;     // state being written
+		Int_t Busy,Done;
+		std::chrono::steady_clock::time_point Last;
+		std::mutex Lock;
+		std::condition_variable Cond;
+		std::thread Thread;
+		void Work();
+
+	public:
+		Double_t Interval;           // seconds between checkpoints
+		Long64_t Saved;           // checkpoints written
+
+		KCheckpoint(const char *, Double_t = 600);
+		~KCheckpoint();
+		Bool_t Due();
+		Int_t Save(std::vector<char> &);
+		Int_t Load(std::vector<char> &);
+		void Remove();
+		static void Put(std::vector<char> &, const void *, size_t);
+		static Int_t Get(const std::vector<char> &, size_t &, void *, size_t);
+		static ULong64_t Hash(const void *, size_t, ULong64_t = 14695981039346656037ULL);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KCheckpoint                                                          //
+//                                                                      //
+// Keeps the state of a long job (the vectors of linbcg, the progress   //
+// of EventMC) in a file, so that a pre-empted job continues where it   //
+// stopped. Save() hands a packed state to a background thread and      //
+// returns at once; the thread writes it to a temporary file with a     //
+// checksum and renames it over the old checkpoint, so the file always  //
+// holds a complete state. A save is skipped while the previous one is  //
+// still being written.                                                 //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KCheckpoint::KCheckpoint(const char *name, Double_t interval)
+{
+	File=name; Interval=interval;
+	Busy=0; Done=0; Saved=0;
+	Last=std::chrono::steady_clock::now();
+	Thread=std::thread(&KCheckpoint::Work,this);
+}
+
+KCheckpoint::~KCheckpoint()
+{
+	{
+		std::lock_guard<std::mutex> lk(Lock);
+		Done=1;
+	}
+	Cond.notify_all();
+	Thread.join();
+}
+
+Bool_t KCheckpoint::Due()
+{
+	// true if Interval has passed since the last save and it was written
+	std::lock_guard<std::mutex> lk(Lock);
+	return !Busy && std::chrono::duration<Double_t>(std::chrono::steady_clock::now()-Last).count()>=Interval;
+}
+
+Int_t KCheckpoint::Save(std::vector<char> &state)
+{
+	// hands state over (swapped) to the writer; 0 if it is still busy
+	std::lock_guard<std::mutex> lk(Lock);
+	if(Busy) return 0;
+	Buf.swap(state);
+	Busy=1;
+	Last=std::chrono::steady_clock::now();
+	Cond.notify_all();
+	return 1;
+}
+
+void KCheckpoint::Work()
+{
+	std::unique_lock<std::mutex> lk(Lock);
+	while(1)
+	{
+		Cond.wait(lk,[this]{return Done || Busy;});
+		if(!Busy) break;
+		lk.unlock();
+		std::string tmp=File+".tmp";
+		ULong64_t n=Buf.size(),h=Hash(Buf.data(),n);
+		FILE *f=fopen(tmp.c_str(),"wb");
+		if(f==NULL) printf("KCheckpoint: can not write %s\n",tmp.c_str());
+		else
+		{
+			Int_t ok=fwrite("RASERCK1",1,8,f)==8 && fwrite(&n,sizeof(n),1,f)==1 &&
+			       fwrite(Buf.data(),1,n,f)==n && fwrite(&h,sizeof(h),1,f)==1;
+			ok=fflush(f)==0 && ok;
+			fsync(fileno(f));
+			fclose(f);
+			if(ok) rename(tmp.c_str(),File.c_str());
+			else printf("KCheckpoint: writing %s failed\n",tmp.c_str());
+		}
+		lk.lock();
+		Saved++;
+		Busy=0;
+		Cond.notify_all();
+	}
+}
+
+Int_t KCheckpoint::Load(std::vector<char> &state)
+{
+	// reads the last complete checkpoint, 0 if there is none
+	char magic[8];
+	ULong64_t n,h;
+	Int_t ok=0;
+	FILE *f=fopen(File.c_str(),"rb");
+	if(f==NULL) return 0;
+	if(fread(magic,1,8,f)==8 && !memcmp(magic,"RASERCK1",8) && fread(&n,sizeof(n),1,f)==1)
+	{
+		state.resize(n);
+		if(fread(state.data(),1,n,f)==n && fread(&h,sizeof(h),1,f)==1 && h==Hash(state.data(),n)) ok=1;
+	}
+	fclose(f);
+	if(!ok) printf("KCheckpoint: %s is damaged, ignored\n",File.c_str());
+	return ok;
+}
+
+void KCheckpoint::Remove()
+{
+	// waits for the last write and deletes the checkpoint (the job is done)
+	std::unique_lock<std::mutex> lk(Lock);
+	Cond.wait(lk,[this]{return !Busy;});
+	remove(File.c_str());
+}
+
+void KCheckpoint::Put(std::vector<char> &s, const void *p, size_t n)
+{
+	s.insert(s.end(),(const char *)p,(const char *)p+n);
+}
+
+Int_t KCheckpoint::Get(const std::vector<char> &s, size_t &pos, void *p, size_t n)
+{
+	if(pos+n>s.size()) return 0;
+	memcpy(p,&s[pos],n);
+	pos+=n;
+	return 1;
+}
+
+ULong64_t KCheckpoint::Hash(const void *p, size_t n, ULong64_t h)
+{
+	// FNV-1a
+	const unsigned char *c=(const unsigned char *)p;
+	for(size_t i=0;i<n;i++) {h^=c[i]; h*=1099511628211ULL;}
+	return h;
+}
+
+// KProfile
+
+#include <algorithm>
+
+class KProfileData
+{
+	public:
+		Int_t Tid;                    // thread number in the trace
+		std::vector<Double_t> Time;   // time in each timer [s]
+		std::vector<Long64_t> Calls;  // calls of each timer
+		std::vector<Long64_t> Count;  // counters
+		std::vector<Double_t> Trace;  // timer, start, duration [us] of the traced scopes
+		Long64_t Dropped;             // scopes not traced (MaxTrace reached)
+};
+
+class KProfile
+{
+	private:
+		static std::mutex Lock;
+		static std::vector<KProfileData *> Threads;
+		static thread_local KProfileData *Local;
+		static std::chrono::steady_clock::time_point T0;
+
+	public:
+		enum {kGeometry, kDeclaration, kSolver, kGradient, kDrift, kBatch, kEvent, kMip, kEventMC, kNTimers};
+		enum {kIterations, kFieldXYZ, kPotXYZ, kGridPoints, kMobility, kSteps, kNCounters};
+		static const Int_t kNStops=21;            // drift stop codes (ishit of KDetector::Drift)
+		static const char *TimerNames[kNTimers];
+		static const char *CounterNames[kNCounters];
+
+		static std::atomic<Bool_t> On;      // collect timers and counters
+		static std::atomic<Bool_t> Tracing; // keep the scopes for the trace
+		static Long64_t MaxTrace;     // scopes traced per thread
+
+		static void Start(Bool_t = kFALSE);
+		static void Stop() {On.store(kFALSE); Tracing.store(kFALSE);};
+		static Bool_t IsOn() {return On.load(std::memory_order_relaxed);};
+		static Bool_t IsTracing() {return Tracing.load(std::memory_order_relaxed);};
+		static void Reset();
+		static KProfileData *Data();
+		static Double_t Now() {return std::chrono::duration<Double_t,std::micro>(std::chrono::steady_clock::now()-T0).count();};
+		static void Add(Int_t c, Long64_t n=1) {if(IsOn()) Data()->Count[c]+=n;};
+		static void AddStop(Int_t stop, Int_t steps) {if(IsOn()) {KProfileData *d=Data(); d->Count[kNCounters+2*stop]++; d->Count[kNCounters+2*stop+1]+=steps; d->Count[kSteps]+=steps;}};
+		static void Print();
+		static Int_t WriteTrace(const char *);
+};
+
+class KProfileTimer
+{
+	private:
+		Int_t Id;
+		Double_t T;
+
+	public:
+		KProfileTimer(Int_t id) {Id=id; T=KProfile::IsOn()?KProfile::Now():-1;};
+		~KProfileTimer();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KProfile                                                             //
+//                                                                      //
+// Timers and counters of the hot paths, switched on at run time with  //
+// Start(). A KProfileTimer measures the scope it lives in (geometry,   //
+// Declaration, the solver, field gradients, drifts, events); counters  //
+// count solver iterations, interpolations, mobility evaluations and    //
+// the drifts and steps per stop code. Each thread fills its own        //
+// KProfileData, so the counting needs no lock; when off a timer or     //
+// counter costs one test. Print() sums the threads, WriteTrace() gives //
+// the traced scopes as a Chrome trace-event file (chrome://tracing,    //
+// ui.perfetto.dev).                                                    //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+std::mutex KProfile::Lock;
+std::vector<KProfileData *> KProfile::Threads;
+thread_local KProfileData *KProfile::Local=NULL;
+std::chrono::steady_clock::time_point KProfile::T0=std::chrono::steady_clock::now();
+std::atomic<Bool_t> KProfile::On(kFALSE);
+std::atomic<Bool_t> KProfile::Tracing(kFALSE);
+Long64_t KProfile::MaxTrace=1000000;
+
+const char *KProfile::TimerNames[kNTimers]={"geometry","declaration","solver","gradient","drift","batch drift","event","mip","event mc"};
+const char *KProfile::CounterNames[kNCounters]={"solver iterations","field interpolations","potential interpolations",
+                                                "grid points","mobility evaluations","drift steps"};
+
+void KProfile::Start(Bool_t trace)
+{
+	Reset();
+	T0=std::chrono::steady_clock::now();
+	Tracing.store(trace);
+	On.store(kTRUE);
+}
+
+void KProfile::Reset()
+{
+	std::lock_guard<std::mutex> lk(Lock);
+	for(size_t i=0;i<Threads.size();i++)
+	{
+		KProfileData *d=Threads[i];
+		std::fill(d->Time.begin(),d->Time.end(),0.);
+		std::fill(d->Calls.begin(),d->Calls.end(),0);
+		std::fill(d->Count.begin(),d->Count.end(),0);
+		d->Trace.clear(); d->Dropped=0;
+	}
+}
+
+KProfileData *KProfile::Data()
+{
+	// the data of this thread, registered on first use and kept for the run
+	if(Local==NULL)
+	{
+		KProfileData *d=new KProfileData();
+		d->Time.resize(kNTimers,0); d->Calls.resize(kNTimers,0);
+		d->Count.resize(kNCounters+2*kNStops,0); d->Dropped=0;
+		std::lock_guard<std::mutex> lk(Lock);
+		d->Tid=(Int_t)Threads.size();
+		Threads.push_back(d);
+		Local=d;
+	}
+	return Local;
+}
+
+KProfileTimer::~KProfileTimer()
+{
+	if(T<0 || !KProfile::IsOn()) return;
+	Double_t dt=KProfile::Now()-T;
+	KProfileData *d=KProfile::Data();
+	d->Time[Id]+=dt*1e-6; d->Calls[Id]++;
+	if(!KProfile::IsTracing()) return;
+	if((Long64_t)d->Trace.size()<3*KProfile::MaxTrace)
+	{
+		d->Trace.push_back(Id); d->Trace.push_back(T); d->Trace.push_back(dt);
+	}
+	else d->Dropped++;
+}
+
+void KProfile::Print()
+{
+	// Sum of all threads: time per timer and the counters
+	static const char *stops[kNStops]={"","collected","","x low","x high","y low","y high","z low","z high",
+	                                   "no velocity","","max length","trapped","","","","","","","","max steps"};
+	std::vector<Double_t> t(kNTimers,0);
+	std::vector<Long64_t> n(kNTimers,0),c(kNCounters+2*kNStops,0);
+	Double_t wall=Now()*1e-6;
+	Long64_t dropped=0;
+	Int_t i;
+
+	std::lock_guard<std::mutex> lk(Lock);
+	for(size_t k=0;k<Threads.size();k++)
+	{
+		for(i=0;i<kNTimers;i++) {t[i]+=Threads[k]->Time[i]; n[i]+=Threads[k]->Calls[i];}
+		for(i=0;i<kNCounters+2*kNStops;i++) c[i]+=Threads[k]->Count[i];
+		dropped+=Threads[k]->Dropped;
+	}
+	printf("KProfile: %.3f s wall, %d threads\n",wall,(Int_t)Threads.size());
+	printf("  %-26s %12s %12s %12s\n","timer","calls","time [s]","per call [s]");
+	for(i=0;i<kNTimers;i++)
+		if(n[i]>0) printf("  %-26s %12lld %12.4f %12.4g\n",TimerNames[i],n[i],t[i],t[i]/n[i]);
+	printf("  %-26s %12s %12s\n","counter","count","per s");
+	for(i=0;i<kNCounters;i++)
+		if(c[i]>0) printf("  %-26s %12lld %12.4g\n",CounterNames[i],c[i],wall>0?c[i]/wall:0);
+	printf("  %-26s %12s %12s\n","drift stop","drifts","steps");
+	for(i=0;i<kNStops;i++)
+		if(c[kNCounters+2*i]>0)
+			printf("  %2d %-23s %12lld %12lld\n",i,stops[i],c[kNCounters+2*i],c[kNCounters+2*i+1]);
+	if(dropped>0) printf("  %lld scopes not traced (MaxTrace)\n",dropped);
+}
+
+Int_t KProfile::WriteTrace(const char *name)
+{
+	// Chrome trace-event format: a complete event ("ph":"X") per traced
+	// scope, times in us from Start()
+	FILE *f=fopen(name,"w");
+	Long64_t n=0;
+	if(f==NULL) {printf("KProfile: can not write %s\n",name); return -1;}
+	std::lock_guard<std::mutex> lk(Lock);
+	fprintf(f,"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for(size_t k=0;k<Threads.size();k++)
+	{
+		KProfileData *d=Threads[k];
+		fprintf(f,"%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+		        n++>0?",\n":"",d->Tid,d->Tid);
+		for(size_t e=0;e+2<d->Trace.size();e+=3,n++)
+			fprintf(f,",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+			        TimerNames[(Int_t)d->Trace[e]],d->Tid,d->Trace[e+1],d->Trace[e+2]);
+	}
+	fprintf(f,"\n]}\n");
+	fclose(f);
+	printf("KProfile: %lld trace events written to %s\n",n,name);
+	return 0;
+}
+
+
 /***************************************************** 
 atimes : How to multiply the vector with the matrices 
 Modified in this form by GK 4.10.2012
@@ -77,7 +441,9 @@ Modified in this form by GK 4.10.2012
 // #define C1(x,y,z) y3[n]=x+y+z;
 
 
-double *b,*y6,*y2,*y3,*y4,*y5,*y7,*y8; 
+// one set of matrices per thread, so that fields of different detectors
+// can be solved at the same time (KSweep)
+thread_local double *b,*y6,*y2,*y3,*y4,*y5,*y7,*y8; 
 
 
 /**********************************************************
@@ -119,6 +485,29 @@ void asolve(unsigned long n, double b[], double x[], int itrnsp)
 	for(i=1;i<=n;i++) x[i]=(y3[i] != 0.0 ? b[i]/y3[i] : b[i]);
 }
 
+void atimes2D(unsigned long n, int nx, double x[], double r[])
+{
+	// atimes of a planar detector (nz==1): five point stencil without the
+	// z neighbours. Only the first and the last nx rows of the vector
+	// need the bound checks, the same sums as atimes are made
+	unsigned long q,lo=nx+1,hi=n>(unsigned long)nx?n-nx:0;
+	double C,L,D,R,U;
+
+	for(q=1; q<=n; q++)
+	{
+		if(q==lo && lo<=hi)
+			for(; q<=hi; q++)
+				r[q]=y3[q]*x[q]+y2[q]*x[q-1]+y6[q]*x[q-nx]+y4[q]*x[q+1]+y5[q]*x[q+nx];
+		if(q>n) break;
+		C=y3[q]*x[q];
+		if(q>1)          L=y2[q]*x[q-1]; else L=0;
+		if(q>(unsigned long)nx) D=y6[q]*x[q-nx]; else D=0;
+		if(q<n)          R=y4[q]*x[q+1]; else R=0;
+		if(q+nx<=n)      U=y5[q]*x[q+nx]; else U=0;
+		r[q]=C+L+D+R+U;
+	}
+}
+
 void atimes(unsigned long n,int dim[], double x[],double r[],int itrnsp)
 {
 	// This is a function used to multuply the vectors with matrices!
@@ -128,6 +517,7 @@ void atimes(unsigned long n,int dim[], double x[],double r[],int itrnsp)
 	double C,L,D,O,R,U,I;
 
 	nx=dim[0]; ny=dim[1]; nz=dim[2];
+	if(nz==1) {atimes2D(n,nx,x,r); return;}
 
 	for(k=1; k<=nz; k++)
 		for(j=1; j<=ny; j++)          /*mnozenje po stolpcu*/ 
@@ -135,9 +525,9 @@ void atimes(unsigned long n,int dim[], double x[],double r[],int itrnsp)
 			{ 
 				q++;
 				C=y3[q]*x[q];
-				if(q-1>1)       L=y2[q]*x[q-1]; else L=0;
-				if(q-nx>1)      D=y6[q]*x[q-nx]; else D=0;
-				if((q-nx*ny)>1) I=y7[q]*x[q-ny*nx]; else I=0;
+				if(q>1)         L=y2[q]*x[q-1]; else L=0;
+				if(q>nx)        D=y6[q]*x[q-nx]; else D=0;
+				if(q>nx*ny)     I=y7[q]*x[q-ny*nx]; else I=0;
 
 				if(q+1<=n)       R=y4[q]*x[q+1]; else R=0;
 				if(q+nx<=n)      U=y5[q]*x[q+nx]; else U=0;
@@ -152,8 +542,11 @@ void atimes(unsigned long n,int dim[], double x[],double r[],int itrnsp)
 
 
 void linbcg(unsigned long n, int dim[], double b[], double x[], int itol, double tol,
-		int itmax, int *iter, double *err)
+		int itmax, int *iter, double *err, KCheckpoint *ck = NULL)
 {
+	// With ck the state of the iteration is saved every ck->Interval
+	// seconds and a saved state of the same system (n, itol, b and the
+	// diagonal) is continued; the result is the same as without a break.
 	// The main function for electric field calcualtion
 	void asolve(unsigned long n, double b[], double x[], int itrnsp);
 	void atimes(unsigned long n, int dim[],double x[], double r[], int itrnsp);
@@ -164,6 +557,9 @@ void linbcg(unsigned long n, int dim[], double b[], double x[], int itol, double
 	unsigned long j;
 	double ak,akden,bk,bkden,bknum,bnrm,dxnrm,xnrm,zm1nrm,znrm;
 	double *p,*pp,*r,*rr,*z,*zz;
+	unsigned long long sig=0;
+	int resumed=0;
+	KProfileTimer prof(KProfile::kSolver);
 
 	p=dvector(1,n);
 	pp=dvector(1,n);
@@ -173,26 +569,60 @@ void linbcg(unsigned long n, int dim[], double b[], double x[], int itol, double
 	zz=dvector(1,n);
 
 	*iter=0;
-	atimes(n,dim,x,r,0);
-	for (j=1;j<=n;j++) {
-		r[j]=b[j]-r[j];
-		rr[j]=r[j];
-	}
-	atimes(n,dim,r,rr,0); // minimal residual invariant
-	znrm=1.0;
-	if (itol == 1) bnrm=snrm(n,b,itol);
-	else if (itol == 2) {
-		asolve(n,b,z,0);
-		bnrm=snrm(n,z,itol);
-	}
-	else if (itol == 3 || itol == 4) {
-		asolve(n,b,z,0);
-		bnrm=snrm(n,z,itol);
-		asolve(n,r,z,0);
-		znrm=snrm(n,z,itol);
-	} else nrerror("illegal itol in linbcg");
+	bkden=1.0;
+	if (ck != NULL) {
+		std::vector<char> st;
+		unsigned long long sn,ssig;
+		int sitol;
+		size_t pos=0;
+		sig=KCheckpoint::Hash(&b[1],n*sizeof(double),KCheckpoint::Hash(&y3[1],n*sizeof(double)));
+		if (ck->Load(st) && KCheckpoint::Get(st,pos,&sn,sizeof(sn)) && KCheckpoint::Get(st,pos,&sitol,sizeof(sitol)) &&
+		    KCheckpoint::Get(st,pos,&ssig,sizeof(ssig)) && sn == n && sitol == itol && ssig == sig) {
+			resumed=KCheckpoint::Get(st,pos,iter,sizeof(int)) && KCheckpoint::Get(st,pos,&bkden,sizeof(double)) &&
+			        KCheckpoint::Get(st,pos,&znrm,sizeof(double)) && KCheckpoint::Get(st,pos,&bnrm,sizeof(double)) &&
+			        KCheckpoint::Get(st,pos,&x[1],n*sizeof(double)) && KCheckpoint::Get(st,pos,&p[1],n*sizeof(double)) &&
+			        KCheckpoint::Get(st,pos,&pp[1],n*sizeof(double)) && KCheckpoint::Get(st,pos,&r[1],n*sizeof(double)) &&
+			        KCheckpoint::Get(st,pos,&rr[1],n*sizeof(double));
+			if (resumed) printf("linbcg: continuing from iteration %d\n",*iter);
+			else *iter=0;
+		}
+	}
+	if (!resumed) {
+		atimes(n,dim,x,r,0);
+		for (j=1;j<=n;j++) {
+			r[j]=b[j]-r[j];
+			rr[j]=r[j];
+		}
+		atimes(n,dim,r,rr,0); // minimal residual invariant
+		znrm=1.0;
+		if (itol == 1) bnrm=snrm(n,b,itol);
+		else if (itol == 2) {
+			asolve(n,b,z,0);
+			bnrm=snrm(n,z,itol);
+		}
+		else if (itol == 3 || itol == 4) {
+			asolve(n,b,z,0);
+			bnrm=snrm(n,z,itol);
+			asolve(n,r,z,0);
+			znrm=snrm(n,z,itol);
+		} else nrerror("illegal itol in linbcg");
+	}
 	asolve(n,r,z,0);
 	while (*iter <= itmax) {
+		if (ck != NULL && *iter > 0 && ck->Due()) {
+			// state at the end of an iteration; z follows from r
+			std::vector<char> st;
+			unsigned long long sn=n;
+			st.reserve(5*n*sizeof(double)+64);
+			KCheckpoint::Put(st,&sn,sizeof(sn)); KCheckpoint::Put(st,&itol,sizeof(itol));
+			KCheckpoint::Put(st,&sig,sizeof(sig)); KCheckpoint::Put(st,iter,sizeof(int));
+			KCheckpoint::Put(st,&bkden,sizeof(double)); KCheckpoint::Put(st,&znrm,sizeof(double));
+			KCheckpoint::Put(st,&bnrm,sizeof(double));
+			KCheckpoint::Put(st,&x[1],n*sizeof(double)); KCheckpoint::Put(st,&p[1],n*sizeof(double));
+			KCheckpoint::Put(st,&pp[1],n*sizeof(double)); KCheckpoint::Put(st,&r[1],n*sizeof(double));
+			KCheckpoint::Put(st,&rr[1],n*sizeof(double));
+			ck->Save(st);
+		}
 		++(*iter);
 		zm1nrm=znrm;
 		asolve(n,rr,zz,1);
@@ -245,6 +675,7 @@ void linbcg(unsigned long n, int dim[], double b[], double x[], int itol, double
 
 		if (*err <= tol) break;
 	}
+	KProfile::Add(KProfile::kIterations,*iter);
 
 	free_dvector(p,1,n);
 	free_dvector(pp,1,n);
@@ -255,6 +686,19 @@ void linbcg(unsigned long n, int dim[], double b[], double x[], int itol, double
 }
 
 // KStruct 
+class KSignal;
+
+class KCarrier
+{
+	public:
+		Float_t x,y,z;   // position [um]
+		Double_t t;      // creation time [s]
+		Float_t q;       // charge (of each carrier of the pair)
+		ULong64_t Key;   // random stream key (set by the avalanche driver)
+
+		KCarrier(Double_t px, Double_t py, Double_t pz, Double_t pt, Float_t pq) {x=px; y=py; z=pz; t=pt; q=pq; Key=0;};
+};
+
 class KStruct
 
 {
@@ -262,35 +706,98 @@ class KStruct
 		Int_t PCharge;
 		Int_t Steps;
 		Int_t DStrip;
+		Int_t Stop;       // reason the drift ended (ishit of KDetector::Drift)
+		Int_t NField;     // number of electric field evaluations of the drift
+		Int_t Track;      // store the drift path (1) or only the summary (0)
+		KSignal *Signal;  // induced current is streamed here if not NULL
+		Float_t Weight;   // charge of the drifted bucket (for Signal and multiplication)
+		std::vector<KCarrier> Sec;  // secondary pairs from impact ionization (MTresh>1)
 		Float_t Xlenght;
 		Float_t Ylenght;
 		Float_t Zlenght;
 		Float_t TTime;
 		Float_t TCharge;
-		Float_t Xtrack[MAXPOINT];
-		Float_t Ytrack[MAXPOINT];
-		Float_t Ztrack[MAXPOINT];
-		Float_t Charge[MAXPOINT];
-		Float_t Time[MAXPOINT];
-		Float_t Efield[MAXPOINT];
-		Float_t MulCar[MAXPOINT];
+		Float_t *Xtrack;  // the arrays below point into Arena
+		Float_t *Ytrack;
+		Float_t *Ztrack;
+		Float_t *Charge;
+		Float_t *Time;
+		Float_t *Efield;
+		Float_t *MulCar;
 
 
-		KStruct();
-		~KStruct(){};
+		KStruct(Int_t = 256);
+		~KStruct();
 		void Clear();  
+		void Grow(Int_t);
+		inline Int_t Slot(Int_t);
+		Int_t GetSize() {return Size;};
+
+	private:
+		Float_t *Arena;   // one block holding all arrays
+		Int_t Size;       // points per array
+		Int_t Used;       // points written since the last Clear()
+
+		KStruct(const KStruct &);
+		KStruct &operator=(const KStruct &);
 };
 
-KStruct::KStruct()
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KStruct                                                              //
+//                                                                      //
+// Drift path of one carrier. The arrays share one block that grows on  //
+// demand and is kept between drifts, so reusing a KStruct costs no     //
+// allocation. Points are claimed with Slot() and Clear() resets only   //
+// the claimed ones, everything else stays zero. With Track=0 only the  //
+// start point and the last step are kept (Slot() returns 0 or 1).      //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KStruct::KStruct(Int_t size)
 {
+	Arena=NULL; Size=0; Used=0; Track=1;
+	Signal=NULL; Weight=1;
+	Xtrack=Ytrack=Ztrack=Charge=Time=Efield=MulCar=NULL;
+	Grow(size>2?size:2);
 	Clear();
 }
 
+KStruct::~KStruct()
+{
+	if(Arena!=NULL) delete [] Arena;
+}
+
+void KStruct::Grow(Int_t size)
+{
+	// Enlarges the arrays to at least size points keeping the contents
+	Int_t i,n=Size;
+	if(size<=Size) return;
+	while(n<size) n=n>0?2*n:size;
+	Float_t *a=new Float_t [7*n]();
+	Float_t **arr[7]={&Xtrack,&Ytrack,&Ztrack,&Charge,&Time,&Efield,&MulCar};
+	for(i=0;i<7;i++)
+	{
+		if(Arena!=NULL) memcpy(a+i*n,*arr[i],Size*sizeof(Float_t));
+		*arr[i]=a+i*n;
+	}
+	if(Arena!=NULL) delete [] Arena;
+	Arena=a; Size=n;
+}
+
+inline Int_t KStruct::Slot(Int_t st)
+{
+	// Index where step st is stored
+	if(!Track) st=st>0;
+	else if(st>=Size) Grow(st+1);
+	if(st>=Used) Used=st+1;
+	return st;
+}
 
 void KStruct::Clear()
 {
 	Int_t i = 0;
-	for (i = 0; i < MAXPOINT; i++) {
+	for (i = 0; i < Used; i++) {
 		Xtrack[i] = 0;
 		Ytrack[i] = 0;
 		Ztrack[i] = 0;
@@ -304,7 +811,11 @@ void KStruct::Clear()
 	TTime = 0;
 	Steps = 0;
 	DStrip = 0;
+	Stop = 0;
+	NField = 0;
 	TCharge = 0;
+	Used = 0;
+	Sec.clear();
 }
 
 
@@ -405,7 +916,8 @@ class KGeometry
 		void ElCylinder(Float_t *Pos,Float_t R, Float_t L,Int_t O, Int_t Wei, Int_t Mat); 
 		Int_t SetBoundaryConditions();
 		TH3F *MapToGeometry(Double_t *, Double_t =1);
-		TH3F *GetGeom();
+		TH3F *GetGeom(Int_t=0);
+		TH3F *ElectrodeDistance();
 		Float_t GetLowEdge(Int_t);
 		Float_t GetUpEdge(Int_t);
 		//   ClassDef(KGeometry,1) 
@@ -547,6 +1059,7 @@ void KGeometry::ElCylinder(Float_t *Pos,Float_t R, Float_t L,Int_t O, Int_t Wei,
 Int_t KGeometry::SetBoundaryConditions()
 {
 	Int_t i,j,k,val,cval,nval;
+	KProfileTimer prof(KProfile::kGeometry);
 	if(EG==NULL) {printf("Please set the geometry first ! \n"); return -1;}
 	nx=EG->GetNbinsX();
 	ny=EG->GetNbinsY();
@@ -667,30 +1180,131 @@ TH3F *KGeometry::MapToGeometry(Double_t *x,Double_t Scale)
 	return fhis;
 }
 
-TH3F *KGeometry::GetGeom()
+TH3F *KGeometry::GetGeom(Int_t maxbins)
 {
 	// Map the array of values: E, U, W ... to the geometry.
+	// With maxbins>0 bins are merged so that no axis has more than maxbins
+	// bins (for drawing), a merged bin shows the highest class in it.
 	//
 	int i,j,k,n,bin,col;
-	TH3F *dhis=new TH3F();
-	EG->Copy(*dhis);
+	Int_t g[3]={1,1,1},nn[3]={nx,ny,nz},cn[3];
+	TH3F *dhis;
+
+	for(n=0;n<3;n++)
+	{
+		if(maxbins>0 && nn[n]>maxbins) g[n]=(nn[n]+maxbins-1)/maxbins;
+		cn[n]=(nn[n]+g[n]-1)/g[n];
+	}
+	if(g[0]==1 && g[1]==1 && g[2]==1)
+	{
+		dhis=new TH3F();
+		EG->Copy(*dhis);
+		dhis->Reset();
+	}
+	else
+	{
+		TAxis *ax[3]={EG->GetXaxis(),EG->GetYaxis(),EG->GetZaxis()};
+		Double_t lo[3],hi[3];
+		for(n=0;n<3;n++)
+		{
+			lo[n]=ax[n]->GetBinLowEdge(1);
+			hi[n]=lo[n]+cn[n]*g[n]*ax[n]->GetBinWidth(1);
+		}
+		dhis=new TH3F("geom","",cn[0],lo[0],hi[0],cn[1],lo[1],hi[1],cn[2],lo[2],hi[2]);
+		dhis->SetDirectory(0);
+	}
 
 	for (k=1;k<=nz;k++)
 		for (j=1;j<=ny;j++)
 			for(i=1;i<=nx;i++)
 			{
-				bin=dhis->GetBinContent(i,j,k);
+				bin=EG->GetBinContent(i,j,k);
 				col=0;
 				if(bin>=32768) col=1; 
 				if(bin==1 || bin==2) col=2;
 				if(bin==16385) col=3;		 
-				dhis->SetBinContent(i,j,k,col);
+				n=dhis->GetBin((i-1)/g[0]+1,(j-1)/g[1]+1,(k-1)/g[2]+1);
+				if(col>dhis->GetBinContent(n)) dhis->SetBinContent(n,col);
 			}
 	//  dhis->Draw("glbox");
 	return dhis;
 }
 
 
+TH3F *KGeometry::ElectrodeDistance()
+{
+	// Map of the distance [um] from each bin center to the surface of the
+	// nearest electrode bin (approximated by the bin center distance minus
+	// half of the largest bin size). Bins without any electrode get 1e30.
+	// The euclidean distance transform is separable: the squared distance
+	// is computed along x, then y, then z with the lower envelope of
+	// parabolas (Felzenszwalb & Huttenlocher), which also works for
+	// non-uniform bins.
+	const Double_t INF=1e30;
+	Int_t i,j,k,n,q,m,val,nmax;
+	Int_t nn[3]={nx,ny,nz};
+	Double_t s,half=0;
+	TH3F *dhis=new TH3F();
+	EG->Copy(*dhis);
+
+	nmax=TMath::Max(nx,TMath::Max(ny,nz));
+	std::vector<Double_t> d2(nx*ny*nz),f(nmax),p(nmax),zz(nmax+1),out(nmax);
+	std::vector<Int_t> v(nmax);
+	TAxis *ax[3]={EG->GetXaxis(),EG->GetYaxis(),EG->GetZaxis()};
+
+	for(k=1;k<=nz;k++)
+		for(j=1;j<=ny;j++)
+			for(i=1;i<=nx;i++)
+			{
+				val=EG->GetBinContent(i,j,k);
+				d2[(k-1)*nx*ny+(j-1)*nx+i-1]=(val&1 || val&2 || val>=32768)?0:INF;
+			}
+
+	for(Int_t dir=0;dir<3;dir++)
+	{
+		Int_t len=nn[dir];
+		Int_t stride=dir==0?1:(dir==1?nx:nx*ny);
+		for(q=1;q<=len;q++) {p[q-1]=ax[dir]->GetBinCenter(q); half=TMath::Max(half,ax[dir]->GetBinWidth(q)/2);}
+		for(n=0;n<nx*ny*nz;n++)
+		{
+			// n runs over the first bin of every line along dir
+			if((n/stride)%len!=0) continue;
+			for(q=0;q<len;q++) f[q]=d2[n+q*stride];
+			// lower envelope of the parabolas (p[q]-x)^2+f[q] of finite sites
+			m=-1;
+			for(q=0;q<len;q++)
+			{
+				if(f[q]>=INF) continue;
+				while(m>=0)
+				{
+					s=((f[q]+p[q]*p[q])-(f[v[m]]+p[v[m]]*p[v[m]]))/(2*(p[q]-p[v[m]]));
+					if(s<=zz[m]) m--; else break;
+				}
+				m++; v[m]=q;
+				zz[m]=m==0?-INF:((f[q]+p[q]*p[q])-(f[v[m-1]]+p[v[m-1]]*p[v[m-1]]))/(2*(p[q]-p[v[m-1]]));
+			}
+			if(m<0) continue;  // no electrode on this line
+			zz[m+1]=INF;
+			for(q=0,j=0;q<len;q++)
+			{
+				while(zz[j+1]<p[q]) j++;
+				out[q]=(p[q]-p[v[j]])*(p[q]-p[v[j]])+f[v[j]];
+			}
+			for(q=0;q<len;q++) d2[n+q*stride]=out[q];
+		}
+	}
+
+	for(k=1;k<=nz;k++)
+		for(j=1;j<=ny;j++)
+			for(i=1;i<=nx;i++)
+			{
+				s=d2[(k-1)*nx*ny+(j-1)*nx+i-1];
+				dhis->SetBinContent(i,j,k,s>=INF?INF:TMath::Max(0.,TMath::Sqrt(s)-half));
+			}
+	return dhis;
+}
+
+
 Float_t KGeometry::GetUpEdge(Int_t dir)
 {
 	Float_t ret=0;
@@ -722,31 +1336,83 @@ Float_t KGeometry::GetLowEdge(Int_t dir)
 
 // KMaterial 
 
+#define KMAT_NUM 256   // number of material ids that can be described
+
+class KMatProp
+{
+	public:
+		Float_t Perm;         // relative permittivity
+		Int_t MobMod;         // mobility model (-1 = use KMaterial::Mobility)
+		Float_t Temperature;  // temperature (<0 = use KMaterial::Temperature)
+};
 
 class KMaterial
 {
 	private:
+		KMatProp Props[KMAT_NUM+1];   // material table, the last entry is used for unknown ids
+
 	public:
-		static Int_t Mat;              // Material index
-		static Float_t Temperature;    // Temperature
-		static Int_t Mobility;         // mobility model for each material
-		static Int_t ImpactIonization; // impact ionization model
+		Float_t Temperature;    // Temperature
+		Int_t Mobility;         // mobility model for silicon
+		Int_t ImpactIonization; // impact ionization model
 
 		//////////////////////////////////////////////////////
 
-		KMaterial() { Mat = 1; } // MobMod=1;}
+		KMaterial();
 		~KMaterial(){};
-static Float_t Perm(Int_t = 1);
-static Int_t MobMod();
-// ClassDef(KMaterial, 1)
+		static Float_t Perm(Int_t = 1);
+		void SetMaterial(Int_t, Float_t, Int_t, Float_t = -1);
+		inline const KMatProp &GetMaterial(Int_t Mat) const {return Props[(UInt_t)Mat<KMAT_NUM?Mat:KMAT_NUM];};
+		inline Float_t GetPerm(Int_t Mat) const {return GetMaterial(Mat).Perm;};
+		inline Int_t MobMod(Int_t Mat) const {Int_t m=GetMaterial(Mat).MobMod; return m<0?Mobility:m;};
+		inline Float_t GetTemperature(Int_t Mat) const {Float_t t=GetMaterial(Mat).Temperature; return t<0?Temperature:t;};
+		// ClassDef(KMaterial, 1)
 };
 
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KMaterial                                                            //
+//                                                                      //
+// Material table of the detector indexed by the material id stored in  //
+// KGeometry::DM. Each entry holds the permittivity, the mobility model //
+// and the temperature of the material. The table is filled when the    //
+// detector is configured and only read during the field calculation    //
+// and the drift, so several detectors and threads can use it at once.  //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
 // ClassImp(KMaterial)
-Int_t KMaterial::Mat = 1;
-Float_t KMaterial::Temperature = 293;
-Int_t KMaterial::Mobility = 1;
+KMaterial::KMaterial()
+{
+	Int_t i;
+	Temperature=293;
+	Mobility=1;
+	ImpactIonization=0;
+
+	// materials without free carriers have zero mobility (model 9)
+	for(i=0;i<=KMAT_NUM;i++) SetMaterial(i,Perm(i),9);
+
+	SetMaterial(0,Perm(0),-1);   //silicon
+	SetMaterial(1,Perm(1),8);    //poly silicon
+	SetMaterial(2,Perm(2),9);    //silicon oxide
+	SetMaterial(10,Perm(10),10); //diamond
+	SetMaterial(20,Perm(20),9);  //air
+	SetMaterial(100,Perm(100),9);//aluminium
+}
+
+void KMaterial::SetMaterial(Int_t Mat, Float_t perm, Int_t mobmod, Float_t T)
+{
+	// Sets the properties of material Mat; mobmod=-1 uses the Mobility
+	// model of the detector, T<0 the temperature of the detector.
+	if(Mat<0 || Mat>KMAT_NUM) {printf("Material index %d out of range!\n",Mat); return;}
+	Props[Mat].Perm=perm;
+	Props[Mat].MobMod=mobmod;
+	Props[Mat].Temperature=T;
+}
+
 Float_t KMaterial::Perm(Int_t Material)
 {
+	// default relative permittivity of the material
 	Float_t perm;
 	switch (Material) {
 		case 0:
@@ -775,42 +1441,48 @@ Float_t KMaterial::Perm(Int_t Material)
 }
 
 
-Int_t KMaterial::MobMod()
-{
-	Int_t ret;
-	switch (Mat) {
-		case 0:
-			ret = Mobility;
-			break; //if(Mobility==1) ret=1; else ret=0; break; //silicon
-		case 1:
-			ret = 8;
-			break; //poly silicon
-		case 2:
-			ret = 9;
-			break; //silicon oxide 2.648
-		case 10:
-			ret = 10;
-			break; //diamond
-	}
-	return ret;
-}
+// KField 
 
+class KField;
 
-// KField 
+class KFieldGrid
+{
+	public:
+		Int_t dim;             // dimension of the field (2 or 3)
+		Int_t nx,ny,nz;        // number of bins
+		Double_t x0,y0,z0;     // centers of the first bins
+		Double_t idx,idy,idz;  // inverse bin widths
+		Float_t *Ex,*Ey,*Ez;   // field at the bin centers (x runs fastest)
+		Float_t *U;            // potential at the bin centers
+		Int_t Valid;           // 0 if the histograms have variable bins
+
+		KFieldGrid(KField *);
+		~KFieldGrid();
+		void Field(Int_t, const Double_t *, const Double_t *, const Double_t *, Float_t *, Float_t *, Float_t *, Float_t *) const;
+		void Potential(Int_t, const Double_t *, const Double_t *, const Double_t *, Float_t *) const;
+};
 
 class KField
 {
 	private:
 		Int_t Method;   // Method to calculate the intermediate points
 		Int_t dim;
+		// 2D (nz==1): flat copy of U, Ex and Ey with a ring of empty bins
+		Int_t Nx,Ny;          // bins of the plane
+		Double_t Ax[2],Ay[2]; // ranges of the x and y axes
+		Double_t *Cx,*Cy;     // bin centers 0..Nx+1 and 0..Ny+1
+		Float_t *Plane;       // U, Ex, Ey of bin (i,j) at 3*(i+(Nx+2)*j)
+		Int_t CalField2D();
+		void Interpolate2D(Float_t, Float_t, Int_t, Int_t, Float_t *);
 	public:
 		TH3F *U;
 		TH3F *Ex;
 		TH3F *Ey;
 		TH3F *Ez;
 		TH3F *E;
+		KFieldGrid *Grid;   // flat copy of U and E for the batched drift
 
-		KField() {U=NULL; Ex=NULL; Ey=NULL; Ez=NULL;};
+		KField() {U=NULL; Ex=NULL; Ey=NULL; Ez=NULL; E=NULL; Grid=NULL; Cx=NULL; Cy=NULL; Plane=NULL;};
 		~KField();
 		Int_t CalField();
 		static Float_t GetFieldPoint(Float_t *, Float_t *);
@@ -820,7 +1492,10 @@ class KField
 		Float_t CalPotXYZ(Float_t x, Float_t y, Float_t z);
 		Double_t DriftVelocity(Float_t E,Float_t Charg, Float_t T, Double_t Neff, Int_t which);
 		Double_t Mobility(Float_t E,Float_t T,Float_t Charg,Double_t Neff, Int_t which);
+		static Double_t Alpha(Float_t E,Float_t T,Float_t Charg, Int_t which);
 		Float_t KInterpolate2D(TH3F *, Float_t ,Float_t, Int_t=3, Int_t=1);
+		KFieldGrid *GetFieldGrid();
+		Int_t GetDim() {return dim;};
 
 		//   ClassDef(KField,1) 
 };
@@ -831,6 +1506,9 @@ KField::~KField()
 	if(Ex!=NULL) delete Ex; 
 	if(Ey!=NULL) delete Ey; 
 	if(Ez!=NULL) delete Ez;
+	if(E!=NULL) delete E;
+	if(Grid!=NULL) delete Grid;
+	if(Plane!=NULL) {delete [] Plane; delete [] Cx; delete [] Cy;}
 }
 
 Float_t KField::KInterpolate2D(TH3F *his, Float_t x, Float_t y, Int_t dir, Int_t bin)
@@ -893,6 +1571,7 @@ Int_t KField::CalField()
 {
 	Float_t X[3],Y[3],EE;
 	Int_t q,i,j,k;
+	KProfileTimer prof(KProfile::kGradient);
 
 	if(U==NULL) 
 	{printf("Can not calculate field - no potential array!"); return -1;};
@@ -903,6 +1582,10 @@ Int_t KField::CalField()
 
 	if(nz==1) {printf("2D field!\n"); dim=2;} else dim=3;
 
+	if(Grid!=NULL) {delete Grid; Grid=NULL;}
+	if(Plane!=NULL) {delete [] Plane; delete [] Cx; delete [] Cy; Plane=NULL;}
+	if(dim==2 && U->GetXaxis()->GetXbins()->GetSize()==0 && U->GetYaxis()->GetXbins()->GetSize()==0)
+		return CalField2D();
 
 
 	Ex=new TH3F(); U->Copy(*Ex); Ex->Reset();
@@ -963,23 +1646,108 @@ Int_t KField::CalField()
 	return 0;
 }
 
-Float_t KField::GetFieldPoint(Float_t *X, Float_t *Y)
+Int_t KField::CalField2D()
 {
-	Float_t a,b,k12,k23;
-	k12=(Y[0]-Y[1])/(X[0]-X[1]);
-	k23=(Y[1]-Y[2])/(X[1]-X[2]);
-	a=(k23-k12)/(X[2]-X[0]);
-	b=k12-a*(X[0]+X[1]);
-	return 2*a*X[1]+b;
-}
-
+	// Field of a planar detector on the flat plane: no z loop and no Ez,
+	// the histograms Ex, Ey and E are filled from the plane at the end.
+	// The values are those of the 3D loop of CalField.
+	Float_t X[3],Y[3];
+	Int_t q,i,j,k,w;
+	TAxis *ax=U->GetXaxis(), *ay=U->GetYaxis();
+
+	Nx=ax->GetNbins(); Ny=ay->GetNbins(); w=Nx+2;
+	Ax[0]=ax->GetXmin(); Ax[1]=ax->GetXmax();
+	Ay[0]=ay->GetXmin(); Ay[1]=ay->GetXmax();
+	Cx=new Double_t [Nx+2]; Cy=new Double_t [Ny+2];
+	for(i=0;i<=Nx+1;i++) Cx[i]=ax->GetBinCenter(i);
+	for(j=0;j<=Ny+1;j++) Cy[j]=ay->GetBinCenter(j);
+	Plane=new Float_t [3*w*(Ny+2)];
+	for(i=0;i<3*w*(Ny+2);i++) Plane[i]=0;
+	for(j=1;j<=Ny;j++)
+		for(i=1;i<=Nx;i++) Plane[3*(i+w*j)]=U->GetBinContent(i,j,1);
+
+	for(j=1;j<=Ny;j++)
+		for(i=1;i<=Nx;i++)
+		{
+			q=3*(i+w*j);
+			if(i>1 && i<Nx)
+			{
+				for(k=0;k<=2;k++) {X[k]=Cx[i+k-1]; Y[k]=Plane[q+3*(k-1)];}
+				Plane[q+1]=GetFieldPoint(X,Y);
+			}
+			if(j>1 && j<Ny)
+			{
+				for(k=0;k<=2;k++) {X[k]=Cy[j+k-1]; Y[k]=Plane[q+3*w*(k-1)];}
+				Plane[q+2]=GetFieldPoint(X,Y);
+			}
+		}
 
-void  KField::CalFieldXYZ(Float_t x, Float_t y, Float_t z, Float_t *E)
-{
-	if(dim==2)
+	Ex=new TH3F(); U->Copy(*Ex); Ex->Reset();
+	Ey=new TH3F(); U->Copy(*Ey); Ey->Reset();
+	E=new TH3F(); U->Copy(*E);  E->Reset();
+	Ez=NULL;
+	for(j=1;j<=Ny;j++)
+		for(i=1;i<=Nx;i++)
+		{
+			q=3*(i+w*j);
+			Ex->SetBinContent(i,j,1,Plane[q+1]);
+			Ey->SetBinContent(i,j,1,Plane[q+2]);
+			E->SetBinContent(i,j,1,(Float_t)TMath::Sqrt(TMath::Power((Double_t)Plane[q+1],2)+TMath::Power((Double_t)Plane[q+2],2)));
+		}
+
+	return 0;
+}
+
+void KField::Interpolate2D(Float_t x, Float_t y, Int_t first, Int_t n, Float_t *v)
+{
+	// KInterpolate2D of the values first..first+n-1 of the plane, the
+	// bins are searched once for all of them
+	Int_t EX1,EX2,EY1,EY2,k,q11,q21,q22,q12,w=Nx+2;
+	Float_t t,u,ret;
+
+	if(x<Ax[0]) EX1=0; else if(!(x<Ax[1])) EX1=Nx+1; else EX1=1+(Int_t)(Nx*(x-Ax[0])/(Ax[1]-Ax[0]));
+	if(Cx[EX1]<=x) {EX2=EX1+1;} else {EX2=EX1; EX1--;}
+	if(y<Ay[0]) EY1=0; else if(!(y<Ay[1])) EY1=Ny+1; else EY1=1+(Int_t)(Ny*(y-Ay[0])/(Ay[1]-Ay[0]));
+	if(Cy[EY1]<=y) {EY2=EY1+1;} else {EY2=EY1; EY1--;}
+
+	if(EY2>Ny) {u=0; EY2=Ny;} else
+		if(EY1<1) {u=0; EY1=1;} else
+			u=(y-Cy[EY1])/(Cy[EY2]-Cy[EY1]);
+
+	if(EX2>Nx) {t=0; EX2=Nx;} else
+		if(EX1<1) {t=0; EX1=1;} else
+			t=(x-Cx[EX1])/(Cx[EX2]-Cx[EX1]);
+
+	q11=3*(EX1+w*EY1)+first; q21=3*(EX2+w*EY1)+first;
+	q22=3*(EX2+w*EY2)+first; q12=3*(EX1+w*EY2)+first;
+	for(k=0;k<n;k++)
+	{
+		ret=(1-t)*(1-u)*Plane[q11+k];
+		ret+=t*(1-u)*Plane[q21+k];
+		ret+=t*u*Plane[q22+k];
+		ret+=(1-t)*u*Plane[q12+k];
+		v[k]=ret;
+	}
+}
+
+Float_t KField::GetFieldPoint(Float_t *X, Float_t *Y)
+{
+	Float_t a,b,k12,k23;
+	k12=(Y[0]-Y[1])/(X[0]-X[1]);
+	k23=(Y[1]-Y[2])/(X[1]-X[2]);
+	a=(k23-k12)/(X[2]-X[0]);
+	b=k12-a*(X[0]+X[1]);
+	return 2*a*X[1]+b;
+}
+
+
+void  KField::CalFieldXYZ(Float_t x, Float_t y, Float_t z, Float_t *E)
+{
+	KProfile::Add(KProfile::kFieldXYZ);
+	if(dim==2)
 	{
-		E[1]=KInterpolate2D(Ex,x,y);
-		E[2]=KInterpolate2D(Ey,x,y);
+		if(Plane!=NULL) Interpolate2D(x,y,1,2,&E[1]);
+		else {E[1]=KInterpolate2D(Ex,x,y); E[2]=KInterpolate2D(Ey,x,y);}
 		E[3]=0;
 	}
 	else
@@ -1015,9 +1783,14 @@ Double_t KField::DriftVelocity(Float_t E,Float_t Charg, Float_t T, Double_t Neff
 
 Float_t KField::CalPotXYZ(Float_t x, Float_t y, Float_t z)
 {
+	KProfile::Add(KProfile::kPotXYZ);
 	Float_t ret=0;
 	Int_t nx,ny,nz,bx,by,bz;
-	if(dim==2) ret=KInterpolate2D(U,x,y);
+	if(dim==2)
+	{
+		if(Plane!=NULL) Interpolate2D(x,y,0,1,&ret);
+		else ret=KInterpolate2D(U,x,y);
+	}
 	else 
 	{
 		nz=U->GetZaxis()->GetNbins(); 
@@ -1041,6 +1814,7 @@ Double_t KField::Mobility(Float_t E,Float_t T,Float_t Charg,Double_t Neff, Int_t
 	Double_t vsatn,vsatp,vsat;
 	Double_t betap,betan;
 	Double_t alpha;
+	KProfile::Add(KProfile::kMobility);
 
 	switch(which)
 	{
@@ -1161,871 +1935,5387 @@ Double_t KField::Mobility(Float_t E,Float_t T,Float_t Charg,Double_t Neff, Int_t
 			hfm=lfm/(1+(lfm*E)/vsat);
 			break;
 	}
-	return hfm; 
+	return hfm;
 }
 
 
+Double_t KField::Alpha(Float_t E,Float_t T,Float_t Charg, Int_t which)
+{
+	// Impact ionization coefficient [1/cm] at the field E [V/cm]
+	// which = 0 : van Overstraeten - de Man (silicon, with temperature scaling)
+	//         1 : Massey (silicon)
+	//         2 : Hatakeyama (4H-SiC, field along the c-axis)
+	Double_t a,b,gamma;
+	if(E<=0) return 0;
+	switch(which)
+	{
+		case 1:
+			if(Charg>0) {a=1.13e6; b=1.71e6+1.09e3*T;}
+			else {a=4.43e5; b=9.66e5+4.99e2*T;}
+			return a*TMath::Exp(-b/E);
+		case 2:
+			if(Charg>0) {a=3.41e8; b=2.50e7;}
+			else {a=1.76e8; b=3.30e7;}
+			return a*TMath::Exp(-b/E);
+		case 0:
+		default:
+			gamma=TMath::TanH(0.063/(2*Kboltz*300))/TMath::TanH(0.063/(2*Kboltz*T));
+			if(Charg>0)
+			{
+				if(E<4e5) {a=1.582e6; b=2.036e6;} else {a=6.71e5; b=1.693e6;}
+			}
+			else {a=7.03e5; b=1.231e6;}
+			return gamma*a*TMath::Exp(-gamma*b/E);
+	}
+}
 
 
-// KDetector 
-
-#include "TRandom.h"
-#include "TF3.h"
+// KFieldGrid
 
-class KDetector : public KGeometry, public KMaterial { 
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KFieldGrid                                                           //
+//                                                                      //
+// Flat float arrays of the potential and field components of a KField  //
+// with index arithmetic in place of TH3F lookups, so that many points  //
+// can be interpolated in one vectorizable loop. The results follow     //
+// KField::CalFieldXYZ and KField::CalPotXYZ: positions are rounded to  //
+// float, the 3D field is zero outside the bin-center domain (as        //
+// TH3F::Interpolate), the 2D field and the potential are clamped to    //
+// the edge bins.                                                       //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
+KFieldGrid::KFieldGrid(KField *f)
+{
+	Int_t i,j,k,n;
+	TAxis *ax=f->U->GetXaxis(), *ay=f->U->GetYaxis(), *az=f->U->GetZaxis();
 
-	private:
-		Double_t Deps;
-		TRandom *ran;               //random number generator
-		Double_t CalErr;               //Error of the solver
-		Int_t MaxIter;              //Maximum number of iterations in eq solver
-		Short_t Debug;              //Print information of drift calculation etc.
+	dim=f->GetDim();
+	nx=ax->GetNbins(); ny=ay->GetNbins(); nz=az->GetNbins();
+	Valid=(ax->GetXbins()->GetSize()==0 && ay->GetXbins()->GetSize()==0 && az->GetXbins()->GetSize()==0);
+	x0=ax->GetBinCenter(1); y0=ay->GetBinCenter(1); z0=az->GetBinCenter(1);
+	idx=1./ax->GetBinWidth(1); idy=1./ay->GetBinWidth(1); idz=1./az->GetBinWidth(1);
 
-	public:
-		Float_t Voltage;  //Voltage
-		Float_t Voltage2; //Voltage2 
-		TArrayF Voltages; //Array of voltages
+	n=nx*ny*nz;
+	Ex=new Float_t [n]; Ey=new Float_t [n]; Ez=new Float_t [n]; U=new Float_t [n];
+	for(k=1;k<=nz;k++)
+		for(j=1;j<=ny;j++)
+			for(i=1;i<=nx;i++)
+			{
+				n=(i-1)+nx*((j-1)+ny*(k-1));
+				Ex[n]=f->Ex->GetBinContent(i,j,k);
+				Ey[n]=f->Ey->GetBinContent(i,j,k);
+				Ez[n]=f->Ez!=NULL?f->Ez->GetBinContent(i,j,k):0;
+				U[n]=f->U->GetBinContent(i,j,k);
+			}
+}
 
-		// Definition of space charge 
-		TF3     *NeffF;     //effective dopping concentration function
-		TH3F    *NeffH;     //effective dopping concentration histogram
+KFieldGrid::~KFieldGrid()
+{
+	delete [] Ex; delete [] Ey; delete [] Ez; delete [] U;
+}
 
-		// Weigthing, electric and magnetic field
-		KField *Ramo;       // ramo field 
-		KField *Real;       // electric field
-		Float_t B[3];      // magnetic field
+void KFieldGrid::Field(Int_t n, const Double_t *x, const Double_t *y, const Double_t *z, Float_t *ex, Float_t *ey, Float_t *ez, Float_t *e) const
+{
+	// field components and magnitude at n points
+	KProfile::Add(KProfile::kGridPoints,n);
+	Int_t m,i,j,k,q,sy=nx,sz=nx*ny;
+	Double_t fx,fy,fz,u,v,w,in;
 
-		// Trapping and variables used for multiplication studies
-		Float_t taue;      // effective trapping time constants 
-		Float_t tauh;      // effective trapping time constants 
-		TF3 *TauE;         // Function of TauE(x,y,z);
-		TF3 *TauH;         // Function of TauH(x,y,z);
+	if(dim==2)
+		for(m=0;m<n;m++)
+		{
+			fx=((Float_t)x[m]-x0)*idx; fx=fx<0?0:(fx>nx-1?nx-1:fx);
+			fy=((Float_t)y[m]-y0)*idy; fy=fy<0?0:(fy>ny-1?ny-1:fy);
+			i=(Int_t)fx; i=i<nx-2?i:nx-2; i=i>0?i:0; u=fx-i;
+			j=(Int_t)fy; j=j<ny-2?j:ny-2; j=j>0?j:0; v=fy-j;
+			q=i+sy*j;
+			ex[m]=(1-u)*(1-v)*Ex[q]+u*(1-v)*Ex[q+1]+(1-u)*v*Ex[q+sy]+u*v*Ex[q+sy+1];
+			ey[m]=(1-u)*(1-v)*Ey[q]+u*(1-v)*Ey[q+1]+(1-u)*v*Ey[q+sy]+u*v*Ey[q+sy+1];
+			ez[m]=0;
+			e[m]=sqrt(ex[m]*ex[m]+ey[m]*ey[m]);
+		}
+	else
+		for(m=0;m<n;m++)
+		{
+			fx=((Float_t)x[m]-x0)*idx; fy=((Float_t)y[m]-y0)*idy; fz=((Float_t)z[m]-z0)*idz;
+			in=(fx>=0 && fx<nx-1 && fy>=0 && fy<ny-1 && fz>=0 && fz<nz-1);
+			fx=in?fx:0; fy=in?fy:0; fz=in?fz:0;
+			i=(Int_t)fx; j=(Int_t)fy; k=(Int_t)fz;
+			u=fx-i; v=fy-j; w=fz-k;
+			q=i+sy*j+sz*k;
+			ex[m]=in*((1-w)*((1-v)*((1-u)*Ex[q]+u*Ex[q+1])+v*((1-u)*Ex[q+sy]+u*Ex[q+sy+1]))
+				+w*((1-v)*((1-u)*Ex[q+sz]+u*Ex[q+sz+1])+v*((1-u)*Ex[q+sz+sy]+u*Ex[q+sz+sy+1])));
+			ey[m]=in*((1-w)*((1-v)*((1-u)*Ey[q]+u*Ey[q+1])+v*((1-u)*Ey[q+sy]+u*Ey[q+sy+1]))
+				+w*((1-v)*((1-u)*Ey[q+sz]+u*Ey[q+sz+1])+v*((1-u)*Ey[q+sz+sy]+u*Ey[q+sz+sy+1])));
+			ez[m]=in*((1-w)*((1-v)*((1-u)*Ez[q]+u*Ez[q+1])+v*((1-u)*Ez[q+sy]+u*Ez[q+sy+1]))
+				+w*((1-v)*((1-u)*Ez[q+sz]+u*Ez[q+sz+1])+v*((1-u)*Ez[q+sz+sy]+u*Ez[q+sz+sy+1])));
+			e[m]=sqrt(ex[m]*ex[m]+ey[m]*ey[m]+ez[m]*ez[m]);
+		}
+}
 
-		Int_t BreakDown;     // if break down occurs it goes to 1 otherwise is 0
-		Float_t MTresh;      // treshold for taking multiplication into account
-		Float_t BDTresh;     // hole multiplication - break down treshold 
-		Float_t DiffOffField;// electric field where diffusion is switched off [V/um] !!
-		// Drift parameters
+void KFieldGrid::Potential(Int_t n, const Double_t *x, const Double_t *y, const Double_t *z, Float_t *pot) const
+{
+	// potential at n points, clamped to the edge bins
+	KProfile::Add(KProfile::kGridPoints,n);
+	Int_t m,i,j,k,q,sy=nx,sz=(dim==2 || nz==1)?0:nx*ny;
+	Double_t fx,fy,fz,u,v,w;
 
-		Float_t enp[3];      //entry point for the charge drift
-		Float_t exp[3];      //exit point for the cahrge drift
-		Int_t diff;          // Diffusion simulation (yes=1, no=0)
-		Int_t average;       // Average (over how many events)
-		Float_t SStep;       // Simulation step size;
-		Float_t MaxDriftLen; // Maximum drift lenght before stopping the drift
+	for(m=0;m<n;m++)
+	{
+		fx=((Float_t)x[m]-x0)*idx; fx=fx<0?0:(fx>nx-1?nx-1:fx);
+		fy=((Float_t)y[m]-y0)*idy; fy=fy<0?0:(fy>ny-1?ny-1:fy);
+		fz=((Float_t)z[m]-z0)*idz; fz=fz<0?0:(fz>nz-1?nz-1:fz);
+		i=(Int_t)fx; i=i<nx-2?i:nx-2; i=i>0?i:0; u=fx-i;
+		j=(Int_t)fy; j=j<ny-2?j:ny-2; j=j>0?j:0; v=fy-j;
+		k=(Int_t)fz; k=k<nz-2?k:nz-2; k=k>0?k:0; w=sz?fz-k:0;
+		q=i+sy*j+sz*k;
+		pot[m]=(1-w)*((1-v)*((1-u)*U[q]+u*U[q+1])+v*((1-u)*U[q+sy]+u*U[q+sy+1]))
+			+w*((1-v)*((1-u)*U[q+sz]+u*U[q+sz+1])+v*((1-u)*U[q+sz+sy]+u*U[q+sz+sy+1]));
+	}
+}
 
-		// Output histograms
-		TH1F *pos;           // contribution of the holes to the total drift current
-		TH1F *neg;           // contribution of the electrons  to the total drift current
-		TH1F *sum;	       // total drift current
+KFieldGrid *KField::GetFieldGrid()
+{
+	// flat copy of the field, built on first use
+	if(Grid==NULL && U!=NULL && Ex!=NULL) Grid=new KFieldGrid(this);
+	return Grid;
+}
 
-		// Constructors and destructor
-		KDetector();
-		~KDetector();
-		//_______________________________________________________________________________
-		void SetDriftHisto(Float_t x,Int_t=200);
-		// start declaration followed by solving Poisson's equation.
-		void CalField(Int_t);         
-		void Declaration(Int_t);                 // declaration of boundary conditions
-		Double_t V(int ,int);                    // defining voltage
-		Double_t kappa(int ,int , int , int);    // defining space charge
 
-		void ShowMipIR(Int_t, Int_t=14, Int_t=1);
-		void ShowUserIonization(Int_t, Float_t *, Float_t *, Float_t *, Float_t *, Int_t=14, Int_t=1);
-		void Drift(Double_t, Double_t, Double_t, Float_t, KStruct *, Double_t = 0);
+// KVelocityTable
 
+#include <map>
+#include <unordered_map>
+#include <mutex>
 
+class KVelocityTable
+{
+	private:
+		Int_t N;            // number of intervals in |E|
+		Float_t Emax;       // upper end of the table [V/um]
+		Float_t dE;         // sampling step [V/um]
+		Float_t idE;        // inverse of the sampling step
+		Float_t *V;         // drift velocity at the nodes [cm/s]
+		Float_t *M;         // mobility at the nodes [cm^2/Vs]
+		KField *Field;      // field class used for the exact evaluation
 
-		//Configuration functions 
-		// ClassDef(KDetector,1) 
+	public:
+		Int_t Which;        // mobility model
+		Float_t Charg;      // carrier charge (sign)
+		Float_t T;          // temperature
+		Double_t Neff;      // effective doping the table was sampled at
+		Float_t Tol;        // relative interpolation error reached (w.r.t. max velocity)
+
+		KVelocityTable(KField *, Int_t, Float_t, Float_t, Double_t, Float_t = 1e-4, Float_t = 100);
+		~KVelocityTable();
+		inline Double_t Velocity(Float_t E) const;
+		inline Double_t Mobility(Float_t E) const;
+		void Eval(Int_t, const Float_t *, Float_t *, Float_t * = NULL) const;
+		Int_t GetN() const {return N;};
 };
 
-#include "TPolyLine3D.h"
-// #include "KDetector.h"
-#include "TFile.h"
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KVelocityTable                                                       //
+//                                                                      //
+// Drift velocity and mobility of one carrier type sampled on a         //
+// uniform grid in |E| for a fixed (model, T, Neff). The grid is        //
+// refined until linear interpolation reproduces KField::Mobility       //
+// within the requested tolerance at the interval mid and quarter       //
+// points. Fields above Emax are evaluated exactly.                     //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
-#define ABS(x) x>0?x:-x
-#define PREDZNAK(x) x>0?1:-1
+KVelocityTable::KVelocityTable(KField *field, Int_t which, Float_t charg, Float_t t, Double_t neff, Float_t tol, Float_t emax)
+{
+	Int_t i,j;
+	Double_t e,vi,mi,err,errm,vmax,mmax;
 
-#define C1(x,y,z) y3[n]=x+y+z;
+	Field=field; Which=which; Charg=charg; T=t; Neff=neff; Emax=emax;
+	V=NULL; M=NULL;
 
-#define L1(x) y2[n]=x;
-#define R1(x) y4[n]=x;
-#define U1(x) y5[n]=x;
-#define D1(x) y6[n]=x;
-#define I1(x) y7[n]=x;
-#define O1(x) y8[n]=x;
+	for(N=256; N<=(1<<20); N*=2)
+	{
+		// models that are singular at high fields (e.g. Klanner Scharf holes)
+		// do not converge - shrink the table and evaluate above it exactly
+		if(N==(1<<16) && Emax>1) {Emax/=2; N=128; continue;}
+
+		if(V!=NULL) delete [] V;
+		if(M!=NULL) delete [] M;
+		V=new Float_t [N+1];
+		M=new Float_t [N+1];
+		dE=Emax/N; idE=N/Emax;
+
+		vmax=0; mmax=0;
+		for(i=0;i<=N;i++)
+		{
+			V[i]=Field->DriftVelocity(i*dE,Charg,T,Neff,Which);
+			M[i]=Field->Mobility(i*dE*1e4,T,Charg,Neff,Which);
+			if(TMath::Abs(V[i])>vmax) vmax=TMath::Abs(V[i]);
+			if(TMath::Abs(M[i])>mmax) mmax=TMath::Abs(M[i]);
+		}
 
-#define L2(x) y2[n]=2*x;
-#define R2(x) y4[n]=2*x;
-#define U2(x) y5[n]=2*x;
-#define D2(x) y6[n]=2*x;
-#define I2(x) y7[n]=2*x;
-#define O2(x) y8[n]=2*x;
+		// check the interpolation error inside each interval
+		err=0; errm=0;
+		for(i=0;i<N;i++)
+			for(j=1;j<=3;j++)
+			{
+				e=(i+0.25*j)*dE;
+				vi=Field->DriftVelocity(e,Charg,T,Neff,Which);
+				mi=Field->Mobility(e*1e4,T,Charg,Neff,Which);
+				if(TMath::Abs(Velocity(e)-vi)>err) err=TMath::Abs(Velocity(e)-vi);
+				if(TMath::Abs(Mobility(e)-mi)>errm) errm=TMath::Abs(Mobility(e)-mi);
+			}
+		if(vmax>0) err/=vmax;
+		if(mmax>0) errm/=mmax;
+		if(errm>err) err=errm;
+		Tol=err;
+		if(err<=tol) break;
+	}
 
-#define C0 y3[n]=1.;
-#define U0 y5[n]=0.;
-#define D0 y6[n]=0.;
-#define R0 y4[n]=0.;
-#define L0 y2[n]=0.;
-#define I0 y7[n]=0.;
-#define O0 y8[n]=0.;
+	if(N>(1<<20)) {N/=2; printf("Warning: velocity table (model %d) reached %e instead of %e !\n",Which,Tol,tol);}
+}
 
-#define  PI  3.1415927
-#define EPS 1.0e-14
-#define STEP_DET_CUR 25e-9
+KVelocityTable::~KVelocityTable()
+{
+	if(V!=NULL) delete [] V;
+	if(M!=NULL) delete [] M;
+}
 
-// ClassImp(KDetector)
+inline Double_t KVelocityTable::Velocity(Float_t E) const
+{
+	// drift velocity [cm/s] for |E| in [V/um]
+	if(E>=Emax) return Field->DriftVelocity(E,Charg,T,Neff,Which);
+	Float_t x=E*idE;
+	Int_t i=(Int_t)x;
+	if(i>=N) i=N-1;
+	return V[i]+(x-i)*(V[i+1]-V[i]);
+}
+
+inline Double_t KVelocityTable::Mobility(Float_t E) const
+{
+	// mobility [cm^2/Vs] for |E| in [V/um]
+	if(E>=Emax) return Field->Mobility(E*1e4,T,Charg,Neff,Which);
+	Float_t x=E*idE;
+	Int_t i=(Int_t)x;
+	if(i>=N) i=N-1;
+	return M[i]+(x-i)*(M[i+1]-M[i]);
+}
 
+void KVelocityTable::Eval(Int_t n, const Float_t *E, Float_t *v, Float_t *mu) const
+{
+	// Batch evaluation of the drift velocity (and mobility if mu!=NULL)
+	// for n field magnitudes [V/um]. The main loop has no branches and
+	// vectorizes; the few fields beyond the table are fixed up afterwards.
+	Int_t i,j,over=0;
+	Float_t x,f,top=N*(1-1e-6);
 
-// double **a,*b,*y6,*y2,*y3,*y4,*y5,*y7,*y8;
+	for(i=0;i<n;i++)
+	{
+		x=E[i]*idE;
+		x=x<top?x:top;
+		j=(Int_t)x; f=x-j;
+		v[i]=V[j]+f*(V[j+1]-V[j]);
+		over|=(E[i]>=Emax);
+	}
+	if(mu!=NULL)
+		for(i=0;i<n;i++)
+		{
+			x=E[i]*idE;
+			x=x<top?x:top;
+			j=(Int_t)x; f=x-j;
+			mu[i]=M[j]+f*(M[j+1]-M[j]);
+		}
 
+	if(over)
+		for(i=0;i<n;i++)
+			if(E[i]>=Emax)
+			{
+				v[i]=Field->DriftVelocity(E[i],Charg,T,Neff,Which);
+				if(mu!=NULL) mu[i]=Field->Mobility(E[i]*1e4,T,Charg,Neff,Which);
+			}
+}
 
-void KDetector::SetDriftHisto(Float_t x, Int_t numbins)
+
+class KVelocityTables
 {
-	if(x<0 || x>10000e-9) 
-		printf("Selected time range out of scope !\n"); 
-	else
-	{
-		if(pos!=NULL) delete pos;
-		pos  = new TH1F("charge+","Positive Charge",numbins,0,x);
-		if(neg!=NULL) delete neg;
-		neg  = new TH1F("charge-","Negative Charge",numbins,0,x); 	
-		if(sum!=NULL) delete sum;
-		sum  = new TH1F("charge","Total Charge",numbins,0,x); 
+	private:
+		KField *Field;
+		std::map<ULong64_t, KVelocityTable *> Tables;
+		std::mutex Lock;
 
-		sum->SetXTitle("t [s]");  neg->SetXTitle("t [s]"); pos->SetXTitle("t [s]");
-		sum->SetYTitle("I [arb.]");neg->SetYTitle("I [arb.]");pos->SetYTitle("I [arb.]");
-		sum->GetYaxis()->SetTitleOffset(1.4); neg->GetYaxis()->SetTitleOffset(1.4); pos->GetYaxis()->SetTitleOffset(1.4);
-		pos->SetLineColor(2);
-		neg->SetLineColor(4);
-		sum->SetLineColor(1);	
+	public:
+		Float_t Tol;        // requested relative interpolation error
+		Int_t NeffBins;     // Neff buckets per decade (only for Neff dependent models)
 
-	}
-}
+		KVelocityTables(KField *field) {Field=field; Tol=1e-4; NeffBins=20;};
+		~KVelocityTables();
+		KVelocityTable *Get(Int_t, Float_t, Float_t, Double_t);
+		void Clear();
+};
 
+KVelocityTables::~KVelocityTables()
+{
+	Clear();
+}
 
+void KVelocityTables::Clear()
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	std::map<ULong64_t, KVelocityTable *>::iterator it;
+	for(it=Tables.begin(); it!=Tables.end(); it++) delete it->second;
+	Tables.clear();
+}
 
-KDetector::KDetector()
+KVelocityTable *KVelocityTables::Get(Int_t which, Float_t charg, Float_t T, Double_t Neff)
 {
-	//////////////////////////////////////////////////////////////////////
-	// Author: Gregor Kramberger                                        //
-	// Default constructor for KDetector class                           //
-	// Default = no space charge -> default space charge is function     //
-	//////////////////////////////////////////////////////////////////////
+	// Returns (and builds on first use) the table for the given
+	// (model, carrier, T, Neff bucket). Only model 0 depends on Neff,
+	// the others share one table for all doping levels.
+	Int_t bucket=0;
+	Double_t neff=Neff;
+	UInt_t tbits;
+	ULong64_t key;
+
+	if(which==0 && Neff>1)
+	{
+		bucket=(Int_t)(TMath::Log10(Neff)*NeffBins+0.5);
+		neff=TMath::Power(10.,(Double_t)bucket/NeffBins);
+	}
+	else neff=0;
 
-	NeffF=new TF3("Profile","x[0]*x[1]*x[2]*0+[0]",0,1000,0,1000,0,1000);
-	NeffF->SetParameter(0,0);
-	NeffH=NULL; //Neff histogram se to NULL
+	memcpy(&tbits,&T,sizeof(tbits));
+	key=((ULong64_t)tbits<<32) | ((ULong64_t)(bucket&0xffff)<<16) | ((ULong64_t)(which&0xff)<<1) | (charg>0);
 
-	//set magnetic field to zero
-	for(Int_t i=0;i<3;i++) B[i]=0;
+	std::lock_guard<std::mutex> guard(Lock);
+	KVelocityTable *&tab=Tables[key];
+	if(tab==NULL) tab=new KVelocityTable(Field,which,charg,T,neff,Tol);
+	return tab;
+}
 
-	// setting up default random generator - diffusion
-	ran=new TRandom(33);  
 
-	// Calculation parameters
-	CalErr=1e-6;
-	MaxIter=2000;
 
-	// histograms for storing the drift
-	pos=NULL; neg=NULL; sum=NULL;
-	SetDriftHisto(25e-9);
 
-	// setting up general variables
-	// multiplication 
-	TauE=NULL;
-	TauH=NULL;
-	taue=-1;   //no electron trapping 
-	tauh=-1;   //no hole trapping 
-	MTresh=-1; //no multiplication 
-	BDTresh=-1;
-	DiffOffField=8;  // critical field for diffusion to be switched off
+// KThreadPool
 
-	// drift
+#include <thread>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 
-	Deps=1e-5;       //precision of tracking
-	MaxDriftLen=1e9; // maximum driftlenght in [um]
+class KThreadPool
+{
+	private:
+		Int_t NThreads;
+		std::vector<std::thread> Workers;
+		std::vector<std::deque<std::function<void(Int_t)> > > Queues;   // one task queue per worker
+		std::vector<std::mutex> Locks;                                  // lock of each queue
+		std::mutex WaitLock;
+		std::condition_variable WorkCond;     // signalled when tasks are queued
+		std::condition_variable DoneCond;     // signalled when all tasks are done
+		std::atomic<Long64_t> Queued;         // tasks waiting in the queues
+		std::atomic<Long64_t> Pending;        // tasks submitted and not yet finished
+		std::atomic<UInt_t> Next;             // round robin queue for external submissions
+		Bool_t Stop;
+
+		Bool_t Pop(Int_t, std::function<void(Int_t)> &);
+		void Work(Int_t);
 
-	//MobMod=1;  //Mobility parametrization
-	average=1; //average over waveforms
-	diff=0;    //diffusion
-	SStep=1;   //Step size of simulation
-	Temperature=263; //temperature
-	BreakDown=0; // no breakdown
-	Debug=0;     // bo printing of debug information
-	Voltage2=0;
-	Ramo=new KField();
-	Real=new KField();
+	public:
+		KThreadPool(Int_t = 0);
+		~KThreadPool();
+		void Submit(std::function<void(Int_t)>, Int_t = -1);
+		void Wait();
+		Int_t GetN() {return NThreads;};
+		static Int_t Cores();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KThreadPool                                                          //
+//                                                                      //
+// Work-stealing thread pool. Every worker owns a task queue; it takes  //
+// its own tasks from the back and, when it runs dry, steals from the   //
+// front of the other queues. A task receives the index of the worker   //
+// that runs it, so it can use per-worker buffers. Tasks may submit new //
+// tasks to their own queue.                                            //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
+Int_t KThreadPool::Cores()
+{
+	Int_t n=(Int_t)std::thread::hardware_concurrency();
+	return n>0?n:1;
 }
 
+KThreadPool::KThreadPool(Int_t n) : Queues(n>0?n:Cores()), Locks(n>0?n:Cores())
+{
+	Int_t i;
+	NThreads=n>0?n:Cores();
+	Queued=0; Pending=0; Next=0; Stop=kFALSE;
+	for(i=0;i<NThreads;i++) Workers.push_back(std::thread(&KThreadPool::Work,this,i));
+}
 
-KDetector::~KDetector()
+KThreadPool::~KThreadPool()
 {
-	//Destructor of the detector class
+	Int_t i;
+	Wait();
+	{
+		std::lock_guard<std::mutex> guard(WaitLock);
+		Stop=kTRUE;
+	}
+	WorkCond.notify_all();
+	for(i=0;i<NThreads;i++) Workers[i].join();
+}
 
-	if(NeffF!=NULL) delete NeffF;
-	if(NeffH!=NULL) delete NeffH;
-	if(ran!=NULL) delete ran;
-	if(pos!=NULL) delete pos;
-	if(neg!=NULL) delete neg;
-	if(sum!=NULL) delete sum;
+void KThreadPool::Submit(std::function<void(Int_t)> task, Int_t worker)
+{
+	// Queues a task - on the given worker's queue (from inside a task)
+	// or round robin (from outside)
+	if(worker<0 || worker>=NThreads) worker=(Next++)%NThreads;
+	Pending++;
+	{
+		std::lock_guard<std::mutex> guard(Locks[worker]);
+		Queues[worker].push_back(task);
+	}
+	{
+		std::lock_guard<std::mutex> guard(WaitLock);
+		Queued++;
+	}
+	WorkCond.notify_one();
+}
 
+Bool_t KThreadPool::Pop(Int_t w, std::function<void(Int_t)> &task)
+{
+	Int_t i,q;
+	// own queue first (last in, first out keeps the caches warm) ...
+	{
+		std::lock_guard<std::mutex> guard(Locks[w]);
+		if(!Queues[w].empty()) {task=Queues[w].back(); Queues[w].pop_back(); Queued--; return kTRUE;}
+	}
+	// ... then steal the oldest task of another worker
+	for(i=1;i<NThreads;i++)
+	{
+		q=(w+i)%NThreads;
+		std::lock_guard<std::mutex> guard(Locks[q]);
+		if(!Queues[q].empty()) {task=Queues[q].front(); Queues[q].pop_front(); Queued--; return kTRUE;}
+	}
+	return kFALSE;
 }
 
-void KDetector::CalField(Int_t what)
+void KThreadPool::Work(Int_t w)
 {
-	double err;
-	int iteracije,i;
-	int num=nx*ny*nz,dim[3];
-	Double_t *x;
-	//booking memory
-	b=dvector(1,num); y6=dvector(1,num); y2=dvector(1,num); 
-	y3=dvector(1,num); y4=dvector(1,num); y5=dvector(1,num);
-	y7=dvector(1,num); y8=dvector(1,num);
-	x=dvector(1,num);    
-	// Setting up the boundary conditions
-	printf("Setting up matrix ... \n");
-	Declaration(what);
-	printf("Solving matrix ...\n");
-	// matrix solving
-	for(i=1;i<=num;i++) x[i]=1.;
-	dim[0]=nx; dim[1]=ny; dim[2]=nz;
-	linbcg(num,dim,b,x,1,CalErr,MaxIter,&iteracije,&err);
-	// Calculating the field
-	if(!what)
+	std::function<void(Int_t)> task;
+	while(1)
 	{
-		Real->U=MapToGeometry(x);
-		Real->CalField();
+		if(Pop(w,task))
+		{
+			task(w);
+			task=nullptr;
+			if(--Pending==0)
+			{
+				std::lock_guard<std::mutex> guard(WaitLock);
+				DoneCond.notify_all();
+			}
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(WaitLock);
+		WorkCond.wait(lock,[this]{return Stop || Queued>0;});
+		if(Stop && Queued==0) return;
 	}
-	else
+}
+
+void KThreadPool::Wait()
+{
+	// blocks until all submitted tasks are finished
+	std::unique_lock<std::mutex> lock(WaitLock);
+	DoneCond.wait(lock,[this]{return Pending==0;});
+}
+
+inline Double_t KAtomicAdd(std::atomic<Double_t> &a, Double_t v)
+{
+	// a+=v, returns the value before (fetch_add)
+	Double_t o=a.load();
+	while(!a.compare_exchange_weak(o,o+v));
+	return o;
+}
+
+inline ULong64_t KSeed(ULong64_t a, ULong64_t b = 0, ULong64_t c = 0, ULong64_t d = 0)
+{
+	// Mixes up to four numbers into a seed (splitmix64 finalizer), used
+	// to give each unit of parallel work its own reproducible stream.
+	ULong64_t x=a,v[3]={b,c,d};
+	Int_t i;
+	for(i=0;i<4;i++)
 	{
-		// Scale back to 1 from 1000 when storing the potential
-		Ramo->U=MapToGeometry(x,1e-4);
+		x+=0x9e3779b97f4a7c15ULL;
+		x=(x^(x>>30))*0xbf58476d1ce4e5b9ULL;
+		x=(x^(x>>27))*0x94d049bb133111ebULL;
+		x^=x>>31;
+		if(i<3) x^=v[i];
+	}
+	return x;
+}
 
-		Ramo->CalField();
+
+// KRandom
+
+#include "TRandom.h"
+
+class KRandom : public TRandom
+{
+	private:
+		ULong64_t Key;       // stream key, e.g. KSeed(run, event, bucket, carrier)
+		ULong64_t Ctr;       // counter, e.g. the drift step
+		ULong64_t Sub;       // block within the counter
+		UInt_t Buf[4];       // current block
+		Int_t Pos;           // next word of Buf
+		Double_t Spare;      // second normal of the last Box-Muller pair
+		Int_t HasSpare;
+
+		inline void Next() {Philox(Key,Ctr,Sub++,Buf); Pos=0;};
+		inline UInt_t Word() {if(Pos>3) Next(); return Buf[Pos++];};
+
+	public:
+		KRandom(ULong64_t key = 0) {SetKey(key);};
+		virtual ~KRandom(){};
+		void SetKey(ULong64_t key) {Key=key; SetCounter(0);};
+		ULong64_t GetKey() const {return Key;};
+		void SetCounter(ULong64_t ctr) {Ctr=ctr; Sub=0; Pos=4; HasSpare=0;};
+		ULong64_t GetCounter() const {return Ctr;};
+
+		virtual void SetSeed(ULong_t seed = 0) {SetKey(seed);};
+		virtual UInt_t GetSeed() const {return (UInt_t)Key;};
+		virtual Double_t Rndm() {return ToUniform(Word());};
+		virtual void RndmArray(Int_t n, Float_t *a) {for(Int_t i=0;i<n;i++) a[i]=Rndm();};
+		virtual void RndmArray(Int_t n, Double_t *a) {for(Int_t i=0;i<n;i++) a[i]=Rndm();};
+		virtual Double_t Gaus(Double_t mean = 0, Double_t sigma = 1);
+
+		static void Philox(ULong64_t key, ULong64_t ctr, ULong64_t sub, UInt_t *out);
+		static inline Double_t ToUniform(UInt_t w) {return (w+0.5)*2.3283064365386963e-10;};
+		static void Normal4(Int_t n, const ULong64_t *key, const ULong64_t *ctr, Double_t *out);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KRandom                                                              //
+//                                                                      //
+// Counter-based generator (Philox4x32-10, Salmon et al., SC11). Every  //
+// number is a function of (key, counter, block) only: the key names a  //
+// stream - KSeed(Seed, event, bucket, carrier) for a drifted bucket -  //
+// and the drift sets the counter to the step number, so any carrier    //
+// and any step can be regenerated on its own, in any order and on any  //
+// thread. One block gives four 32 bit words: four uniforms or four    //
+// normals (Box-Muller), which covers the diffusion of a 3D step.       //
+// Normal4 fills four normals per (key, counter) pair for many streams  //
+// at once with the same values as Gaus, for the batched drift.         //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+void KRandom::Philox(ULong64_t key, ULong64_t ctr, ULong64_t sub, UInt_t *out)
+{
+	const UInt_t M0=0xD2511F53, M1=0xCD9E8D57, W0=0x9E3779B9, W1=0xBB67AE85;
+	UInt_t c0=(UInt_t)ctr, c1=(UInt_t)(ctr>>32), c2=(UInt_t)sub, c3=(UInt_t)(sub>>32);
+	UInt_t k0=(UInt_t)key, k1=(UInt_t)(key>>32);
+	ULong64_t p0,p1;
+	for(Int_t r=0;r<10;r++)
+	{
+		p0=(ULong64_t)M0*c0; p1=(ULong64_t)M1*c2;
+		c0=(UInt_t)(p1>>32)^c1^k0; c1=(UInt_t)p1;
+		c2=(UInt_t)(p0>>32)^c3^k1; c3=(UInt_t)p0;
+		k0+=W0; k1+=W1;
 	}
-	// Freeing the memory
-	free_dvector(x, 1,num);   free_dvector(b, 1,num);   free_dvector(y2, 1,num); 
-	free_dvector(y3, 1,num);  free_dvector(y4, 1,num);  free_dvector(y5, 1,num); 
-	free_dvector(y6, 1,num);  free_dvector(y7, 1,num);  free_dvector(y8, 1,num);
+	out[0]=c0; out[1]=c1; out[2]=c2; out[3]=c3;
 }
 
-void KDetector::Declaration(Int_t dowhat)
+Double_t KRandom::Gaus(Double_t mean, Double_t sigma)
 {
-	// New declaration for a general detector class 
-	Int_t i,j,k,val;
-	Double_t Rd,Ld,Dd,Ud,Od,Id;
-	Double_t PRd,PLd,PDd,PUd,POd,PId;
+	// Box-Muller on two words; the second normal is kept for the next call
+	Double_t r,phi;
+	if(HasSpare) {HasSpare=0; return mean+sigma*Spare;}
+	r=TMath::Sqrt(-2*TMath::Log(ToUniform(Word())));
+	phi=2*TMath::Pi()*ToUniform(Word());
+	Spare=r*TMath::Sin(phi); HasSpare=1;
+	return mean+sigma*r*TMath::Cos(phi);
+}
 
-	Double_t Xr=0,Yr=0,Zr=0;
-	Double_t Xc=0,Yc=0,Zc=0;
-	Double_t Xl=0,Yl=0,Zl=0;
-	Int_t ii,jj,kk;
-	Double_t fac;
+void KRandom::Normal4(Int_t n, const ULong64_t *key, const ULong64_t *ctr, Double_t *out)
+{
+	// the first four normals of the streams key[m] at the counters ctr[m]
+	// into out[4m..4m+3], as four calls of Gaus() after SetCounter(ctr[m])
+	UInt_t w[4];
+	Double_t r,phi;
+	for(Int_t m=0;m<n;m++)
+	{
+		Philox(key[m],ctr[m],0,w);
+		r=TMath::Sqrt(-2*TMath::Log(ToUniform(w[0]))); phi=2*TMath::Pi()*ToUniform(w[1]);
+		out[4*m]=r*TMath::Cos(phi); out[4*m+1]=r*TMath::Sin(phi);
+		r=TMath::Sqrt(-2*TMath::Log(ToUniform(w[2]))); phi=2*TMath::Pi()*ToUniform(w[3]);
+		out[4*m+2]=r*TMath::Cos(phi); out[4*m+3]=r*TMath::Sin(phi);
+	}
+}
 
-	long n=0;
-	Int_t num=nx*ny*nz;
 
-	for (k=1;k<=nz;k++)
-		for (j=1;j<=ny;j++)
-			for(i=1;i<=nx;i++)
-			{
-				n=(k-1)*nx*ny+(j-1)*nx+i; //Get index of the matrix element
-				if(j-1<1) jj=1;  else jj=j-1;
-				if(i-1<1) ii=1;  else ii=i-1; 
-				if(k-1<1) kk=1;  else kk=k-1; 
+// KEvent
 
-				/////////// DEFINE STEPS IN X //////////////////////////////////////
-				Rd=fabs(EG->GetXaxis()->GetBinCenter(i+1)-EG->GetXaxis()->GetBinCenter(i));
-				Ld=fabs(EG->GetXaxis()->GetBinCenter(i)-EG->GetXaxis()->GetBinCenter(i-1));
-				if(i+1>nx) Rd=Ld; if(i-1<1) Ld=Rd;
+class KEvent
+{
+	public:
+		Int_t Event;                   // event number - selects the random streams
+		std::vector<Float_t> x,y,z,Q;  // position and charge of the buckets
+		std::vector<Double_t> T;       // time of the deposition [s]
+
+		// results per bucket, [0] holes and [1] electrons
+		std::vector<Double_t> TTime[2];    // end time of the drift
+		std::vector<Double_t> TCharge[2];  // induced charge
+		std::vector<Int_t> Steps[2];       // number of steps
+		std::vector<Int_t> Stop[2];        // stop code of the drift
+		Double_t Charge;                   // total induced charge (weighted by Q)
+		Double_t Gain;                     // (primary + impact ionization charge) / primary charge
+		Long64_t NSec;                     // number of secondary pairs
+		Int_t BreakDown;                   // 1 if the avalanche was stopped at BDTresh
+
+		KEvent(Int_t ev = 0) {Event=ev; Charge=0; Gain=1; NSec=0; BreakDown=0;};
+		~KEvent(){};
+		void Add(Float_t px, Float_t py, Float_t pz, Float_t q = 1, Double_t t = 0) {x.push_back(px); y.push_back(py); z.push_back(pz); Q.push_back(q); T.push_back(t);};
+		Int_t GetN() {return (Int_t)x.size();};
+		void Clear() {x.clear(); y.clear(); z.clear(); Q.clear(); T.clear(); Charge=0; Gain=1; NSec=0; BreakDown=0;};
+};
 
-				////////// DEFINE PEMITIVITY IN X - normal surface ////////////////////////////
-				PRd=Perm(DM->GetBinContent(i,j,k))+Perm(DM->GetBinContent(i,jj,k));
 
-				if(nz!=1) 
-				{
-					PRd+=Perm(DM->GetBinContent(i,j,kk))+Perm(DM->GetBinContent(i,jj,kk));
-					PRd/=4;
-				} else PRd/=2;
+// KSignal
 
-				PLd=Perm(DM->GetBinContent(ii,j,k))+Perm(DM->GetBinContent(ii,jj,k));
-				if(nz!=1) 
-				{
-					PLd+=Perm(DM->GetBinContent(ii,j,kk))+Perm(DM->GetBinContent(ii,jj,kk));
-					PLd/=4;
-				} else PLd/=2;
+class KSignalPart
+{
+	public:
+		Int_t First;                // first bin
+		std::vector<Double_t> Q;    // induced charge in the bins First, First+1 ...
+};
 
-				/////////// DEFINE STEPS IN Y //////////////////////////////////////
+class KSignal
+{
+	public:
+		Int_t N;                    // number of time bins
+		Double_t T0;                // lower edge of the first bin [s]
+		Double_t IdT;               // inverse bin width [1/s]
+		std::vector<Double_t> Pos;  // charge induced by the holes in each bin
+		std::vector<Double_t> Neg;  // charge induced by the electrons in each bin
+
+		KSignal(TH1F *);
+		~KSignal(){};
+		void Reset() {Pos.assign(N,0); Neg.assign(N,0);};
+		inline void Fill(Double_t, Double_t, Double_t, Float_t);
+		void Take(Int_t, KSignalPart &);
+		void Add(Int_t, const KSignalPart &);
+		void Store(TH1F *, TH1F *, TH1F *, Double_t = 1);
+};
 
-				Ud=fabs(EG->GetYaxis()->GetBinCenter(j+1)-EG->GetYaxis()->GetBinCenter(j));
-				Dd=fabs(EG->GetYaxis()->GetBinCenter(j)-EG->GetYaxis()->GetBinCenter(j-1));
-				if(j+1>ny) Ud=Dd; if(j-1<1) Dd=Ud;
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KSignal                                                              //
+//                                                                      //
+// Accumulation buffer for the induced current with the binning of the  //
+// drift histograms. Drift spreads the induced charge of every step     //
+// evenly over the bins of the step time, so the path does not have to  //
+// be kept and long (adaptive) steps do not put it into one bin.        //
+// Each thread fills its own buffer; Take() moves the charge of a task  //
+// into a KSignalPart, so that the parts can be added in a fixed order, //
+// and Store() converts the charge per bin into current.                //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
-				////////// DEFINE PEMITIVITY IN Y ////////////////////////////
-				PUd=Perm(DM->GetBinContent(i,j,k))  +Perm(DM->GetBinContent(ii,j,k));
-				if(nz!=1) 
-				{
-					PUd+=Perm(DM->GetBinContent(i,j,kk))+Perm(DM->GetBinContent(ii,j,kk));
-					PUd/=4;
-				} else PUd/=2;
+KSignal::KSignal(TH1F *his)
+{
+	N=his->GetNbinsX();
+	T0=his->GetXaxis()->GetXmin();
+	IdT=N/(his->GetXaxis()->GetXmax()-T0);
+	Reset();
+}
 
-				PDd=Perm(DM->GetBinContent(i,jj,k))+Perm(DM->GetBinContent(ii,jj,k));
-				if(nz!=1) 
-				{
-					PDd+=Perm(DM->GetBinContent(i,jj,kk))+Perm(DM->GetBinContent(ii,jj,kk));
-					PDd/=4;
-				} else PDd/=2;
+inline void KSignal::Fill(Double_t t1, Double_t t2, Double_t q, Float_t charg)
+{
+	// charge q induced evenly between t1 and t2
+	std::vector<Double_t> &s=charg>0?Pos:Neg;
+	Double_t x1=(t1-T0)*IdT,x2=(t2-T0)*IdT;
+	Int_t i=(Int_t)TMath::Floor(x1),l=(Int_t)TMath::Floor(x2);
+	if(i==l) {if(i>=0 && i<N) s[i]+=q; return;}
+	if(x2<x1) {Double_t x=x1; x1=x2; x2=x; Int_t k=i; i=l; l=k;}
+	Double_t f=q/(x2-x1);
+	if(i>=0 && i<N) s[i]+=f*(i+1-x1);
+	for(i=TMath::Max(i+1,0);i<l && i<N;i++) s[i]+=f;
+	if(l>=0 && l<N) s[l]+=f*(x2-l);
+}
 
-				/////////// DEFINE STEPS IN Z //////////////////////////////////////
+void KSignal::Take(Int_t c, KSignalPart &p)
+{
+	// moves the non-zero bins of the holes (c=0) or electrons (c=1) to p
+	std::vector<Double_t> &s=c?Neg:Pos;
+	Int_t b,e;
+	for(b=0;b<N && s[b]==0;b++);
+	for(e=N;e>b && s[e-1]==0;e--);
+	p.First=b; p.Q.assign(s.begin()+b,s.begin()+e);
+	std::fill(s.begin()+b,s.begin()+e,0.);
+}
 
-				Od=fabs(EG->GetZaxis()->GetBinCenter(k+1)-EG->GetZaxis()->GetBinCenter(k));
-				Id=fabs(EG->GetZaxis()->GetBinCenter(k)-EG->GetZaxis()->GetBinCenter(k-1));
-				if(k+1>nz) Od=Id; 
-				if(k-1<1) Id=Od;
+void KSignal::Add(Int_t c, const KSignalPart &p)
+{
+	std::vector<Double_t> &s=c?Neg:Pos;
+	for(size_t i=0;i<p.Q.size();i++) s[p.First+i]+=p.Q[i];
+}
 
-				//////////DEFINE PEMITIVITY IN Z ////////////////////////////
-				if(nz!=1)
-				{
-					POd=Perm(DM->GetBinContent(i,jj,k))+Perm(DM->GetBinContent(i,j,k))+
-						Perm(DM->GetBinContent(ii,j,k))+Perm(DM->GetBinContent(ii,jj,k));
+void KSignal::Store(TH1F *pos, TH1F *neg, TH1F *sum, Double_t scale)
+{
+	// Current [e/s] = charge in the bin / bin width
+	pos->Reset(); neg->Reset(); sum->Reset();
+	for(Int_t i=0;i<N;i++)
+	{
+		pos->SetBinContent(i+1,Pos[i]*IdT*scale);
+		neg->SetBinContent(i+1,Neg[i]*IdT*scale);
+		sum->SetBinContent(i+1,(Pos[i]+Neg[i])*IdT*scale);
+	}
+}
 
-					PId=Perm(DM->GetBinContent(i,jj,kk))+Perm(DM->GetBinContent(i,j,kk))+
-						Perm(DM->GetBinContent(ii,j,kk))+Perm(DM->GetBinContent(ii,jj,kk));
 
-					POd/=4;
-					PId/=4;
+// KFFT
 
-				}
-				///////////
+class KFFT
+{
+	private:
+		Int_t N;                      // size (power of 2)
+		std::vector<Double_t> C,S;    // twiddle factors cos/sin(2 pi k/N), k<N/2
+		std::vector<Int_t> Rev;       // bit reversed indices
 
-				if(dowhat==1) {PRd=1; PLd=1; PUd=1; PDd=1; POd=1; PId=1;}
+	public:
+		KFFT(Int_t);
+		~KFFT(){};
+		Int_t GetN() const {return N;};
+		void Transform(Double_t *, Double_t *, Int_t = 0) const;
+		static Int_t Size(Int_t n) {Int_t m=1; while(m<n) m<<=1; return m;};
+};
 
-				Xr=PRd/(0.5*Rd*(Rd+Ld));
-				Xl=PLd/(0.5*Ld*(Rd+Ld));  Xc=-(Xr+Xl);
-				Yr=PUd/(0.5*Ud*(Ud+Dd));
-				Yl=PDd/(0.5*Dd*(Ud+Dd));  Yc=-(Yr+Yl);
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KFFT                                                                 //
+//                                                                      //
+// In-place radix-2 complex FFT. The twiddle factors and the bit        //
+// reversal of a size are computed once (the "plan") and the plan is    //
+// reused for every transform of that size; Transform is const, so one  //
+// plan serves all threads.                                             //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
-				if(nz!=1)
-				{
-					Zr=POd/(0.5*Od*(Od+Id));
-					Zl=PId/(0.5*Id*(Od+Id));  Zc=-(Zr+Zl);
-				} 
+KFFT::KFFT(Int_t n)
+{
+	Int_t i,j,b;
+	N=Size(n>1?n:2);
+	C.resize(N/2); S.resize(N/2); Rev.resize(N);
+	for(i=0;i<N/2;i++) {C[i]=TMath::Cos(2*TMath::Pi()*i/N); S[i]=TMath::Sin(2*TMath::Pi()*i/N);}
+	for(i=0;i<N;i++)
+	{
+		for(j=0,b=1;b<N;b<<=1) j=(j<<1)|((i&b)?1:0);
+		Rev[i]=j;
+	}
+}
 
-				//////////
+void KFFT::Transform(Double_t *re, Double_t *im, Int_t inverse) const
+{
+	// X[k] = sum x[n] exp(-2 pi i nk/N); the inverse includes the 1/N
+	Int_t i,j,k,len,half,step;
+	Double_t tr,ti,wr,wi,sg=inverse?1:-1;
 
-				b[n]=0.;
-				val=EG->GetBinContent(i,j,k);
+	for(i=0;i<N;i++)
+		if(i<Rev[i]) {std::swap(re[i],re[Rev[i]]); std::swap(im[i],im[Rev[i]]);}
+	for(len=2;len<=N;len<<=1)
+	{
+		half=len/2; step=N/len;
+		for(i=0;i<N;i+=len)
+			for(j=0,k=0;j<half;j++,k+=step)
+			{
+				wr=C[k]; wi=sg*S[k];
+				tr=re[i+j+half]*wr-im[i+j+half]*wi;
+				ti=re[i+j+half]*wi+im[i+j+half]*wr;
+				re[i+j+half]=re[i+j]-tr; im[i+j+half]=im[i+j]-ti;
+				re[i+j]+=tr; im[i+j]+=ti;
+			}
+	}
+	if(inverse) for(i=0;i<N;i++) {re[i]/=N; im[i]/=N;}
+}
 
-				if(nz==1) { C1(Xc,Yc,0) I0 O0 } 
-				else      { C1(Xc,Yc,Zc) I1(Zl) O1(Zr) }
 
-				R1(Xr) U1(Yr) L1(Xl) D1(Yl) 
+// KShaper
 
+class KPulse
+{
+	public:
+		Float_t Amplitude;   // signed extremum of the shaped signal [mV]
+		Float_t TPeak;       // its time [s]
+		Float_t TCFD;        // constant fraction time on the leading edge [s]
+		Float_t Integral;    // integral of the shaped signal [mV s]
 
-					if(val&4)            {D0 b[n]-=V(EG->GetBinContent(i,j-1,k),dowhat)*Yl;}
-				if(val&8)            {U0 b[n]-=V(EG->GetBinContent(i,j+1,k),dowhat)*Yr;}
-				if(val&16)           {L0 b[n]-=V(EG->GetBinContent(i-1,j,k),dowhat)*Xl;}
-				if(val&32)           {R0 b[n]-=V(EG->GetBinContent(i+1,j,k),dowhat)*Xr;}
-				if(val&1024)         {I0 b[n]-=V(EG->GetBinContent(i,j,k-1),dowhat)*Zl;}
-				if(val&2048)         {O0 b[n]-=V(EG->GetBinContent(i,j,k+1),dowhat)*Zr;}
+		KPulse() {Amplitude=0; TPeak=0; TCFD=0; Integral=0;};
+};
+
+class KShaper
+{
+	private:
+		KFFT *Plan;                     // FFT of the padded waveform
+		Int_t NBin;                     // waveform bins the response was made for
+		Double_t Dt;                    // their width [s]
+		Double_t Par[8];                // parameters of the response
+		std::vector<Double_t> Hre,Him;  // transfer function at the FFT frequencies
+		Double_t NoiseNorm;             // rms of unit white noise after H
+		std::mutex Lock;
 
+		void Prepare(Int_t, Double_t);
 
-				if(val&64)           {U2(Yr) D0 if(val&8)    {U0 b[n]-=V(EG->GetBinContent(i,j+1,k),dowhat)*Yr;}}
-				if(val&128)          {D2(Yl) U0 if(val&4)    {D0 b[n]-=V(EG->GetBinContent(i,j-1,k),dowhat)*Yl;}}
-				if(val&256)          {R2(Xr) L0 if(val&32)   {R0 b[n]-=V(EG->GetBinContent(i+1,j,k),dowhat)*Xr;}}
-				if(val&512)          {L2(Xl) R0 if(val&16)   {L0 b[n]-=V(EG->GetBinContent(i-1,j,k),dowhat)*Xl;}}
-				if(val&4096)         {O2(Zr) I0 if(val&2048) {O0 b[n]-=V(EG->GetBinContent(i,j,k+1),dowhat)*Zr;}}
-				if(val&8192)         {I2(Zl) O0 if(val&1024) {I0 b[n]-=V(EG->GetBinContent(i,j,k-1),dowhat)*Zl;}}
+	public:
+		Int_t Type;          // 0 = none, 1 = CSA with CR-RC^n shaper, 2 = broadband amplifier
+		Float_t Gain;        // CSA: peak per charge [mV/fC]; broadband: voltage gain
+		Float_t Tau;         // CSA: shaping time constant [s]
+		Int_t Order;         // CSA: integrations n of CR-RC^n; broadband: poles
+		Float_t BW;          // broadband: -3 dB bandwidth of one pole [Hz]
+		Float_t R;           // broadband: input impedance [Ohm]
+		Float_t Noise;       // rms of the output noise [mV]
+		Float_t CFD;         // fraction of the amplitude for TCFD
+
+		KShaper(Int_t = 1);
+		~KShaper() {if(Plan!=NULL) delete Plan;};
+		void Shape(Int_t, Double_t, const Float_t *, Float_t *, TRandom * = NULL);
+		void Shape(TH1F *, TH1F *, TRandom * = NULL);
+		KPulse Analyse(Int_t, Double_t, Double_t, const Float_t *) const;
+		KPulse Analyse(TH1F *) const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KShaper                                                              //
+//                                                                      //
+// Readout electronics applied to the induced current [e/s] (e.g. sum): //
+// the current is convolved with the amplifier response by FFT, with    //
+// zero padding to twice the waveform length, and Gaussian noise with   //
+// the spectrum of the amplifier is added in the same transform. The    //
+// plan and the transfer function are made once for a binning and       //
+// reused; Shape can be called from many threads (EventMC). Analyse    //
+// gives the amplitude, peak time, constant fraction time and integral. //
+//                                                                      //
+// CSA (Type=1):   H(s) = A / (1+s Tau)^(Order+1), A such that a charge //
+//                 delta gives a peak of Gain [mV/fC] at t = Order*Tau  //
+// broadband (2):  H(s) = Gain R / (1+s/(2 pi BW))^Order  (current into //
+//                 R, in mV)                                            //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KShaper::KShaper(Int_t type)
+{
+	Type=type;
+	Gain=type==2?100:10;
+	Tau=type==2?0:1e-9;
+	Order=type==2?2:1;
+	BW=2e9;
+	R=50;
+	Noise=0;
+	CFD=0.5;
+	Plan=NULL; NBin=0; Dt=0; NoiseNorm=0;
+	for(Int_t i=0;i<8;i++) Par[i]=0;
+}
+
+void KShaper::Prepare(Int_t n, Double_t dt)
+{
+	// (re)makes the plan and the transfer function if the binning or the
+	// parameters changed
+	Double_t par[8]={(Double_t)Type,Gain,Tau,(Double_t)Order,BW,R,(Double_t)n,dt};
+	Int_t i,k,m;
+	Double_t w,a,re,im,mr,mi,tr,e=1.602176634e-19;
+
+	std::lock_guard<std::mutex> guard(Lock);
+	for(i=0;i<8 && par[i]==Par[i];i++);
+	if(i==8 && Plan!=NULL) return;
+
+	if(Plan!=NULL) delete Plan;
+	Plan=new KFFT(2*n);
+	m=Plan->GetN();
+	Hre.assign(m,1); Him.assign(m,0);
+	NBin=n; Dt=dt;
+	for(k=0;k<m;k++)
+	{
+		w=2*TMath::Pi()*(k<=m/2?k:k-m)/(m*dt);
+		// products of single poles 1/(1 + i w tau)
+		switch(Type)
+		{
+			case 1:
+				a=Gain*e*1e15*Tau*TMath::Factorial(Order)/(Order>0?TMath::Power(Order*TMath::Exp(-1.),Order):1);
+				tr=1/(1+w*w*Tau*Tau); re=tr; im=-w*Tau*tr;
+				for(i=0,mr=a,mi=0;i<=Order;i++) {tr=mr*re-mi*im; mi=mr*im+mi*re; mr=tr;}
+				Hre[k]=mr; Him[k]=mi;
+				break;
+			case 2:
+				a=Gain*R*e*1e3; w/=2*TMath::Pi()*BW;
+				re=1/(1+w*w); im=-w*re;
+				for(i=0,mr=a,mi=0;i<Order;i++) {tr=mr*re-mi*im; mi=mr*im+mi*re; mr=tr;}
+				Hre[k]=mr; Him[k]=mi;
+				break;
+			default:
+				break;
+		}
+	}
+	// Parseval: rms of unit white noise filtered by H
+	for(k=0,a=0;k<m;k++) a+=Hre[k]*Hre[k]+Him[k]*Him[k];
+	NoiseNorm=TMath::Sqrt(a/m);
+	for(i=0;i<8;i++) Par[i]=par[i];
+}
+
+void KShaper::Shape(Int_t n, Double_t dt, const Float_t *in, Float_t *out, TRandom *rnd)
+{
+	// Shapes the current in[n] [e/s] in bins of dt [s] into out[n] [mV]
+	// (in and out may be the same); noise is added if Noise>0 and rnd is given
+	Int_t k,m;
+	Double_t re,sn;
+
+	Prepare(n,dt);
+	m=Plan->GetN();
+	std::vector<Double_t> x(m,0),y(m,0);
+	for(k=0;k<n;k++) x[k]=in[k];
+	if(Noise>0 && rnd!=NULL && NoiseNorm>0)
+	{
+		sn=Noise/NoiseNorm;
+		for(k=0;k<m;k++) x[k]+=rnd->Gaus(0,sn);
+	}
+	Plan->Transform(&x[0],&y[0]);
+	for(k=0;k<m;k++)
+	{
+		re=x[k]*Hre[k]-y[k]*Him[k];
+		y[k]=x[k]*Him[k]+y[k]*Hre[k];
+		x[k]=re;
+	}
+	Plan->Transform(&x[0],&y[0],1);
+	for(k=0;k<n;k++) out[k]=x[k];
+}
+
+void KShaper::Shape(TH1F *in, TH1F *out, TRandom *rnd)
+{
+	// shapes the current histogram in (e.g. sum) into out (may be in)
+	Int_t i,n=in->GetNbinsX();
+	std::vector<Float_t> w(n);
+	for(i=0;i<n;i++) w[i]=in->GetBinContent(i+1);
+	Shape(n,in->GetXaxis()->GetBinWidth(1),&w[0],&w[0],rnd);
+	for(i=0;i<n;i++) out->SetBinContent(i+1,w[i]);
+}
+
+KPulse KShaper::Analyse(Int_t n, Double_t t0, Double_t dt, const Float_t *w) const
+{
+	// Observables of the shaped signal w[n] in bins of dt starting at t0.
+	// TCFD is where the leading edge before the extremum crosses CFD times
+	// its magnitude (linear interpolation between bin centers).
+	KPulse p;
+	Int_t i,im=0;
+	Double_t a=0,f,sg,lo,hi;
+
+	for(i=0;i<n;i++)
+	{
+		p.Integral+=w[i]*dt;
+		if(TMath::Abs(w[i])>a) {a=TMath::Abs(w[i]); im=i;}
+	}
+	if(a==0) return p;
+	sg=w[im]>0?1:-1;
+	p.Amplitude=w[im];
+	p.TPeak=t0+(im+0.5)*dt;
+
+	f=CFD*a;
+	for(i=im;i>0 && sg*w[i-1]>=f;i--);
+	if(i==0) p.TCFD=t0+0.5*dt;
+	else
+	{
+		lo=sg*w[i-1]; hi=sg*w[i];
+		p.TCFD=t0+(i-0.5+(f-lo)/(hi-lo))*dt;
+	}
+	return p;
+}
+
+KPulse KShaper::Analyse(TH1F *h) const
+{
+	Int_t i,n=h->GetNbinsX();
+	std::vector<Float_t> w(n);
+	for(i=0;i<n;i++) w[i]=h->GetBinContent(i+1);
+	return Analyse(n,h->GetXaxis()->GetXmin(),h->GetXaxis()->GetBinWidth(1),&w[0]);
+}
+
+
+// KTreeWriter
+
+class KEventRecord
+{
+	public:
+		Int_t Event;                 // event number
+		Float_t Enp[3];              // entry point of the track
+		Float_t Exp[3];              // exit point of the track
+		Double_t Charge;             // total induced charge [e]
+		Double_t CTime;              // collection time (end of the last drift) [s]
+		Double_t Gain;               // charge multiplication (avalanche mode)
+		Int_t BreakDown;             // 1 if the avalanche reached BDTresh
+		KPulse Pulse;                // observables of the shaped signal (KDetector::Shaper)
+		std::vector<Float_t> Wave;   // induced current [e/s], or the shaped signal [mV], in the drift histogram bins
+};
+
+class KTreeWriter
+{
+	private:
+		TFile *File;
+		TTree *Tree;
+		KEventRecord Rec;                  // branch buffers
+		std::deque<KEventRecord> Queue;    // records waiting to be written
+		std::vector<std::vector<Float_t> > Spare;  // recycled waveform buffers
+		size_t MaxQueue;
+		Int_t Done;
+		KCheckpoint *Ck;                   // pending checkpoint, saved when
+		std::vector<Char_t> CkState;       // the first CkAt records are in the file
+		Long64_t CkAt;
+		std::mutex Lock;
+		std::condition_variable NotFull,NotEmpty;
+		std::thread Thread;
+		void Work();
+
+	public:
+		Long64_t Written;   // records written so far
+		Long64_t Pushed;    // records handed over so far
+
+		KTreeWriter(const char *, Int_t, Int_t = 4096, Int_t = 404, Int_t = 0);
+		~KTreeWriter();
+		void Push(KEventRecord &);
+		void Checkpoint(KCheckpoint *, std::vector<Char_t> &);
+		void GetBuffer(std::vector<Float_t> &);
+		void Close();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KTreeWriter                                                          //
+//                                                                      //
+// Writes KEventRecords to the TTree "events" of a compressed ROOT file //
+// from a background thread. Push() hands a record over (its waveform   //
+// is swapped, not copied) and blocks while the queue is full, so the   //
+// memory use stays constant however many events are written. The      //
+// waveform buffers are recycled through GetBuffer(). The default       //
+// compression is LZ4 (404), fast enough not to slow the drift down.    //
+// With append=1 the records are added to the tree of an existing file. //
+// The tree is saved to the file only by Checkpoint() and Close(), so   //
+// after a crash the file holds the records of the last checkpoint.     //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KTreeWriter::KTreeWriter(const char *name, Int_t nwave, Int_t maxqueue, Int_t compress, Int_t append)
+{
+	Tree=NULL;
+	Rec.Wave.assign(nwave,0);
+	if(append)
+	{
+		File=new TFile(name,"UPDATE");
+		if(!File->IsZombie()) Tree=(TTree *)File->Get("events");
+		if(Tree==NULL) {printf("KTreeWriter: no events in %s, starting a new file\n",name); delete File;}
+	}
+	if(Tree!=NULL)
+	{
+		Tree->SetBranchAddress("event",&Rec.Event);
+		Tree->SetBranchAddress("enp",Rec.Enp);
+		Tree->SetBranchAddress("exp",Rec.Exp);
+		Tree->SetBranchAddress("charge",&Rec.Charge);
+		Tree->SetBranchAddress("ctime",&Rec.CTime);
+		Tree->SetBranchAddress("gain",&Rec.Gain);
+		Tree->SetBranchAddress("breakdown",&Rec.BreakDown);
+		Tree->SetBranchAddress("pulse",&Rec.Pulse);
+		Tree->SetBranchAddress("wave",&Rec.Wave[0]);
+	}
+	else
+	{
+		File=new TFile(name,"RECREATE","raser events",compress);
+		Tree=new TTree("events","raser events");
+		Tree->SetDirectory(File);
+		Tree->Branch("event",&Rec.Event,"event/I");
+		Tree->Branch("enp",Rec.Enp,"enp[3]/F");
+		Tree->Branch("exp",Rec.Exp,"exp[3]/F");
+		Tree->Branch("charge",&Rec.Charge,"charge/D");
+		Tree->Branch("ctime",&Rec.CTime,"ctime/D");
+		Tree->Branch("gain",&Rec.Gain,"gain/D");
+		Tree->Branch("breakdown",&Rec.BreakDown,"breakdown/I");
+		Tree->Branch("pulse",&Rec.Pulse,"amp/F:tpeak/F:tcfd/F:integral/F");
+		Tree->Branch("wave",&Rec.Wave[0],Form("wave[%d]/F",nwave));
+	}
+	Tree->SetAutoSave(0);
+	MaxQueue=maxqueue>0?maxqueue:1;
+	Done=0; Written=Tree->GetEntries(); Pushed=Written;
+	Ck=NULL; CkAt=0;
+	Thread=std::thread(&KTreeWriter::Work,this);
+}
+
+KTreeWriter::~KTreeWriter()
+{
+	Close();
+}
+
+void KTreeWriter::Push(KEventRecord &rec)
+{
+	std::unique_lock<std::mutex> lk(Lock);
+	NotFull.wait(lk,[this]{return Queue.size()<MaxQueue;});
+	Queue.emplace_back();
+	KEventRecord &r=Queue.back();
+	r.Event=rec.Event; r.Charge=rec.Charge; r.CTime=rec.CTime;
+	r.Gain=rec.Gain; r.BreakDown=rec.BreakDown; r.Pulse=rec.Pulse;
+	for(Int_t i=0;i<3;i++) {r.Enp[i]=rec.Enp[i]; r.Exp[i]=rec.Exp[i];}
+	r.Wave.swap(rec.Wave);
+	Pushed++;
+	NotEmpty.notify_one();
+}
+
+void KTreeWriter::Checkpoint(KCheckpoint *ck, std::vector<Char_t> &state)
+{
+	// Saves state (swapped) with ck as soon as the records pushed so far
+	// are written and the tree is saved to the file; the caller goes on
+	// meanwhile. Ignored while the previous checkpoint is pending.
+	std::lock_guard<std::mutex> lk(Lock);
+	if(Ck!=NULL) return;
+	Ck=ck; CkState.swap(state); CkAt=Pushed;
+	NotEmpty.notify_one();
+}
+
+void KTreeWriter::GetBuffer(std::vector<Float_t> &wave)
+{
+	// Gives a recycled waveform buffer (of the right size) to a producer
+	std::lock_guard<std::mutex> lk(Lock);
+	if(Spare.empty()) wave.assign(Rec.Wave.size(),0);
+	else {wave.swap(Spare.back()); Spare.pop_back();}
+}
+
+void KTreeWriter::Work()
+{
+	size_t i;
+	std::vector<Float_t> wave;
+	std::unique_lock<std::mutex> lk(Lock);
+	while(1)
+	{
+		NotEmpty.wait(lk,[this]{return Done || !Queue.empty() || (Ck!=NULL && Written==CkAt);});
+		if(Ck!=NULL && Written==CkAt)
+		{
+			lk.unlock();
+			Tree->AutoSave("SaveSelf");
+			Ck->Save(CkState);
+			lk.lock();
+			Ck=NULL;
+			continue;
+		}
+		if(Queue.empty()) break;
+		KEventRecord &r=Queue.front();
+		Rec.Event=r.Event; Rec.Charge=r.Charge; Rec.CTime=r.CTime;
+		Rec.Gain=r.Gain; Rec.BreakDown=r.BreakDown; Rec.Pulse=r.Pulse;
+		for(i=0;i<3;i++) {Rec.Enp[i]=r.Enp[i]; Rec.Exp[i]=r.Exp[i];}
+		wave.swap(r.Wave);
+		Queue.pop_front();
+		NotFull.notify_one();
+
+		lk.unlock();
+		for(i=0;i<wave.size() && i<Rec.Wave.size();i++) Rec.Wave[i]=wave[i];
+		Tree->Fill();
+		lk.lock();
+		Written++;
+		if(Spare.size()<MaxQueue) {Spare.emplace_back(); Spare.back().swap(wave);}
+	}
+}
+
+void KTreeWriter::Close()
+{
+	if(File==NULL) return;
+	{
+		std::lock_guard<std::mutex> lk(Lock);
+		Done=1;
+	}
+	NotEmpty.notify_one();
+	Thread.join();
+	File->cd();
+	Tree->Write();
+	File->Close();
+	delete File;   // deletes the tree as well
+	File=NULL; Tree=NULL;
+}
+
+
+// KDepositReader
+
+class KDepositReader
+{
+	private:
+		std::ifstream In;
+		Int_t Block;                  // events per block
+		Double_t QScale;              // converts the deposited charge column to e-h pairs
+		std::vector<KEvent> Front;    // block ready for Next()
+		std::vector<KEvent> Back;     // block being read
+		Int_t NFront;                 // events in Front
+		Int_t Full,Eof,Done;
+		std::mutex Lock;
+		std::condition_variable NotFull,NotEmpty;
+		std::thread Thread;
+		void Work();
+
+	public:
+		Long64_t Lines;      // lines read so far
+		Long64_t Deposits;   // deposits read so far
+		Long64_t Events;     // events read so far
+		Long64_t BadLines;   // lines that could not be parsed (skipped)
+
+		KDepositReader(const char *, Int_t = 1024, Double_t = 1);
+		~KDepositReader();
+		Bool_t IsOpen() {return In.is_open();};
+		Int_t Next(std::vector<KEvent> &);
+		void Close();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KDepositReader                                                       //
+//                                                                      //
+// Streams energy deposits, e.g. the steps of an offline Geant4 run,    //
+// from a text file with one deposit per line:                          //
+//                                                                      //
+//      event  x[um]  y[um]  z[um]  Q  [t[s]]                           //
+//                                                                      //
+// Consecutive lines with the same event number form one KEvent (a     //
+// bucket per deposit, Q times QScale e-h pairs, created at t, 0 if     //
+// missing). Empty lines and lines starting with # are skipped. A       //
+// background thread reads the next block of events while the previous //
+// one is drifted; Next() swaps the ready block out, so at most three   //
+// blocks are in memory whatever the size of the file.                 //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KDepositReader::KDepositReader(const char *name, Int_t block, Double_t qscale)
+{
+	Block=block>0?block:1; QScale=qscale;
+	NFront=0; Full=0; Eof=0; Done=0;
+	Lines=0; Deposits=0; Events=0; BadLines=0;
+	In.open(name);
+	if(!In.is_open()) {printf("KDepositReader: can not open %s\n",name); Eof=1; return;}
+	Front.resize(Block); Back.resize(Block);
+	Thread=std::thread(&KDepositReader::Work,this);
+}
+
+KDepositReader::~KDepositReader()
+{
+	Close();
+}
+
+void KDepositReader::Work()
+{
+	std::string line;
+	Int_t n,ev,last=0,pend=0,eof=0;
+	Double_t v[5];
+	char *p,*q;
+
+	while(!eof)
+	{
+		n=0;
+		if(pend) {Back[0].Clear(); Back[0].Event=last; Back[0].Add(v[0],v[1],v[2],v[3]*QScale,v[4]); n=1; pend=0;}
+		while(1)
+		{
+			if(!std::getline(In,line)) {eof=1; break;}
+			Lines++;
+			p=(char *)line.c_str();
+			while(*p==' ' || *p=='\t') p++;
+			if(*p==0 || *p=='#' || *p=='\r') continue;
+			ev=(Int_t)strtol(p,&q,10);
+			Int_t k=0;
+			if(q==p) {BadLines++; continue;}
+			for(k=0;k<5;k++)
+			{
+				p=q; v[k]=strtod(p,&q);
+				if(q==p) break;
+			}
+			if(k<4) {BadLines++; continue;}
+			if(k==4) v[4]=0;
+			Deposits++;
+			if(n==0 || ev!=last)
+			{
+				last=ev; Events++;
+				if(n==Block) {pend=1; break;}
+				Back[n].Clear(); Back[n].Event=ev; n++;
+			}
+			Back[n-1].Add(v[0],v[1],v[2],v[3]*QScale,v[4]);
+		}
+
+		// hand the block over as soon as the previous one was taken
+		std::unique_lock<std::mutex> lk(Lock);
+		NotFull.wait(lk,[this]{return Done || !Full;});
+		if(Done) return;
+		Front.swap(Back); NFront=n;
+		Full=1; Eof=eof;
+		NotEmpty.notify_one();
+	}
+}
+
+Int_t KDepositReader::Next(std::vector<KEvent> &ev)
+{
+	// Gives the next block of events (the first n of ev), 0 at the end of
+	// the file. The vector handed in is recycled for a later block.
+	Int_t n;
+	std::unique_lock<std::mutex> lk(Lock);
+	NotEmpty.wait(lk,[this]{return Full || Eof;});
+	if(!Full) return 0;
+	ev.swap(Front); n=NFront;
+	Front.resize(Block);
+	Full=0;
+	NotFull.notify_one();
+	return n;
+}
+
+void KDepositReader::Close()
+{
+	{
+		std::lock_guard<std::mutex> lk(Lock);
+		Done=1;
+	}
+	NotFull.notify_one();
+	if(Thread.joinable()) Thread.join();
+	if(In.is_open()) In.close();
+}
+
+
+// KResponseMap
+
+class KDetector;
+
+class KResponseMap
+{
+	private:
+		KDetector *Det;
+		TAxis *Ax[3];                   // voxels (bins of the geometry)
+		Int_t Nv[3];
+		std::vector<Int_t> First[2];    // first signal bin of the response of each voxel
+		std::vector<Int_t> Len[2];      // its number of bins
+		std::vector<Long64_t> Off[2];   // its offset in Data
+		std::vector<Float_t> Data[2];   // induced charge per signal bin for a unit charge
+		std::vector<Float_t> CTime[2];  // end time of the drift [s]
+		std::vector<Float_t> QInd[2];   // total induced charge for a unit charge
+		std::vector<Int_t> Steps[2];    // steps of the drift
+		std::vector<Int_t> Stop[2];     // stop code of the drift
+
+	public:
+		Int_t N;                        // signal bins (those of the drift histograms)
+		Double_t T0,IdT;                // their lower edge and inverse width
+		Double_t BuildTime;             // time used by Build() [s]
+
+		KResponseMap(KDetector *);
+		~KResponseMap(){};
+		void Build();
+		inline Int_t Voxel(Float_t, Float_t, Float_t) const;
+		Float_t GetTime(Int_t v, Int_t c) const {return v<0?0:CTime[c][v];};
+		Float_t GetCharge(Int_t v, Int_t c) const {return v<0?0:QInd[c][v];};
+		Int_t GetSteps(Int_t v, Int_t c) const {return v<0?0:Steps[c][v];};
+		Int_t GetStop(Int_t v, Int_t c) const {return v<0?0:Stop[c][v];};
+		void Fill(Int_t, Int_t, Double_t, KSignal *, Double_t = 0) const;
+		Long64_t GetSize() const;
+		void Print() const;
+};
+
+
+// KDetector
+
+#include "TRandom.h"
+#include "TF3.h"
+#ifndef RASER_BATCH
+#include "TPolyLine3D.h"
+#endif
+
+class KDetector : public KGeometry, public KMaterial { 
+
+
+	private:
+		Double_t Deps;
+		TRandom *ran;               //random number generator
+		Double_t CalErr;               //Error of the solver
+		Int_t MaxIter;              //Maximum number of iterations in eq solver
+		Short_t Debug;              //Print information of drift calculation etc.
+		TH3F *EDist;                //distance to the nearest electrode [um]
+		TH3F *TrapMap[2];           //trapping rates of holes [0] and electrons [1] [1/s]
+		TF3 *TrapSrc[2];            //TauH and TauE the maps were sampled from
+		KResponseMap *RMap;         //tabulated drifts of unit charges from every voxel
+		Bool_t RMapWarned;          //the warning that FastSim can not be used was printed
+#ifndef RASER_BATCH
+		std::vector<TGraph *> ShowGr;        //drawn paths, reused by the next display
+		std::vector<TPolyLine3D *> ShowPl;
+		TH1 *ShowHis;                        //drawn geometry
+		std::vector<Float_t> ShowBuf;        //decimated path
+		Int_t Decimate(Int_t, Float_t *, Float_t *, Float_t *, Double_t);
+#endif
+
+		Double_t DriftRate(Double_t *, Float_t, Int_t, Float_t, Double_t, KVelocityTable *, Double_t *, Int_t &);
+		void DriftRK(Double_t, Double_t, Double_t, Float_t, KStruct *, Double_t, TRandom *, Bool_t);
+		void DriftBucket(KEvent &, Int_t, Int_t, KStruct *, KRandom *);
+		void SimEvent(KEvent &, KStruct *, KRandom *, std::vector<std::pair<KCarrier,Int_t> > &, KEventRecord &);
+		void Multiply(KStruct *, Int_t, Double_t, Float_t, Float_t, Double_t, Double_t, Double_t, Double_t, Double_t, KCarrier &);
+		Bool_t CheckBreakDown();
+
+		friend class KDriftBatch;
+		friend class KResponseMap;
+
+	public:
+		Float_t Voltage;  //Voltage
+		Float_t Voltage2; //Voltage2 
+		TArrayF Voltages; //Array of voltages
+
+		// Definition of space charge 
+		TF3     *NeffF;     //effective dopping concentration function
+		TH3F    *NeffH;     //effective dopping concentration histogram
+
+		// Weigthing, electric and magnetic field
+		KField *Ramo;       // ramo field 
+		KField *Real;       // electric field
+		Float_t B[3];      // magnetic field
+
+		// Trapping and variables used for multiplication studies
+		Float_t taue;      // effective trapping time constants 
+		Float_t tauh;      // effective trapping time constants 
+		TF3 *TauE;         // Function of TauE(x,y,z) [s] - sampled on the mesh (GetTrapMap);
+		TF3 *TauH;         // Function of TauH(x,y,z);
+
+		Int_t BreakDown;     // if break down occurs it goes to 1 otherwise is 0
+		Float_t MTresh;      // treshold for taking multiplication into account
+		Float_t BDTresh;     // break down: created charge / primary charge at which an avalanche is stopped (>0)
+		Float_t DiffOffField;// electric field where diffusion is switched off [V/um] !!
+		// Drift parameters
+
+		Float_t enp[3];      //entry point for the charge drift
+		Float_t exp[3];      //exit point for the cahrge drift
+		Float_t MipMPV;      // Landau most probable ionization of a mip [e/um]
+		Float_t MipSigma;    // Landau width of the ionization of a mip [e/um]
+		Int_t diff;          // Diffusion simulation (yes=1, no=0)
+		Int_t average;       // Average (over how many events)
+		Float_t SStep;       // Simulation step size;
+		Float_t MaxDriftLen; // Maximum drift lenght before stopping the drift
+		Int_t MaxSteps;      // Maximum number of drift steps (0 = no limit)
+		Int_t Integrator;    // Drift integrator (0 = fixed step SStep, 1 = adaptive Runge-Kutta)
+		Float_t RKTol;       // Tolerated position error per adaptive step [um]
+		Float_t RKMaxStep;   // Largest adaptive step [um]
+		Int_t NThreads;      // Threads of the parallel drift (0 = all cores)
+		UInt_t Seed;         // Seed of the random streams of the parallel drift
+		Int_t VelTab;        // Tabulated drift velocities (yes=1, no=0)
+		KVelocityTables *VTables; // drift velocity tables
+		Int_t FastSim;       // Event drifts from the response tables (yes=1, no=0), see GetResponseMap
+		Int_t RZ;            // Axisymmetric detector: x of the mesh is the radius, y the depth (see KCyl)
+		KShaper *Shaper;     // Readout electronics applied by EventMC (NULL = none)
+		Float_t ClusterTol;  // Merging distance of deposits into one carrier [um] (0 = no clustering), see Cluster
+		Float_t ClusterFrac; // Merging distance relative to the electrode distance and field gradient length
+		TString CheckPoint;  // Base name of the checkpoint files of CalField and EventMC ("" = none)
+		Float_t CheckInterval; // Seconds between checkpoints
+#ifndef RASER_BATCH
+		Float_t ShowTol;     // Drawn drift paths deviate at most ShowTol pixels from the steps (0 = every step)
+		Int_t ShowBins;      // Largest number of bins per axis of the drawn geometry (0 = all)
+#endif
+
+		// Output histograms
+		TH1F *pos;           // contribution of the holes to the total drift current
+		TH1F *neg;           // contribution of the electrons  to the total drift current
+		TH1F *sum;	       // total drift current
+
+		// Constructors and destructor
+		KDetector();
+		~KDetector();
+		//_______________________________________________________________________________
+		void SetDriftHisto(Float_t x,Int_t=200);
+		// start declaration followed by solving Poisson's equation.
+		void CalField(Int_t);         
+		void Declaration(Int_t);                 // declaration of boundary conditions
+		Double_t V(int ,int);                    // defining voltage
+		Double_t kappa(int ,int , int , int);    // defining space charge
+
+#ifndef RASER_BATCH
+		void ShowMipIR(Int_t, Int_t=14, Int_t=1);
+		void ShowUserIonization(Int_t, Float_t *, Float_t *, Float_t *, Float_t *, Int_t=14, Int_t=1);
+		void ShowToFile(const char *, Int_t, Int_t=1000, Int_t=1000);
+#endif
+		void Drift(Double_t, Double_t, Double_t, Float_t, KStruct *, Double_t = 0, TRandom * = NULL, Bool_t = kFALSE);
+		void DriftEvents(Int_t, KEvent *, Int_t = 0);
+		void MipIR(Int_t);
+		void EventMC(Int_t, Int_t, const char *);
+		void DepositMC(const char *, const char *, Double_t = 1);
+		Int_t Cluster(KEvent &);
+		Double_t TrapFactor(Float_t charg, Double_t t) {Float_t tau=charg>0?tauh:taue; return tau>0?TMath::Exp(-t/tau):1;};
+		TH3F *GetElectrodeDistance();
+		TH3F *GetTrapMap(Int_t);
+		void ResetTrapping();
+		KResponseMap *GetResponseMap();
+		void ResetResponseMap() {if(RMap!=NULL) delete RMap; RMap=NULL;};
+		void ToRZ(Double_t &, Double_t &, Double_t &);
+
+
+
+		//Configuration functions 
+		// ClassDef(KDetector,1) 
+};
+
+// #include "KDetector.h"
+#include "TFile.h"
+
+#define ABS(x) x>0?x:-x
+#define PREDZNAK(x) x>0?1:-1
+
+#define C1(x,y,z) y3[n]=x+y+z;
+
+#define L1(x) y2[n]=x;
+#define R1(x) y4[n]=x;
+#define U1(x) y5[n]=x;
+#define D1(x) y6[n]=x;
+#define I1(x) y7[n]=x;
+#define O1(x) y8[n]=x;
+
+#define L2(x) y2[n]=2*x;
+#define R2(x) y4[n]=2*x;
+#define U2(x) y5[n]=2*x;
+#define D2(x) y6[n]=2*x;
+#define I2(x) y7[n]=2*x;
+#define O2(x) y8[n]=2*x;
+
+#define C0 y3[n]=1.;
+#define U0 y5[n]=0.;
+#define D0 y6[n]=0.;
+#define R0 y4[n]=0.;
+#define L0 y2[n]=0.;
+#define I0 y7[n]=0.;
+#define O0 y8[n]=0.;
+
+#define  PI  3.1415927
+#define EPS 1.0e-14
+#define STEP_DET_CUR 25e-9
+
+// ClassImp(KDetector)
+
+
+// double **a,*b,*y6,*y2,*y3,*y4,*y5,*y7,*y8;
+
+
+void KDetector::SetDriftHisto(Float_t x, Int_t numbins)
+{
+	if(x<0 || x>10000e-9) 
+		printf("Selected time range out of scope !\n"); 
+	else
+	{
+		if(pos!=NULL) delete pos;
+		pos  = new TH1F("charge+","Positive Charge",numbins,0,x);
+		if(neg!=NULL) delete neg;
+		neg  = new TH1F("charge-","Negative Charge",numbins,0,x); 	
+		if(sum!=NULL) delete sum;
+		sum  = new TH1F("charge","Total Charge",numbins,0,x); 
+
+		sum->SetXTitle("t [s]");  neg->SetXTitle("t [s]"); pos->SetXTitle("t [s]");
+		sum->SetYTitle("I [arb.]");neg->SetYTitle("I [arb.]");pos->SetYTitle("I [arb.]");
+		sum->GetYaxis()->SetTitleOffset(1.4); neg->GetYaxis()->SetTitleOffset(1.4); pos->GetYaxis()->SetTitleOffset(1.4);
+		pos->SetLineColor(2);
+		neg->SetLineColor(4);
+		sum->SetLineColor(1);	
+
+	}
+}
+
+
+
+KDetector::KDetector()
+{
+	//////////////////////////////////////////////////////////////////////
+	// Author: Gregor Kramberger                                        //
+	// Default constructor for KDetector class                           //
+	// Default = no space charge -> default space charge is function     //
+	//////////////////////////////////////////////////////////////////////
+
+	NeffF=new TF3("Profile","x[0]*x[1]*x[2]*0+[0]",0,1000,0,1000,0,1000);
+	NeffF->SetParameter(0,0);
+	NeffH=NULL; //Neff histogram se to NULL
+
+	//set magnetic field to zero
+	for(Int_t i=0;i<3;i++) B[i]=0;
+
+	// setting up default random generator - diffusion
+	ran=new TRandom(33);  
+
+	// Calculation parameters
+	CalErr=1e-6;
+	MaxIter=2000;
+
+	// histograms for storing the drift
+	pos=NULL; neg=NULL; sum=NULL;
+	SetDriftHisto(25e-9);
+
+	// setting up general variables
+	// multiplication 
+	TauE=NULL;
+	TauH=NULL;
+	taue=-1;   //no electron trapping 
+	tauh=-1;   //no hole trapping 
+	MTresh=-1; //no multiplication 
+	BDTresh=1000; // breakdown at a gain of about 1000
+	DiffOffField=8;  // critical field for diffusion to be switched off
+
+	// drift
+
+	Deps=1e-5;       //precision of tracking
+	MaxDriftLen=1e9; // maximum driftlenght in [um]
+	MaxSteps=MAXPOINT-1; // maximum number of steps
+	Integrator=0;    // fixed step drift
+	MipMPV=75;       // mip ionization in silicon [e/um]
+	MipSigma=10;
+	RKTol=0.05;      // adaptive drift: position error per step [um]
+	RKMaxStep=50;    // adaptive drift: largest step [um]
+	EDist=NULL;
+	TrapMap[0]=NULL; TrapMap[1]=NULL;
+	TrapSrc[0]=NULL; TrapSrc[1]=NULL;
+	RMap=NULL;
+	RMapWarned=kFALSE;
+	FastSim=0;       // drift every event
+	RZ=0;            // cartesian mesh
+	Shaper=NULL;     // no readout electronics
+	ClusterTol=0;    // every deposit drifted on its own
+	ClusterFrac=0.2;
+	CheckPoint="";   // no checkpoints
+	CheckInterval=600;
+#ifndef RASER_BATCH
+	ShowTol=0.5;
+	ShowBins=100;
+	ShowHis=NULL;
+#endif
+
+	//MobMod=1;  //Mobility parametrization
+	average=1; //average over waveforms
+	diff=0;    //diffusion
+	SStep=1;   //Step size of simulation
+	Temperature=263; //temperature
+	BreakDown=0; // no breakdown
+	Debug=0;     // bo printing of debug information
+	Voltage2=0;
+	Ramo=new KField();
+	Real=new KField();
+
+	NThreads=0; // parallel drift on all cores
+	Seed=33;    // seed of the parallel random streams
+
+	VelTab=0;  // exact mobility evaluation
+	VTables=new KVelocityTables(Real);
+
+}
+
+
+KDetector::~KDetector()
+{
+	//Destructor of the detector class
+
+	if(NeffF!=NULL) delete NeffF;
+	if(NeffH!=NULL) delete NeffH;
+	if(ran!=NULL) delete ran;
+	if(pos!=NULL) delete pos;
+	if(neg!=NULL) delete neg;
+	if(sum!=NULL) delete sum;
+	if(VTables!=NULL) delete VTables;
+	if(EDist!=NULL) delete EDist;
+	if(TrapMap[0]!=NULL) delete TrapMap[0];
+	if(TrapMap[1]!=NULL) delete TrapMap[1];
+	if(RMap!=NULL) delete RMap;
+	if(Ramo!=NULL) delete Ramo;
+	if(Real!=NULL) delete Real;
+#ifndef RASER_BATCH
+	for(size_t i=0;i<ShowGr.size();i++) delete ShowGr[i];
+	for(size_t i=0;i<ShowPl.size();i++) delete ShowPl[i];
+	if(ShowHis!=NULL) delete ShowHis;
+#endif
+
+}
+
+void KDetector::CalField(Int_t what)
+{
+	double err;
+	int iteracije,i;
+	int num=nx*ny*nz,dim[3];
+	Double_t *x;
+	//booking memory
+	b=dvector(1,num); y6=dvector(1,num); y2=dvector(1,num); 
+	y3=dvector(1,num); y4=dvector(1,num); y5=dvector(1,num);
+	y7=dvector(1,num); y8=dvector(1,num);
+	x=dvector(1,num);    
+	// the geometry may have changed
+	if(EDist!=NULL) {delete EDist; EDist=NULL;}
+	ResetResponseMap();
+	// Setting up the boundary conditions
+	printf("Setting up matrix ... \n");
+	Declaration(what);
+	printf("Solving matrix ...\n");
+	// matrix solving
+	for(i=1;i<=num;i++) x[i]=1.;
+	dim[0]=nx; dim[1]=ny; dim[2]=nz;
+	if(CheckPoint!="")
+	{
+		// a pre-empted solution continues from the last checkpoint
+		KCheckpoint ck(Form("%s.field%d",CheckPoint.Data(),what),CheckInterval);
+		linbcg(num,dim,b,x,1,CalErr,MaxIter,&iteracije,&err,&ck);
+		ck.Remove();
+	}
+	else linbcg(num,dim,b,x,1,CalErr,MaxIter,&iteracije,&err);
+	// Calculating the field
+	if(!what)
+	{
+		Real->U=MapToGeometry(x);
+		Real->CalField();
+	}
+	else
+	{
+		// Scale back to 1 from 1000 when storing the potential
+		Ramo->U=MapToGeometry(x,1e-4);
+
+		Ramo->CalField();
+	}
+	// Freeing the memory
+	free_dvector(x, 1,num);   free_dvector(b, 1,num);   free_dvector(y2, 1,num); 
+	free_dvector(y3, 1,num);  free_dvector(y4, 1,num);  free_dvector(y5, 1,num); 
+	free_dvector(y6, 1,num);  free_dvector(y7, 1,num);  free_dvector(y8, 1,num);
+}
+
+void KDetector::Declaration(Int_t dowhat)
+{
+	// New declaration for a general detector class 
+	Int_t i,j,k,val;
+	Double_t Rd,Ld,Dd,Ud,Od,Id;
+	Double_t PRd,PLd,PDd,PUd,POd,PId;
+
+	Double_t Xr=0,Yr=0,Zr=0;
+	Double_t Xc=0,Yc=0,Zc=0;
+	Double_t Xl=0,Yl=0,Zl=0;
+	Int_t ii,jj,kk;
+	Double_t fac,r=0;
+
+	long n=0;
+	Int_t num=nx*ny*nz;
+	KProfileTimer prof(KProfile::kDeclaration);
+
+	for (k=1;k<=nz;k++)
+		for (j=1;j<=ny;j++)
+			for(i=1;i<=nx;i++)
+			{
+				n=(k-1)*nx*ny+(j-1)*nx+i; //Get index of the matrix element
+				if(j-1<1) jj=1;  else jj=j-1;
+				if(i-1<1) ii=1;  else ii=i-1; 
+				if(k-1<1) kk=1;  else kk=k-1; 
+
+				/////////// DEFINE STEPS IN X //////////////////////////////////////
+				Rd=fabs(EG->GetXaxis()->GetBinCenter(i+1)-EG->GetXaxis()->GetBinCenter(i));
+				Ld=fabs(EG->GetXaxis()->GetBinCenter(i)-EG->GetXaxis()->GetBinCenter(i-1));
+				if(i+1>nx) Rd=Ld; if(i-1<1) Ld=Rd;
+
+				////////// DEFINE PEMITIVITY IN X - normal surface ////////////////////////////
+				PRd=GetPerm(DM->GetBinContent(i,j,k))+GetPerm(DM->GetBinContent(i,jj,k));
+
+				if(nz!=1) 
+				{
+					PRd+=GetPerm(DM->GetBinContent(i,j,kk))+GetPerm(DM->GetBinContent(i,jj,kk));
+					PRd/=4;
+				} else PRd/=2;
+
+				PLd=GetPerm(DM->GetBinContent(ii,j,k))+GetPerm(DM->GetBinContent(ii,jj,k));
+				if(nz!=1) 
+				{
+					PLd+=GetPerm(DM->GetBinContent(ii,j,kk))+GetPerm(DM->GetBinContent(ii,jj,kk));
+					PLd/=4;
+				} else PLd/=2;
+
+				/////////// DEFINE STEPS IN Y //////////////////////////////////////
+
+				Ud=fabs(EG->GetYaxis()->GetBinCenter(j+1)-EG->GetYaxis()->GetBinCenter(j));
+				Dd=fabs(EG->GetYaxis()->GetBinCenter(j)-EG->GetYaxis()->GetBinCenter(j-1));
+				if(j+1>ny) Ud=Dd; if(j-1<1) Dd=Ud;
+
+				////////// DEFINE PEMITIVITY IN Y ////////////////////////////
+				PUd=GetPerm(DM->GetBinContent(i,j,k))  +GetPerm(DM->GetBinContent(ii,j,k));
+				if(nz!=1) 
+				{
+					PUd+=GetPerm(DM->GetBinContent(i,j,kk))+GetPerm(DM->GetBinContent(ii,j,kk));
+					PUd/=4;
+				} else PUd/=2;
+
+				PDd=GetPerm(DM->GetBinContent(i,jj,k))+GetPerm(DM->GetBinContent(ii,jj,k));
+				if(nz!=1) 
+				{
+					PDd+=GetPerm(DM->GetBinContent(i,jj,kk))+GetPerm(DM->GetBinContent(ii,jj,kk));
+					PDd/=4;
+				} else PDd/=2;
+
+				/////////// DEFINE STEPS IN Z //////////////////////////////////////
+
+				Od=fabs(EG->GetZaxis()->GetBinCenter(k+1)-EG->GetZaxis()->GetBinCenter(k));
+				Id=fabs(EG->GetZaxis()->GetBinCenter(k)-EG->GetZaxis()->GetBinCenter(k-1));
+				if(k+1>nz) Od=Id; 
+				if(k-1<1) Id=Od;
+
+				//////////DEFINE PEMITIVITY IN Z ////////////////////////////
+				if(nz!=1)
+				{
+					POd=GetPerm(DM->GetBinContent(i,jj,k))+GetPerm(DM->GetBinContent(i,j,k))+
+						GetPerm(DM->GetBinContent(ii,j,k))+GetPerm(DM->GetBinContent(ii,jj,k));
+
+					PId=GetPerm(DM->GetBinContent(i,jj,kk))+GetPerm(DM->GetBinContent(i,j,kk))+
+						GetPerm(DM->GetBinContent(ii,j,kk))+GetPerm(DM->GetBinContent(ii,jj,kk));
+
+					POd/=4;
+					PId/=4;
+
+				}
+				///////////
+
+				if(dowhat==1) {PRd=1; PLd=1; PUd=1; PDd=1; POd=1; PId=1;}
+
+				Xr=PRd/(0.5*Rd*(Rd+Ld));
+				Xl=PLd/(0.5*Ld*(Rd+Ld));
+				if(RZ)
+				{
+					// r-z: (1/r) d/dr (r eps dU/dr) - the flux crosses the faces of the
+					// ring at r+Rd/2 and r-Ld/2, none crosses the axis and the outer
+					// surface of the cell
+					r=EG->GetXaxis()->GetBinCenter(i);
+					Xr*=i<nx?(r+Rd/2)/r:0;
+					Xl*=i>1?(r-Ld/2)/r:0;
+				}
+				Xc=-(Xr+Xl);
+				Yr=PUd/(0.5*Ud*(Ud+Dd));
+				Yl=PDd/(0.5*Dd*(Ud+Dd));  Yc=-(Yr+Yl);
+
+				if(nz!=1)
+				{
+					Zr=POd/(0.5*Od*(Od+Id));
+					Zl=PId/(0.5*Id*(Od+Id));  Zc=-(Zr+Zl);
+				} 
+
+				//////////
+
+				b[n]=0.;
+				val=EG->GetBinContent(i,j,k);
+				if(RZ) val&=~(256|512);   // no mirror at the axis and the outer surface
+
+				if(nz==1) { C1(Xc,Yc,0) I0 O0 } 
+				else      { C1(Xc,Yc,Zc) I1(Zl) O1(Zr) }
+
+				R1(Xr) U1(Yr) L1(Xl) D1(Yl) 
+
+
+					if(val&4)            {D0 b[n]-=V(EG->GetBinContent(i,j-1,k),dowhat)*Yl;}
+				if(val&8)            {U0 b[n]-=V(EG->GetBinContent(i,j+1,k),dowhat)*Yr;}
+				if(val&16)           {L0 b[n]-=V(EG->GetBinContent(i-1,j,k),dowhat)*Xl;}
+				if(val&32)           {R0 b[n]-=V(EG->GetBinContent(i+1,j,k),dowhat)*Xr;}
+				if(val&1024)         {I0 b[n]-=V(EG->GetBinContent(i,j,k-1),dowhat)*Zl;}
+				if(val&2048)         {O0 b[n]-=V(EG->GetBinContent(i,j,k+1),dowhat)*Zr;}
+
+
+				if(val&64)           {U2(Yr) D0 if(val&8)    {U0 b[n]-=V(EG->GetBinContent(i,j+1,k),dowhat)*Yr;}}
+				if(val&128)          {D2(Yl) U0 if(val&4)    {D0 b[n]-=V(EG->GetBinContent(i,j-1,k),dowhat)*Yl;}}
+				if(val&256)          {R2(Xr) L0 if(val&32)   {R0 b[n]-=V(EG->GetBinContent(i+1,j,k),dowhat)*Xr;}}
+				if(val&512)          {L2(Xl) R0 if(val&16)   {L0 b[n]-=V(EG->GetBinContent(i-1,j,k),dowhat)*Xl;}}
+				if(val&4096)         {O2(Zr) I0 if(val&2048) {O0 b[n]-=V(EG->GetBinContent(i,j,k+1),dowhat)*Zr;}}
+				if(val&8192)         {I2(Zl) O0 if(val&1024) {I0 b[n]-=V(EG->GetBinContent(i,j,k-1),dowhat)*Zl;}}
+
+
+				b[n]-=kappa(i,j,k,dowhat);
+				// r-z: the row times r (the flux balance of the ring, half a ring
+				// at a mirrored surface) makes the matrix symmetric as linbcg
+				// expects
+				if(RZ)
+				{
+					fac=val&(64|128)?r/2:r;
+					y2[n]*=fac; y3[n]*=fac; y4[n]*=fac; y5[n]*=fac; y6[n]*=fac; b[n]*=fac;
+				}
+				if(val&1 || val&2 || val>=32768)   {U0 D0 L0 R0 C0 O0 I0 b[n]=V(val,dowhat);}   
+				//if(j<=2 && i<=2) printf("stevilki: i=%d, j=%d, k=%d X=(%f %f ::%f %f), Y(%f %f :: %f %f), Z(%f %f :: %f %f) y[2,3,4,5,6,7,8]=%f %f %f %f %f %f %f :: b[n]=%f :: %d\n",i,j,k,Xr,Xl,Ld,Rd,Yr,Yl,Dd,Ud,Zr,Zl,Id,Od,y2[n],y3[n],y4[n],y5[n],y6[n],y7[n],y8[n],b[n],Mat);
+				//      if(k==nz && (j==2 || j==ny-1)) printf("stevilki: i=%d, j=%d, k=%d X=(%f %f ::%f %f), Y(%f %f :: %f %f), Z(%f %f :: %f %f) y[2,3,4,5,6,7,8]=%f %f %f %f %f %f %f :: b[n]=%f\n",i,j,k,Xr,Xl,Ld,Rd,Yr,Yl,Dd,Ud,Zr,Zl,Id,Od,y2[n],y3[n],y4[n],y5[n],y6[n],y7[n],y8[n],b[n]);
+			}
+
+}
+
+double KDetector::V(int val, int dowhat)
+{
+	double voltage;
+	int k=0;
+	if(dowhat==0) 
+	{
+		if(val&1) voltage=0;  
+		if(val&2) voltage=Voltage;
+		if(val & 32768) 
+			//if bit 15 is on - many voltages
+			voltage=Voltages[val>>16];
+	}
+	else
+	{
+		// numerical calculation converges faster if 1000 is used instead of 1
+		// therefore the potential is scaled after calculation to 1
+		if(val&16384) voltage=10000; else voltage=0;
+	}
+	return voltage;
+}
+
+Double_t KDetector::kappa(int i,int j, int k,  int dowhat )
+{
+	//Sets the effective space charge values for given point in the mesh!
+	Double_t x,y,z,ret=0;
+
+	//  if(NeffF!=NULL && NeffH!=NULL) printf("Warning:: Histogram values will be taken for Neff!\n");
+
+	//Position in space
+	x=EG->GetXaxis()->GetBinCenter(i);
+	y=EG->GetYaxis()->GetBinCenter(j);
+	z=EG->GetZaxis()->GetBinCenter(k);
+
+	if (dowhat==0) 
+	{
+		if(NeffF!=NULL)  // Neff=v enotah [um-3]
+			//            ret=(NeffF->Eval(x,y,z)*1e6*e_0)/(KMaterial::Perm()*perm0); /*printf("i=%d,j=%d,y=%e\n",i,j,y);*/
+			ret=(NeffF->Eval(x,y,z)*1e6*e_0)/(perm0); /*printf("i=%d,j=%d,y=%e\n",i,j,y);*/
+
+		if(NeffH!=NULL)
+			//   ret=(NeffH->GetBinContent(i,j,k)*1e6*e_0)/(KMaterial::Perm()*perm0);
+			ret=(NeffH->GetBinContent(i,j,k)*1e6*e_0)/(perm0);
+
+	}
+
+	//if (dowhat==0) if(j>nc) y=(Step*Step*1e-12)/(Si_mue*Ro*perm*perm0); else y=-(Step*Step*1e-12)/(Si_mue*Ro*perm*perm0);
+	else 
+		ret=0.;
+	return ret;
+}
+
+#ifndef RASER_BATCH
+void KDetector::ShowMipIR(Int_t div, Int_t color,Int_t how)
+{
+	Float_t *x=new Float_t [div];
+	Float_t *y=new Float_t [div];
+	Float_t *z=new Float_t [div];
+	Float_t *Q=new Float_t [div];
+
+	for(Int_t i=0;i<div;i++) 
+	{
+		x[i]=((exp[0]-enp[0])/div)*i+enp[0]+(exp[0]-enp[0])/(2*div);
+		y[i]=((exp[1]-enp[1])/div)*i+enp[1]+(exp[1]-enp[1])/(2*div);
+		z[i]=((exp[2]-enp[2])/div)*i+enp[2]+(exp[2]-enp[2])/(2*div);
+		Q[i]=1;
+	}
+	ShowUserIonization(div, x,y,z,Q,color,how);
+	delete [] x; delete [] y; delete [] z; delete [] Q;
+}
+
+void KDetector::ShowUserIonization(Int_t div, Float_t *x, Float_t *y, Float_t *z, Float_t *Q, Int_t color,Int_t how)
+{
+	// The simulation of the drift for the minimum ionizing particles. 
+	// A track is devided into Int_ div buckets. Each bucket is drifted in the field. The
+	// induced currents for each carrier is calculated as the sum  all buckets. 
+	// The currents (weighted by Q) are stored in pos, neg and sum.
+	// The paths are drawn with the points needed for a deviation below ShowTol
+	// pixels, the geometry with at most ShowBins bins per axis. The graphics
+	// objects belong to the detector and are reused by the next call.
+
+	Int_t i,c,n,np=0;
+	Double_t tol=0;
+	KStruct seg;
+	KSignal sig(sum);
+	seg.Signal=&sig;
+
+	// Draw histograms 
+
+	if(ShowHis!=NULL) {delete ShowHis; ShowHis=NULL;}
+	if(EG!=NULL) 
+	{ 
+		if(nz==1) 
+		{
+			ShowHis=KHisProject(EG,3,how);
+			ShowHis->Draw("COL");
+		}
+		else
+		{
+			ShowHis=GetGeom(ShowBins);
+			ShowHis->SetFillColor(color);
+			ShowHis->Draw("iso");
+		}
+
+		// a pixel of the pad is about the largest detector size over the pad size
+		if(ShowTol>0)
+		{
+			Double_t ext=0;
+			TAxis *ax[3]={EG->GetXaxis(),EG->GetYaxis(),EG->GetZaxis()};
+			for(i=0;i<(nz==1?2:3);i++) ext=TMath::Max(ext,ax[i]->GetXmax()-ax[i]->GetXmin());
+			tol=ShowTol*ext/(gPad!=NULL?TMath::Min((Int_t)gPad->GetWw(),(Int_t)gPad->GetWh()):1000);
+		}
+	} 
+
+	// Draw drift paths: holes solid red, electrons blue (dotted in 2D)
+
+	for(i=0;i<div;i++) 
+	{
+		if(Debug)   printf("Entry Point: %f %f %f \n",x[i],y[i],z[i]);
+		seg.Weight=Q[i];
+		for(c=1;c>=-1;c-=2)
+		{
+			Drift(x[i],y[i],z[i],c,&seg);
+			n=Decimate(seg.Steps,&seg.Xtrack[1],&seg.Ytrack[1],&seg.Ztrack[1],tol);
+			if(nz==1)
+			{
+				if(np>=(Int_t)ShowGr.size()) ShowGr.push_back(new TGraph());
+				TGraph *gr=ShowGr[np];
+				gr->Set(n);
+				for(Int_t k=0;k<n;k++) gr->SetPoint(k,ShowBuf[3*k],ShowBuf[3*k+1]);
+				gr->SetLineColor(c>0?2:4);
+				gr->SetLineStyle(c>0?1:3);
+				gr->Draw("L");
+			}
+			else
+			{
+				if(np>=(Int_t)ShowPl.size()) ShowPl.push_back(new TPolyLine3D());
+				TPolyLine3D *gr3D=ShowPl[np];
+				gr3D->SetPolyLine(n,&ShowBuf[0]);
+				gr3D->SetLineStyle(1);  
+				gr3D->SetLineColor(c>0?2:4); 
+				gr3D->Draw("SAME"); 
+			}
+			np++;
+		}
+	}
+	sig.Store(pos,neg,sum);
+	if(Debug) printf("ShowUserIonization: %d paths drawn\n",np);
+}
+
+Int_t KDetector::Decimate(Int_t n, Float_t *x, Float_t *y, Float_t *z, Double_t tol)
+{
+	// Puts the points of a path needed to stay within tol of all steps
+	// (Douglas-Peucker) into ShowBuf as x,y,z triples, returns their number
+	Int_t i,a,b,m,nk=0;
+	Double_t d,dmax,l2,t,u[3],w[3];
+	std::vector<char> keep(n>0?n:1,tol>0?0:1);
+	std::vector<std::pair<Int_t,Int_t> > st;
+
+	if(n>0 && tol>0)
+	{
+		keep[0]=keep[n-1]=1;
+		st.push_back(std::make_pair(0,n-1));
+	}
+	while(!st.empty())
+	{
+		a=st.back().first; b=st.back().second; st.pop_back();
+		if(b-a<2) continue;
+		u[0]=x[b]-x[a]; u[1]=y[b]-y[a]; u[2]=z[b]-z[a];
+		l2=u[0]*u[0]+u[1]*u[1]+u[2]*u[2];
+		dmax=-1; m=a;
+		for(i=a+1;i<b;i++)
+		{
+			w[0]=x[i]-x[a]; w[1]=y[i]-y[a]; w[2]=z[i]-z[a];
+			t=l2>0?(w[0]*u[0]+w[1]*u[1]+w[2]*u[2])/l2:0;
+			t=TMath::Max(0.,TMath::Min(1.,t));
+			w[0]-=t*u[0]; w[1]-=t*u[1]; w[2]-=t*u[2];
+			d=w[0]*w[0]+w[1]*w[1]+w[2]*w[2];
+			if(d>dmax) {dmax=d; m=i;}
+		}
+		if(dmax>tol*tol)
+		{
+			keep[m]=1;
+			st.push_back(std::make_pair(a,m));
+			st.push_back(std::make_pair(m,b));
+		}
+	}
+
+	ShowBuf.resize(3*(n>0?n:1));
+	for(i=0;i<n;i++)
+		if(keep[i]) {ShowBuf[3*nk]=x[i]; ShowBuf[3*nk+1]=y[i]; ShowBuf[3*nk+2]=z[i]; nk++;}
+	return nk;
+}
+
+void KDetector::ShowToFile(const char *name, Int_t div, Int_t w, Int_t h)
+{
+	// Draws the mip track (ShowMipIR) offscreen and saves it, the type
+	// of the image is given by the file name (.png, .pdf, ...)
+	Bool_t batch=gROOT->IsBatch();
+	gROOT->SetBatch(kTRUE);
+	TCanvas c("raser_show","raser",w,h);
+	c.cd();
+	ShowMipIR(div);
+	c.SaveAs(name);
+	gROOT->SetBatch(batch);
+}
+#endif
+
+void KDetector::Drift(Double_t sx, Double_t sy, Double_t sz, Float_t charg, KStruct *seg, Double_t t0, TRandom *rnd, Bool_t determ)
+{
+	//Drift simulation for a point charge (Float_t charg;)
+	//starting from ( sx,sy, sz)
+	//KStruct *seg is the structure where the  the drift paths, drift times and induced cahrges are stored
+	//TRandom *rnd is the generator for diffusion and trapping (default: the detector's)
+	//a KRandom is set to the counter of each step, so that the drift of a carrier depends only on its key
+	//determ=kTRUE drifts without diffusion, position dependent trapping and multiplication (KResponseMap)
+
+	Double_t Stime=0;                       // Step time
+	Double_t difx=0,dify=0,difz=0;          // diffusion steps in all directions
+	Double_t sigma;                         // sigma of the diffusion step  
+	Double_t cx=0,cy=0,cz=0;                // current position of the charge bucket
+	Double_t vel=0;                         // drift velocity
+	Double_t vth2=0;                        // thermal velocity sqared
+	Double_t depth=0,trap=0;                // optical depth of trapping and the depth at which the carrier is trapped
+	TH3F *tmap;                             // trapping rate map of the carrier (NULL - no trapping)
+	Double_t t=0;                           // drift time
+	Double_t tp=0;                          // drift time at the start of the step
+	KCarrier mul(0,0,0,0,0);                // charge created by impact ionization not yet handed out
+	Double_t sumc=0;                        // total induced charge
+	Double_t ncx=0,ncy=0,ncz=0;             // next position of the charge bucket   
+	Double_t deltacx,deltacy,deltacz;       // drift step due to drift
+
+	Int_t st=0;                             // current step
+	Int_t ishit=0;                          // local counter of the step
+	Int_t j=0;                              // index of the step in KStruct
+	TVector3 EE;                            // Set up electric field vector
+	TVector3 EEN;                           // Set up electric field vector
+	TVector3 FF;                            // Combined drift field
+	Float_t pathlen=0;                      // pathlength
+	Float_t WPot;                           // current ramo potential
+	Float_t NWPot;                          // ramo potential at the next position
+	Double_t neff;                          // effective doping at the current position
+	KVelocityTable *vt=NULL;                // drift velocity table in use (VelTab=1)
+	Int_t vtmod=-1;                         // mobility model of the table in use
+	Float_t vttemp=-1;                      // temperature of the table in use
+	Int_t mat=0;                            // material at the current position
+	Int_t mobmod;                           // mobility model of the material
+	Float_t temp;                           // temperature of the material
+	Double_t vtneff=-1;                     // doping of the table in use
+	KRandom *kr;                            // rnd if it is a counter-based generator
+
+	// Inclusion of Magnetic field 28.8.2001 - revised 15.10.2012
+	TVector3 BB(B);                           // Create a magnetic field vector
+	Float_t muhe=1650;                        // parametrization of the magnetic field 
+	Float_t muhh=310;	                  // is based on simply this mobility parameters
+
+	// Start time in the  absolute domain (used for delayed charge generation in multiplication 
+
+	t=t0;
+	if(rnd==NULL) rnd=ran;
+	if(RZ) ToRZ(sx,sy,sz);
+	KProfileTimer prof(KProfile::kDrift);
+	if(Integrator==1) {DriftRK(sx,sy,sz,charg,seg,t0,rnd,determ); return;}
+	kr=dynamic_cast<KRandom *>(rnd);
+
+	// Intitialize KStruct class and its members 
+
+	seg->Clear();
+	seg->PCharge=(Int_t) charg;
+	tmap=determ?NULL:GetTrapMap(charg<0);
+	if(kr!=NULL) kr->SetCounter(0);
+	if(tmap!=NULL) trap=-TMath::Log(rnd->Rndm());
+
+	// start drift
+
+	cx=sx; cy=sy; cz=sz;                   // set current coordinates
+	j=seg->Slot(st);
+	seg->Xtrack[j]=cx; seg->Ytrack[j]=cy; seg->Ztrack[j]=cz;    // put the first point in the KStruct 
+	seg->Time[j]=t;  seg->Charge[j]=0; 
+
+	Real->CalFieldXYZ(cx,cy,cz,&EE);        // Get the electric field vector 
+	EEN=EE;                                // Get the electric field vector for next step - here the default is the same 12.9.2018
+	seg->Efield[j]=EE.Mag();               // Store the magnitude of E field
+	seg->NField=1;
+	WPot=Ramo->CalPotXYZ(cx,cy,cz);        // the ramo potential is carried from step to step
+
+
+
+
+
+
+	//printf("%d %f : (%f %f %f)\n",st,charg,cx,cy,cz);
+
+	do 
+	{
+		//    printf("Calculate field\n");
+		st++;
+		j=seg->Slot(st);
+		if(kr!=NULL) kr->SetCounter(st);
+		if(charg>0)
+			FF=EE+muhh*EE.Cross(BB); else 
+				FF=EE-muhe*EE.Cross(BB); 
+		// "-muhe" stands for the fact that at the same 
+		// field the drift direction has changed due to different charge
+
+		//printf("Field : %f %f %f (%f %f %f)  ---- ",FF[0],FF[1],FF[2],(*EE)[0],(*EE)[1],(*EE)[2]);
+		if(FF.Mag()!=0)
+		{
+			deltacy=-SStep*charg*FF.y()/FF.Mag();   // deltay 
+			deltacx=-SStep*charg*FF.x()/FF.Mag();   // deltax
+			deltacz=-SStep*charg*FF.z()/FF.Mag();   // deltaz
+		}
+		else { deltacx=0; deltacy=0; deltacz=0; }
+
+		//    printf("Calculate velocity \n");
+
+		if(DM!=NULL)
+			mat=DM->GetBinContent(DM->FindBin(cx,cy,cz)); 
+		else mat=0;
+		mobmod=MobMod(mat);
+		temp=GetTemperature(mat);
+
+		//      EEN=Real->CalFieldXYZ(cx+deltacx,cy+deltacy,cz+deltacz); // get field & velocity at new location //12.9.2018
+		Real->CalFieldXYZ(cx+deltacx,cy+deltacy,cz+deltacz,&EEN); // get field & velocity at new location
+		seg->NField++;
+		neff=TMath::Abs(NeffF->Eval(cx,cy,cz));
+		if(VelTab)
+		{
+			if(vt==NULL || mobmod!=vtmod || temp!=vttemp || neff!=vtneff)
+			{vtmod=mobmod; vttemp=temp; vtneff=neff; vt=VTables->Get(vtmod,charg,temp,neff);}
+			vel=vt->Velocity((EEN.Mag()+EE.Mag())/2);
+		}
+		else
+			vel=Real->DriftVelocity( (EEN.Mag()+EE.Mag())/2,charg,temp,neff,mobmod);
+
+		//printf("Calculate vel: %e EEN = %e ::: ",vel, EEN.Mag());
+		if(vel==0) {
+			deltacx=0; deltacy=0; deltacz=0; 
+			difx=0; dify=0; difz=0;
+			ishit=9;
+		} 
+		else 
+			if(diff && !determ && !(DiffOffField<EEN.Mag() && MTresh>1))  
+				// is diffusion ON - if yes then include it
+				// if multiplication is ON the diffusion must be switched 
+				// off when the field gets large enough
+			{
+				Stime=SStep*1e-4/vel; // calcualte step time  
+				// Mobility() expects V/cm while EE is in V/um - the table takes V/um
+			if(VelTab) sigma=TMath::Sqrt(2*Kboltz*vt->Mobility(EE.Mag()*1e-4)*temp*Stime);
+			else sigma=TMath::Sqrt(2*Kboltz*Real->Mobility(EE.Mag(),temp,charg,neff,mobmod)*temp*Stime); 
+				dify=rnd->Gaus(0,sigma)*1e4; 
+				difx=rnd->Gaus(0,sigma)*1e4;
+				if(nz!=1 || RZ) difz=rnd->Gaus(0,sigma)*1e4; else difz=0;
+			} else {difx=0; dify=0; difz=0;}
+
+		if(RZ)
+		{
+			// r-z: z of the mesh is the azimuthal direction, a step along it
+			// or across the axis only changes the radius
+			ncx=TMath::Sqrt((cx+deltacx+difx)*(cx+deltacx+difx)+(deltacz+difz)*(deltacz+difz));
+			if(ncx>=GetUpEdge(0)) ncx=GetUpEdge(0);
+			deltacz=0; difz=0;
+		} else
+		if((cx+deltacx+difx)>=GetUpEdge(0)) ncx=GetUpEdge(0); else
+			if((cx+deltacx+difx)<GetLowEdge(0)) ncx=GetLowEdge(0); else
+				ncx=cx+(deltacx+difx);;
+
+		if((cy+deltacy+dify)>=GetUpEdge(1)) ncy=GetUpEdge(1); else
+			if((cy+deltacy+dify)<GetLowEdge(1)) ncy=GetLowEdge(1); else
+				ncy=cy+(deltacy+dify);
+
+		if((cz+deltacz+difz)>=GetUpEdge(2)) ncz=GetUpEdge(2); else
+			if((cz+deltacz+difz)<GetLowEdge(2)) ncz=GetLowEdge(2); else
+				ncz=cz+(deltacz+difz);
+
+		if(Debug) printf("%d %f E=%e (%e %e %e): x:%f->%f y:%f->%f z:%f->%f (%f %f %f)(%f %f %f) : Mat=%d :: ",st,charg,EEN.Mag(),EEN.x(),EEN.y(),EEN.z(),cx,ncx,cy,ncy,cz,ncz,deltacx,deltacy,deltacz,dify,dify,difz,mat);
+
+		NWPot=Ramo->CalPotXYZ(ncx,ncy,ncz);
+		seg->Charge[j]=charg*(NWPot-WPot);
+
+		//////////////////// calculate strict trapping, e.g. depending on position ///////////////////////
+		// the trapping rate is integrated over the drift time (optical depth) and the carrier
+		// is trapped where it exceeds an exponentially distributed depth drawn at the start
+		if(tmap!=NULL && vel!=0)
+		{
+			// vth2=3*Kboltz*Temperature*Clight*Clight/(511e3*EmeC(mat))*1e4*0;
+			depth+=SStep*1e-4/TMath::Sqrt(vel*vel+vth2)*tmap->GetBinContent(tmap->FindBin((ncx+cx)/2,(ncy+cy)/2,(ncz+cz)/2));
+			if(depth>trap) ishit=12;
+		}
+		/////////////////////////////////////////////////////////////////////////////////////////////////////
+		cx=ncx; cy=ncy; cz=ncz;
+
+		sumc+=seg->Charge[j];
+
+
+		tp=t;
+		if(vel!=0) 
+		{
+			t=t+SStep*1e-4/vel; //else t+=Stime;
+			pathlen+=SStep;
+		}
+
+		// induced current over the step (signal mode)
+		if(seg->Signal!=NULL) seg->Signal->Fill(tp,t,seg->Weight*seg->Charge[j]*TrapFactor(charg,(tp+t)/2-t0),charg);
+
+		// impact ionization along the step (avalanche mode)
+		if(MTresh>1 && !determ) Multiply(seg,j,(EEN.Mag()+EE.Mag())/2,temp,charg,vel!=0?SStep:0,cx,cy,cz,t,mul);
+
+		seg->Xtrack[j]=cx;
+		seg->Ytrack[j]=cy;
+		seg->Ztrack[j]=cz;
+		seg->Time[j]=t;
+
+		//    EE=Real->CalFieldXYZ(cx,cy,cz);     //12.9.2018
+		Real->CalFieldXYZ(cx,cy,cz,&EE);     //12.9.2018
+		seg->NField++;
+		seg->Efield[j]=EE.Mag();
+
+		// Checking for termination of the drift //// 
+
+		WPot=NWPot;
+		if(WPot>(1-Deps)) ishit=1;
+		// if(TMath::Abs(WPot)<Deps) ishit=2;
+		if(cx<= GetLowEdge(0) && !RZ) ishit=3;
+		if(cx>=  GetUpEdge(0)) ishit=4;
+		if(cy<= GetLowEdge(1)) ishit=5;
+		if(cy>= GetUpEdge(1))  ishit=6;
+		if(cz<= GetLowEdge(2)) ishit=7;
+		if(cz>= GetUpEdge(2))  ishit=8;
+		if(pathlen>MaxDriftLen) ishit=11;
+		if(MaxSteps>0 && st>=MaxSteps) ishit=20;   
+
+		if(Debug) printf("(t=%e, vel=%e, velth=%e) [Ch=%f ChInt=%f Depth=%f/%f] Ishit=%d \n",t,vel,TMath::Sqrt(vth2),seg->Charge[j],sumc,depth,trap,ishit);
+
+	} while (!ishit); // Do until the end of drift
+
+	if(mul.q>0) seg->Sec.push_back(mul);
+
+	(*seg).Xlenght=pathlen; (*seg).Ylenght=pathlen; 
+	(*seg).TTime=t; (*seg).TCharge=sumc; (*seg).Steps=st; (*seg).Stop=ishit;
+	KProfile::AddStop(ishit,st);
+
+	return;
+}
+
+void KDetector::ToRZ(Double_t &x, Double_t &y, Double_t &z)
+{
+	// 3D position around the axis x=y=0 of an r-z detector to its mesh:
+	// (radius, depth, middle of the single z bin)
+	Double_t r=TMath::Sqrt(x*x+y*y);
+	y=z; x=r; z=(GetLowEdge(2)+GetUpEdge(2))/2;
+}
+
+TH3F *KDetector::GetElectrodeDistance()
+{
+	// Distance to the nearest electrode used to bound the adaptive drift
+	// steps; built on first use and dropped when the field is recalculated.
+	if(EDist==NULL) EDist=ElectrodeDistance();
+	return EDist;
+}
+
+TH3F *KDetector::GetTrapMap(Int_t c)
+{
+	// Trapping rate 1/tau [1/s] of holes (c=0, TauH) or electrons (c=1,
+	// TauE) at the bin centers of the geometry, so that the drift does not
+	// evaluate TauE/TauH at every step. Sampled on first use and again when
+	// TauE/TauH point to another function; call ResetTrapping() after
+	// changing the parameters of the same function. NULL without trapping.
+	Int_t i,j,k;
+	Double_t tau;
+	TF3 *f=c?TauE:TauH;
+	if(TauE==NULL || TauH==NULL || EG==NULL) return NULL;
+	if(TrapMap[c]!=NULL && TrapSrc[c]==f) return TrapMap[c];
+
+	if(TrapMap[c]!=NULL) delete TrapMap[c];
+	TrapMap[c]=new TH3F(); EG->Copy(*TrapMap[c]); TrapMap[c]->Reset();
+	TAxis *ax=EG->GetXaxis(), *ay=EG->GetYaxis(), *az=EG->GetZaxis();
+	for(k=1;k<=nz;k++)
+		for(j=1;j<=ny;j++)
+			for(i=1;i<=nx;i++)
+			{
+				tau=f->Eval(ax->GetBinCenter(i),ay->GetBinCenter(j),az->GetBinCenter(k));
+				TrapMap[c]->SetBinContent(i,j,k,tau>0?1/tau:0);
+			}
+	TrapSrc[c]=f;
+	return TrapMap[c];
+}
+
+void KDetector::ResetTrapping()
+{
+	// drops the trapping maps; they are sampled again on the next drift
+	for(Int_t c=0;c<2;c++)
+	{
+		if(TrapMap[c]!=NULL) delete TrapMap[c];
+		TrapMap[c]=NULL; TrapSrc[c]=NULL;
+	}
+}
+
+KResponseMap *KDetector::GetResponseMap()
+{
+	// Drift tables used with FastSim=1; built on first use and dropped by
+	// CalField. Call ResetResponseMap() after changing other drift
+	// parameters (temperature, step, mobility, drift histograms ...).
+	// The tables hold deterministic drifts: with diffusion, TauE/TauH or
+	// multiplication on there are none (NULL) and every event is drifted.
+	if(diff || TauE!=NULL || TauH!=NULL || MTresh>1)
+	{
+		if(!RMapWarned) printf("KDetector: FastSim ignored, the response tables have no diffusion, TauE/TauH or multiplication\n");
+		RMapWarned=kTRUE;
+		ResetResponseMap();
+		return NULL;
+	}
+	if(RMap==NULL) {RMap=new KResponseMap(this); RMap->Build(); RMap->Print();}
+	return RMap;
+}
+
+Double_t KDetector::DriftRate(Double_t *X, Float_t charg, Int_t mobmod, Float_t temp, Double_t neff, KVelocityTable *vt, Double_t *dY, Int_t &nfield)
+{
+	// Right hand side of the drift equations along the path length s [um]:
+	// dY[0-2] = dx/ds (unit vector along the drift), dY[3] = dt/ds [s/um]
+	// and dY[4] = |E| [V/um] at X. Returns the drift velocity [cm/s], which
+	// is 0 where the carrier can not move (then dY[0-3] are 0).
+	Float_t E[4],F[3],xc[3],f;
+	Int_t i;
+	for(i=0;i<3;i++) xc[i]=TMath::Min(TMath::Max((Float_t)X[i],GetLowEdge(i)),GetUpEdge(i));
+	Real->CalFieldXYZ(xc[0],xc[1],xc[2],E); nfield++;
+	dY[4]=E[0];
+
+	// magnetic field (see Drift)
+	f=charg>0?310:-1650;
+	F[0]=E[1]+f*(E[2]*B[2]-E[3]*B[1]);
+	F[1]=E[2]+f*(E[3]*B[0]-E[1]*B[2]);
+	F[2]=E[3]+f*(E[1]*B[1]-E[2]*B[0]);
+	f=TMath::Sqrt(F[0]*F[0]+F[1]*F[1]+F[2]*F[2]);
+
+	Double_t vel=0;
+	if(f!=0)
+	{
+		if(vt!=NULL) vel=vt->Velocity(E[0]);
+		else vel=Real->DriftVelocity(E[0],charg,temp,neff,mobmod);
+	}
+	if(vel==0) {dY[0]=0; dY[1]=0; dY[2]=0; dY[3]=0; return 0;}
+	for(i=0;i<3;i++) dY[i]=-charg*F[i]/f;
+	dY[3]=1e-4/vel;
+	return vel;
+}
+
+void KDetector::DriftRK(Double_t sx, Double_t sy, Double_t sz, Float_t charg, KStruct *seg, Double_t t0, TRandom *rnd, Bool_t determ)
+{
+	// Adaptive step drift (Integrator=1). The drift path and time are
+	// integrated along the path length s with the embedded Runge-Kutta 4(5)
+	// pair of Dormand & Prince (dx/ds = -q F/|F|, dt/ds = 1/v). The step
+	// follows the local error estimate (RKTol) and is kept within SStep and
+	// RKMaxStep and below the distance to the nearest electrode, so the
+	// steps near the electrodes are those of the fixed step drift. With a
+	// signal (seg->Signal) a step is also kept within one time bin.
+	// Diffusion is a Gaussian displacement with sigma = sqrt(2 D dt) per
+	// step and trapping integrates the trapping rate over the step time
+	// (optical depth, see Drift), so both are independent of the step size. Termination codes are the
+	// same as in Drift.
+
+	// Dormand-Prince coefficients: stage matrix, 5th order weights (=A[6])
+	// and the difference of the 5th and 4th order weights
+	static const Double_t A[7][6]={
+		{0,0,0,0,0,0},
+		{1./5,0,0,0,0,0},
+		{3./40,9./40,0,0,0,0},
+		{44./45,-56./15,32./9,0,0,0},
+		{19372./6561,-25360./2187,64448./6561,-212./729,0,0},
+		{9017./3168,-355./33,46732./5247,49./176,-5103./18656,0},
+		{35./384,0,500./1113,125./192,-2187./6784,11./84}};
+	static const Double_t Er[7]={71./57600,0,-71./16695,71./1920,-17253./339200,22./525,-1./40};
+
+	Double_t K[7][5];                       // stage derivatives (K[0] = at current position)
+	Double_t Y[4],Yn[4],Ys[4];              // current, next and stage state (x,y,z,t)
+	Double_t h,hs=0,hmax,err,e,fac;         // next and taken step, its bound, scaled error
+	Double_t vel,vels;                      // drift velocity at the step start / at a stage
+	Double_t sigma,dif[3],dt,az;
+	Double_t depth=0,trap=0;                // optical depth of trapping and its threshold
+	Double_t lo[3],up[3];
+	Double_t sumc=0,neff=0;
+	Double_t e0;                            // field at the step start
+	KCarrier mul(0,0,0,0,0);                // charge from impact ionization not yet handed out
+	Float_t pathlen=0,WPot,WPotOld,temp=0;
+	Int_t st=0,ishit=0,i,j,k=0,ok=0,mat=0,mobmod=0;
+	Int_t kmod=-1;                          // K[0] is valid for these material parameters
+	Float_t ktemp=-1;
+	Double_t kneff=-1;
+	KVelocityTable *vt=NULL;
+
+	TH3F *dist=GetElectrodeDistance();
+	TH3F *tmap=determ?NULL:GetTrapMap(charg<0);
+	KRandom *kr=dynamic_cast<KRandom *>(rnd);
+
+	seg->Clear();
+	seg->PCharge=(Int_t) charg;
+	if(kr!=NULL) kr->SetCounter(0);
+	if(tmap!=NULL) trap=-TMath::Log(rnd->Rndm());
+
+	for(i=0;i<3;i++) {lo[i]=GetLowEdge(i); up[i]=GetUpEdge(i);}
+
+	Y[0]=sx; Y[1]=sy; Y[2]=sz; Y[3]=t0;
+	k=seg->Slot(st);
+	seg->Xtrack[k]=Y[0]; seg->Ytrack[k]=Y[1]; seg->Ztrack[k]=Y[2];
+	seg->Time[k]=Y[3]; seg->Charge[k]=0;
+	WPotOld=Ramo->CalPotXYZ(Y[0],Y[1],Y[2]);
+	h=SStep;
+	vel=0;
+
+	do
+	{
+		st++;
+		k=seg->Slot(st);
+		if(kr!=NULL) kr->SetCounter(st);
+
+		// material at the step start; K[0] is reused unless it changed
+		if(DM!=NULL) mat=DM->GetBinContent(DM->FindBin(Y[0],Y[1],Y[2])); else mat=0;
+		mobmod=MobMod(mat);
+		temp=GetTemperature(mat);
+		neff=TMath::Abs(NeffF->Eval(Y[0],Y[1],Y[2]));
+		if(mobmod!=kmod || temp!=ktemp || neff!=kneff)
+		{
+			kmod=mobmod; ktemp=temp; kneff=neff;
+			vt=VelTab?VTables->Get(mobmod,charg,temp,neff):NULL;
+			vel=DriftRate(Y,charg,mobmod,temp,neff,vt,K[0],seg->NField);
+		}
+		if(st==1) seg->Efield[0]=K[0][4];
+		e0=K[0][4];
+
+		if(vel==0)
+		{
+			for(i=0;i<4;i++) Yn[i]=Y[i];
+			ishit=9;
+		}
+		else
+		{
+			hmax=TMath::Min((Double_t)RKMaxStep,(Double_t)dist->GetBinContent(dist->FindBin(Y[0],Y[1],Y[2])));
+			// in signal mode a step covers at most about one time bin
+			if(seg->Signal!=NULL) hmax=TMath::Min(hmax,vel*1e4/seg->Signal->IdT);
+			hmax=TMath::Max(hmax,(Double_t)SStep);
+			h=TMath::Min(TMath::Max(h,(Double_t)SStep),hmax);
+
+			do
+			{
+				if(h<=SStep)
+				{
+					// smallest step: the step of Drift along the field at the
+					// start (one field evaluation), time from both ends
+					h=SStep;
+					for(i=0;i<3;i++) Yn[i]=Y[i]+h*K[0][i];
+					ok=DriftRate(Yn,charg,mobmod,temp,neff,vt,K[6],seg->NField)!=0;
+					Yn[3]=Y[3]+h*(ok?(K[0][3]+K[6][3])/2:K[0][3]);
+					// no error estimate: grow only if the direction hardly turned
+					err=ok && K[0][0]*K[6][0]+K[0][1]*K[6][1]+K[0][2]*K[6][2]>0.999?-1:-2;
+					break;
+				}
+
+				ok=1;
+				for(j=1;j<7 && ok;j++)
+				{
+					for(i=0;i<4;i++)
+					{
+						Ys[i]=Y[i];
+						for(Int_t l=0;l<j;l++) Ys[i]+=h*A[j][l]*K[l][i];
+					}
+					vels=DriftRate(Ys,charg,mobmod,temp,neff,vt,K[j],seg->NField);
+					if(vels==0) ok=0;
+				}
+
+				if(ok)
+				{
+					for(i=0;i<4;i++) Yn[i]=Ys[i];    // the last stage is the 5th order solution
+					err=0;
+					for(i=0;i<3;i++)
+					{
+						for(e=0,j=0;j<7;j++) e+=Er[j]*K[j][i];
+						err=TMath::Max(err,TMath::Abs(h*e));
+					}
+					// time error expressed as a distance at the current velocity
+					for(e=0,j=0;j<7;j++) e+=Er[j]*K[j][3];
+					err=TMath::Max(err,TMath::Abs(h*e)*vel*1e4)/RKTol;
+				}
+				else err=1e10;  // stage in a region where the carrier stops
+
+				if(err<=1) break;
+				h=TMath::Max((Double_t)SStep,h*TMath::Max(0.2,0.9*TMath::Power(err,-0.2)));
+			} while(1);
+
+			// step size for the next step (err<0: smallest step taken)
+			hs=h;
+			if(err<0) fac=err==-1?2:1; else fac=err>0?0.9*TMath::Power(err,-0.2):5;
+			h*=TMath::Min(5.,TMath::Max(0.2,fac));
+		}
+
+		// diffusion over the time of the step
+		for(i=0;i<3;i++) dif[i]=0;
+		dt=Yn[3]-Y[3];
+		if(ishit==0 && diff && !determ && !(DiffOffField<K[ok?6:0][4] && MTresh>1))
+		{
+			// Mobility() is given the field in V/um as in Drift
+			sigma=TMath::Sqrt(2*Kboltz*(vt!=NULL?vt->Mobility(K[0][4]*1e-4):Real->Mobility(K[0][4],temp,charg,neff,mobmod))*temp*dt);
+			dif[1]=rnd->Gaus(0,sigma)*1e4;
+			dif[0]=rnd->Gaus(0,sigma)*1e4;
+			if(nz!=1 || RZ) dif[2]=rnd->Gaus(0,sigma)*1e4;
+		}
+
+		if(RZ)
+		{
+			// r-z: z of the mesh is the azimuthal direction (see Drift)
+			az=Yn[2]-Y[2]+dif[2];
+			if(az!=0 || Yn[0]+dif[0]<0)
+			{
+				Yn[0]=TMath::Sqrt((Yn[0]+dif[0])*(Yn[0]+dif[0])+az*az); Yn[2]=Y[2];
+				dif[0]=0; dif[2]=0; ok=0;
+			}
+		}
+
+		for(i=0;i<3;i++)
+		{
+			Yn[i]+=dif[i];
+			if(Yn[i]>=up[i]) {Yn[i]=up[i]; ok=0;}
+			if(Yn[i]<lo[i]) {Yn[i]=lo[i]; ok=0;}
+			if(dif[i]!=0) ok=0;
+		}
+
+		WPot=Ramo->CalPotXYZ(Yn[0],Yn[1],Yn[2]);
+		seg->Charge[k]=charg*(WPot-WPotOld);
+
+		// trapping over the time of the step
+		if(ishit==0 && tmap!=NULL)
+		{
+			depth+=dt*tmap->GetBinContent(tmap->FindBin((Yn[0]+Y[0])/2,(Yn[1]+Y[1])/2,(Yn[2]+Y[2])/2));
+			if(depth>trap) ishit=12;
+		}
+
+		sumc+=seg->Charge[k];
+		if(ishit==0) pathlen+=hs;
+
+		// the derivative at the end of an undisturbed step is the first
+		// stage of the next one
+		if(ishit==0)
+		{
+			if(ok)
+			{
+				for(i=0;i<5;i++) K[0][i]=K[6][i];
+				vel=1e-4/K[0][3];
+			}
+			else vel=DriftRate(Yn,charg,mobmod,temp,neff,vt,K[0],seg->NField);
+		}
+		if(seg->Signal!=NULL) seg->Signal->Fill(Y[3],Yn[3],seg->Weight*seg->Charge[k]*TrapFactor(charg,(Y[3]+Yn[3])/2-t0),charg);
+		if(MTresh>1 && !determ) Multiply(seg,k,(e0+K[0][4])/2,temp,charg,ishit==9?0:hs,Yn[0],Yn[1],Yn[2],Yn[3],mul);
+		for(i=0;i<4;i++) Y[i]=Yn[i];
+		WPotOld=WPot;
+
+		seg->Xtrack[k]=Y[0]; seg->Ytrack[k]=Y[1]; seg->Ztrack[k]=Y[2];
+		seg->Time[k]=Y[3];
+		seg->Efield[k]=K[0][4];
+
+		// Checking for termination of the drift
+		if(WPot>(1-Deps)) ishit=1;
+		if(Y[0]<=lo[0] && !RZ) ishit=3;
+		if(Y[0]>=up[0]) ishit=4;
+		if(Y[1]<=lo[1]) ishit=5;
+		if(Y[1]>=up[1]) ishit=6;
+		if(Y[2]<=lo[2]) ishit=7;
+		if(Y[2]>=up[2]) ishit=8;
+		if(pathlen>MaxDriftLen) ishit=11;
+		if(MaxSteps>0 && st>=MaxSteps) ishit=20;
+
+		if(Debug) printf("%d %f h=%f x=(%f %f %f) t=%e vel=%e Q=%f Ishit=%d\n",st,charg,h,Y[0],Y[1],Y[2],Y[3],vel,sumc,ishit);
+
+	} while (!ishit);
+
+	if(mul.q>0) seg->Sec.push_back(mul);
+	seg->Xlenght=pathlen; seg->Ylenght=pathlen;
+	seg->TTime=Y[3]; seg->TCharge=sumc; seg->Steps=st; seg->Stop=ishit;
+	KProfile::AddStop(ishit,st);
+}
+
+void KDetector::Multiply(KStruct *seg, Int_t j, Double_t E, Float_t T, Float_t charg, Double_t ds, Double_t x, Double_t y, Double_t z, Double_t t, KCarrier &mul)
+{
+	// Impact ionization over a drift step of ds [um] at the field E [V/um]
+	// (model KMaterial::ImpactIonization). The created charge is stored in
+	// MulCar and collected in mul, which is placed at the end (x,y,z,t)
+	// of the last multiplying step. Once it reaches (MTresh-1) times the
+	// carrier charge it is handed out as a secondary pair. The rest is
+	// handed out by the caller at the end of the drift - at the last
+	// multiplying step rather than inside the electrode, where the new
+	// carriers would not move.
+	Double_t gen=0;
+	if(ds>0) gen=seg->Weight*(TMath::Exp(KField::Alpha(E*1e4,T,charg,ImpactIonization)*ds*1e-4)-1);
+	seg->MulCar[j]=gen;
+	if(gen<=0) return;
+	// secondaries start from 3D positions (r-z: in the plane y=0)
+	if(RZ) {mul.x=x; mul.y=0; mul.z=y;} else {mul.x=x; mul.y=y; mul.z=z;}
+	mul.t=t; mul.q+=gen;
+	if(mul.q>=(MTresh-1)*seg->Weight) {seg->Sec.push_back(mul); mul.q=0;}
+}
+
+Bool_t KDetector::CheckBreakDown()
+{
+	// An avalanche (MTresh>1) is only stopped by the breakdown threshold
+	if(MTresh>1 && !(BDTresh>0))
+	{
+		printf("KDetector: multiplication (MTresh>1) needs a breakdown threshold BDTresh>0\n");
+		return kFALSE;
+	}
+	return kTRUE;
+}
+
+void KDetector::DriftEvents(Int_t nev, KEvent *ev, Int_t signal)
+{
+	// Drifts the holes and electrons of all buckets of nev events in
+	// parallel. Every (event, bucket, carrier) is a task for the thread
+	// pool with its own random stream seeded from (Seed, event, bucket,
+	// carrier) and its own result slot, so the results do not depend on
+	// the number of threads or on the order in which tasks are run.
+	// With signal=1 the induced currents of all events (weighted by Q)
+	// are summed into pos, neg and sum. The current of every task is kept
+	// apart (KSignalPart) and the parts are added in the order of events,
+	// buckets and carriers, so the sum does not depend on the threads.
+	// The events are run in blocks of about 256 tasks per thread and the
+	// parts of a block are added before the next one starts, so the memory
+	// does not grow with nev.
+	// With MTresh>1 (avalanche mode) the secondary pairs of every drift
+	// are submitted as new tasks, keyed by their parent's random stream,
+	// until an event's created charge exceeds BDTresh times its primary
+	// charge (BreakDown); secondaries below 1e-6 of the primary charge
+	// are not drifted. The charges and currents induced by the
+	// secondaries are added to Charge and the signal in the order of
+	// their keys. Which secondaries are dropped at breakdown depends on
+	// the order of the tasks, so such events are only reproducible with
+	// one thread.
+	Int_t e,e0,e1,i,c,nb,w;
+	if(!CheckBreakDown()) return;
+	KThreadPool pool(NThreads);
+	std::vector<KStruct *> seg(pool.GetN());
+	std::vector<KRandom *> rng(pool.GetN());
+	std::vector<KSignal *> sig(pool.GetN(),(KSignal *)NULL);
+	std::vector<Long64_t> off(nev+1,0);         // first task (2 per bucket) of every event
+	for(e=0;e<nev;e++) off[e+1]=off[e]+2*ev[e].GetN();
+	Long64_t block=256*pool.GetN();
+	std::unique_ptr<KSignal> tot(signal?new KSignal(sum):NULL);
+
+	// result of a secondary drift, reduced in the order of (event, key)
+	struct Sec {Int_t e,c; ULong64_t Key; Double_t Q; KSignalPart S;};
+	Int_t aval=MTresh>1;
+	std::vector<std::vector<Sec> > sec(pool.GetN());
+	std::vector<std::vector<Long64_t> > secn(pool.GetN(),std::vector<Long64_t>(aval?nev:0,0));
+	std::unique_ptr<std::atomic<Double_t>[]> gen(new std::atomic<Double_t>[aval?nev:0]);
+	std::unique_ptr<std::atomic<Int_t>[]> brk(new std::atomic<Int_t>[aval?nev:0]);
+	std::vector<Double_t> cap(aval?nev:0,0),qmin(aval?nev:0,0);
+	std::function<void(Int_t,Int_t,ULong64_t)> avalanche;
+
+	avalanche=[&](Int_t e, Int_t w, ULong64_t key)
+	{
+		// hands the secondary pairs of the last drift of worker w to the pool
+		std::vector<KCarrier> &S=seg[w]->Sec;
+		for(size_t k=0;k<S.size();k++)
+		{
+			if(S[k].q<qmin[e]) continue;
+			// the charge is reserved by one atomic add; the pair is dropped
+			// (and the charge given back) if the event was over the cap
+			if(KAtomicAdd(gen[e],S[k].q)>cap[e]) {KAtomicAdd(gen[e],-S[k].q); brk[e]=1; break;}
+			secn[w][e]++;
+			for(Int_t c2=0;c2<2;c2++)
+			{
+				KCarrier C=S[k];
+				C.Key=KSeed(key,k,c2);
+				pool.Submit([&,e,c2,C](Int_t w2)
+				{
+					rng[w2]->SetKey(C.Key);
+					seg[w2]->Weight=C.q;
+					Drift(C.x,C.y,C.z,c2?-1:1,seg[w2],C.t,rng[w2]);
+					sec[w2].push_back(Sec());
+					Sec &r=sec[w2].back();
+					r.e=e; r.c=c2; r.Key=C.Key; r.Q=C.q*seg[w2]->TCharge;
+					if(signal) sig[w2]->Take(c2,r.S);
+					avalanche(e,w2,C.Key);
+				},w);
+			}
+		}
+	};
+
+	ROOT::EnableThreadSafety();
+	if(Integrator==1 || ClusterTol>0) GetElectrodeDistance();  // built once, before the workers share it
+	GetTrapMap(0); GetTrapMap(1);
+	if(FastSim) GetResponseMap();
+	for(i=0;i<pool.GetN();i++)
+	{
+		seg[i]=new KStruct(); seg[i]->Track=0; rng[i]=new KRandom();
+		if(signal) {sig[i]=new KSignal(sum); seg[i]->Signal=sig[i];}
+	}
+
+	for(e0=0;e0<nev;e0=e1)
+	{
+		for(e1=e0+1;e1<nev && off[e1]-off[e0]<block;e1++);
+		std::vector<KSignalPart> part(signal?off[e1]-off[e0]:0);
+		for(e=e0;e<e1;e++)
+		{
+			nb=ev[e].GetN();
+			for(c=0;c<2;c++)
+			{
+				ev[e].TTime[c].assign(nb,0); ev[e].TCharge[c].assign(nb,0);
+				ev[e].Steps[c].assign(nb,0); ev[e].Stop[c].assign(nb,0);
+			}
+			if(aval)
+			{
+				Double_t q=0;
+				for(i=0;i<nb;i++) q+=ev[e].Q[i];
+				gen[e]=0; brk[e]=0; cap[e]=BDTresh*q; qmin[e]=1e-6*q;
+			}
+			for(i=0;i<nb;i++)
+				for(c=0;c<2;c++)
+					pool.Submit([this,ev,e,e0,i,c,&seg,&rng,&sig,&part,&off,signal,aval,&avalanche](Int_t w)
+					{
+						DriftBucket(ev[e],i,c,seg[w],rng[w]);
+						if(signal) sig[w]->Take(c,part[off[e]-off[e0]+2*i+c]);
+						if(aval) avalanche(e,w,KSeed(Seed,ev[e].Event,i,c));
+					});
+		}
+		pool.Wait();
+
+		// reduction of the block in a fixed order
+		std::vector<Sec> all;
+		for(w=0;w<pool.GetN();w++)
+		{
+			all.insert(all.end(),std::make_move_iterator(sec[w].begin()),std::make_move_iterator(sec[w].end()));
+			std::vector<Sec>().swap(sec[w]);
+		}
+		std::sort(all.begin(),all.end(),[](const Sec &a, const Sec &b) {return a.e!=b.e?a.e<b.e:a.Key<b.Key;});
+		size_t s=0;
+		for(e=e0;e<e1;e++)
+		{
+			Double_t q=0;
+			ev[e].Charge=0;
+			for(i=0;i<ev[e].GetN();i++)
+			{
+				ev[e].Charge+=ev[e].Q[i]*(ev[e].TCharge[0][i]+ev[e].TCharge[1][i]);
+				q+=ev[e].Q[i];
+				if(signal) for(c=0;c<2;c++) tot->Add(c,part[off[e]-off[e0]+2*i+c]);
+			}
+			ev[e].Gain=1; ev[e].NSec=0; ev[e].BreakDown=0;
+			if(aval)
+			{
+				for(;s<all.size() && all[s].e==e;s++)
+				{
+					ev[e].Charge+=all[s].Q;
+					if(signal) tot->Add(all[s].c,all[s].S);
+				}
+				for(w=0;w<pool.GetN();w++) ev[e].NSec+=secn[w][e];
+				if(q>0) ev[e].Gain=1+gen[e]/q;
+				ev[e].BreakDown=brk[e];
+				if(brk[e]) BreakDown=1;
+			}
+		}
+	}
+	if(signal) tot->Store(pos,neg,sum);
+
+	for(i=0;i<pool.GetN();i++) {delete seg[i]; delete rng[i]; if(sig[i]!=NULL) delete sig[i];}
+}
+
+void KDetector::DriftBucket(KEvent &E, Int_t i, Int_t c, KStruct *seg, KRandom *rng)
+{
+	// Drifts the holes (c=0) or electrons (c=1) of bucket i of event E
+	// with the random stream of (Seed, event, bucket, carrier), or takes
+	// the drift of the bucket's voxel from the response tables (FastSim,
+	// if GetResponseMap made them)
+	if(FastSim && RMap!=NULL)
+	{
+		Int_t v=RMap->Voxel(E.x[i],E.y[i],E.z[i]);
+		E.TTime[c][i]=RMap->GetTime(v,c)+E.T[i]; E.TCharge[c][i]=RMap->GetCharge(v,c);
+		E.Steps[c][i]=RMap->GetSteps(v,c); E.Stop[c][i]=RMap->GetStop(v,c);
+		if(seg->Signal!=NULL) RMap->Fill(v,c,E.Q[i],seg->Signal,E.T[i]);
+		seg->Sec.clear();
+		return;
+	}
+	rng->SetKey(KSeed(Seed,E.Event,i,c));
+	seg->Weight=E.Q[i];
+	Drift(E.x[i],E.y[i],E.z[i],c?-1:1,seg,E.T[i],rng);
+	E.TTime[c][i]=seg->TTime; E.TCharge[c][i]=seg->TCharge;
+	E.Steps[c][i]=seg->Steps; E.Stop[c][i]=seg->Stop;
+}
+
+void KDetector::MipIR(Int_t div)
+{
+	// Induced current of a minimum ionizing particle crossing the detector
+	// from enp to exp, averaged over "average" events. The track is
+	// divided into div buckets of unit charge; the carriers are drifted in
+	// parallel without keeping their paths and the currents are stored in
+	// pos, neg and sum. Events differ only by diffusion and trapping.
+	Int_t e,i,nev=average>0?average:1;
+	std::vector<KEvent> ev(nev);
+	KProfileTimer prof(KProfile::kMip);
+
+	for(e=0;e<nev;e++)
+	{
+		ev[e].Event=e;
+		for(i=0;i<div;i++)
+			ev[e].Add(((exp[0]-enp[0])/div)*i+enp[0]+(exp[0]-enp[0])/(2*div),
+			          ((exp[1]-enp[1])/div)*i+enp[1]+(exp[1]-enp[1])/(2*div),
+			          ((exp[2]-enp[2])/div)*i+enp[2]+(exp[2]-enp[2])/(2*div),1);
+	}
+	DriftEvents(nev,&ev[0],1);
+	if(nev>1) {pos->Scale(1./nev); neg->Scale(1./nev); sum->Scale(1./nev);}
+}
+
+void KDetector::EventMC(Int_t nev, Int_t div, const char *file)
+{
+	// Headless Monte Carlo of nev mip events written to the TTree "events"
+	// of file (see KTreeWriter). Every event has random entry and exit
+	// points on the two faces of the detector (y faces for 2D, z faces for
+	// 3D detectors) and div buckets with Landau distributed charge
+	// (MipMPV, MipSigma per um of track). The events are drifted in
+	// parallel, one task per event, without keeping the paths; the total
+	// charge, the collection time and the waveform (binning of sum) go to
+	// a background writer. Tasks are submitted in blocks so that the
+	// memory use does not depend on nev. Records are written in the order
+	// in which the events finish. In avalanche mode (MTresh>1) the
+	// secondary pairs of an event are drifted by the event's task. With
+	// a Shaper the waveform is the shaped signal, with the noise of the
+	// event's own stream, and its observables go to the pulse branch.
+	// With CheckPoint the file is saved after a block every CheckInterval
+	// seconds, without waiting for it; a job started again with the same
+	// nev, div and Seed adds the missing events to the file. Since every
+	// event has its own random streams they are the same as without the
+	// break.
+	Int_t i,d=nz==1?1:2,start=0,append=0;
+	Int_t nw=sum->GetNbinsX();
+	Float_t lo[3],up[3];
+	KProfileTimer prof(KProfile::kEventMC);
+	if(!CheckBreakDown()) return;
+	KThreadPool pool(NThreads);
+	Int_t nthr=pool.GetN(),block=256*nthr;
+	std::vector<KStruct *> seg(nthr);
+	std::vector<KRandom *> rng(nthr);
+	std::vector<KSignal *> sig(nthr);
+	std::vector<KEvent> ev(nthr);
+	std::vector<std::vector<std::pair<KCarrier,Int_t> > > todo(nthr);   // secondaries waiting to drift
+
+	ROOT::EnableThreadSafety();
+	if(Integrator==1 || ClusterTol>0) GetElectrodeDistance();
+	GetTrapMap(0); GetTrapMap(1);
+	if(FastSim) GetResponseMap();
+	for(i=0;i<3;i++) {lo[i]=GetLowEdge(i); up[i]=GetUpEdge(i);}
+	for(i=0;i<nthr;i++)
+	{
+		seg[i]=new KStruct(); seg[i]->Track=0; rng[i]=new KRandom();
+		sig[i]=new KSignal(sum); seg[i]->Signal=sig[i];
+	}
+
+	KCheckpoint *ck=NULL;
+	std::vector<Char_t> st;
+	Int_t job[4]={nev,div,(Int_t)Seed,nw};
+	if(CheckPoint!="")
+	{
+		Int_t old[4];
+		size_t p=0;
+		ck=new KCheckpoint(Form("%s.events",CheckPoint.Data()),CheckInterval);
+		if(ck->Load(st) && KCheckpoint::Get(st,p,old,sizeof(old)))
+		{
+			if(!memcmp(old,job,sizeof(job))) append=1;
+			else printf("EventMC: checkpoint of another job ignored\n");
+		}
+	}
+	KTreeWriter out(file,nw,4096,404,append);
+	if(append)
+	{
+		start=out.Written<nev?(Int_t)out.Written:nev;
+		printf("EventMC: continuing after %d events of %s\n",start,file);
+	}
+
+	auto task=[&](Int_t e, Int_t w)
+	{
+		KEvent &E=ev[w];
+		KEventRecord rec;
+		Int_t j;
+		Double_t len=0,f;
+
+		// track and its ionization from the event's own stream
+		rng[w]->SetKey(KSeed(Seed,e,0xFFFFFFFFULL,2));
+		for(j=0;j<3;j++) {rec.Enp[j]=rng[w]->Uniform(lo[j],up[j]); rec.Exp[j]=rng[w]->Uniform(lo[j],up[j]);}
+		rec.Enp[d]=lo[d]; rec.Exp[d]=up[d];
+		for(j=0;j<3;j++) len+=(rec.Exp[j]-rec.Enp[j])*(rec.Exp[j]-rec.Enp[j]);
+		len=TMath::Sqrt(len)/div;
+
+		// TRandom::Landau takes the location parameter; the most probable
+		// value of the Landau distribution lies 0.22278 sigma below it
+		E.Clear(); E.Event=e;
+		for(j=0;j<div;j++)
+		{
+			f=(j+0.5)/div;
+			E.Add(rec.Enp[0]+(rec.Exp[0]-rec.Enp[0])*f,rec.Enp[1]+(rec.Exp[1]-rec.Enp[1])*f,rec.Enp[2]+(rec.Exp[2]-rec.Enp[2])*f,
+			      TMath::Max(0.,rng[w]->Landau((MipMPV+0.22278*MipSigma)*len,MipSigma*len)));
+		}
+		rec.Event=e;
+		out.GetBuffer(rec.Wave);
+		SimEvent(E,seg[w],rng[w],todo[w],rec);
+		out.Push(rec);
+	};
+
+	for(Int_t first=start;first<nev;first+=block)
+	{
+		for(Int_t e=first;e<nev && e<first+block;e++)
+			pool.Submit([&task,e](Int_t w){task(e,w);});
+		pool.Wait();
+		if(Debug) printf("EventMC: %d of %d events\n",TMath::Min(first+block,nev),nev);
+		if(ck!=NULL && first+block<nev && ck->Due())
+		{
+			// all events before first+block are pushed
+			st.clear();
+			KCheckpoint::Put(st,job,sizeof(job));
+			out.Checkpoint(ck,st);
+		}
+	}
+	out.Close();
+	if(ck!=NULL) {ck->Remove(); delete ck;}
+
+	for(i=0;i<nthr;i++) {delete seg[i]; delete rng[i]; delete sig[i];}
+	printf("EventMC: %lld events written to %s\n",out.Written,file);
+}
+
+void KDetector::DepositMC(const char *in, const char *file, Double_t qscale)
+{
+	// Drifts the energy deposits of the file in (see KDepositReader; the
+	// charge column is multiplied by qscale) event by event and writes the
+	// records to the TTree "events" of file, like EventMC. enp and exp of
+	// a record are the first and the last deposit of the event. The
+	// events of a block are drifted in parallel while the reader prefetches
+	// the next block, so reading the file overlaps with the drift.
+	Int_t i,n;
+	Long64_t nev=0;
+	Int_t nw=sum->GetNbinsX();
+	KProfileTimer prof(KProfile::kEventMC);
+	if(!CheckBreakDown()) return;
+	KThreadPool pool(NThreads);
+	Int_t nthr=pool.GetN(),block=256*nthr;
+	std::vector<KStruct *> seg(nthr);
+	std::vector<KRandom *> rng(nthr);
+	std::vector<KSignal *> sig(nthr);
+	std::vector<KEvent> ev;
+	std::vector<std::vector<std::pair<KCarrier,Int_t> > > todo(nthr);
+
+	KDepositReader rd(in,block,qscale);
+	if(!rd.IsOpen()) return;
+	ROOT::EnableThreadSafety();
+	if(Integrator==1 || ClusterTol>0) GetElectrodeDistance();
+	GetTrapMap(0); GetTrapMap(1);
+	if(FastSim) GetResponseMap();
+	for(i=0;i<nthr;i++)
+	{
+		seg[i]=new KStruct(); seg[i]->Track=0; rng[i]=new KRandom();
+		sig[i]=new KSignal(sum); seg[i]->Signal=sig[i];
+	}
+	KTreeWriter out(file,nw);
+
+	auto task=[&](KEvent &E, Int_t w)
+	{
+		KEventRecord rec;
+		Int_t j,nb=E.GetN();
+		rec.Event=E.Event;
+		for(j=0;j<3;j++) {rec.Enp[j]=0; rec.Exp[j]=0;}
+		if(nb>0)
+		{
+			rec.Enp[0]=E.x[0]; rec.Enp[1]=E.y[0]; rec.Enp[2]=E.z[0];
+			rec.Exp[0]=E.x[nb-1]; rec.Exp[1]=E.y[nb-1]; rec.Exp[2]=E.z[nb-1];
+		}
+		out.GetBuffer(rec.Wave);
+		SimEvent(E,seg[w],rng[w],todo[w],rec);
+		out.Push(rec);
+	};
+
+	while((n=rd.Next(ev))>0)
+	{
+		for(i=0;i<n;i++)
+		{
+			KEvent *E=&ev[i];
+			pool.Submit([&task,E](Int_t w){task(*E,w);});
+		}
+		pool.Wait();
+		nev+=n;
+		if(Debug) printf("DepositMC: %lld events\n",nev);
+	}
+	rd.Close();
+	out.Close();
+
+	for(i=0;i<nthr;i++) {delete seg[i]; delete rng[i]; delete sig[i];}
+	if(rd.BadLines>0) printf("DepositMC: %lld lines of %s skipped\n",rd.BadLines,in);
+	printf("DepositMC: %lld deposits of %lld events written to %s\n",rd.Deposits,out.Written,file);
+}
+
+Int_t KDetector::Cluster(KEvent &E)
+{
+	// Merges the deposits of E into fewer carriers and returns their
+	// number. A deposit joins the nearest carrier (at the charge weighted
+	// centre of its deposits, created at their mean time) that is closer
+	// to it than the local tolerance of both and within one bin of the
+	// drift histograms in time. The carriers are kept in ClusterTol cubes
+	// by their centre and only the cube of the deposit and its neighbours
+	// are searched, so deposits on both sides of a cube face merge too.
+	// The local tolerance is ClusterTol, but at most ClusterFrac times the
+	// distance to the nearest electrode and times the length |E|/|grad |E||
+	// over which the field changes, so the carriers stay fine where the
+	// drift paths diverge. Uses the streams of E.Event in the order of the
+	// carriers.
+	Int_t i,k,j,a,m,q,n=E.GetN();
+	if(ClusterTol<=0 || n<2) return n;
+
+	TH3F *dist=GetElectrodeDistance();
+	Double_t dt=sum->GetXaxis()->GetBinWidth(1),h=ClusterTol;
+	Double_t tol,d,dmin,g,dE,w,R[3];
+	Float_t F[4],Fp[4],Fm[4],P[3];
+	Long64_t key,ix[3];
+	std::unordered_map<Long64_t,std::vector<Int_t> > cell;
+	std::vector<Double_t> cx,cy,cz,cq,ct,ctol;
+	std::vector<Long64_t> ckey;
+	auto cube=[](Long64_t i, Long64_t j, Long64_t k) {return ((i&0x1FFFFF)<<42)+((j&0x1FFFFF)<<21)+(k&0x1FFFFF);};
+	Double_t is=1./ClusterTol;
+
+	for(i=0;i<n;i++)
+	{
+		// local tolerance
+		tol=ClusterTol;
+		R[0]=E.x[i]; R[1]=E.y[i]; R[2]=E.z[i];
+		if(RZ) ToRZ(R[0],R[1],R[2]);
+		d=dist->GetBinContent(dist->FindFixBin(R[0],R[1],R[2]));
+		tol=TMath::Min(tol,ClusterFrac*d);
+		Real->CalFieldXYZ(R[0],R[1],R[2],F);
+		g=0;
+		for(a=0;a<(nz==1?2:3);a++)
+		{
+			P[0]=R[0]; P[1]=R[1]; P[2]=R[2]; P[a]+=h;
+			Real->CalFieldXYZ(P[0],P[1],P[2],Fp);
+			P[a]-=2*h;
+			Real->CalFieldXYZ(P[0],P[1],P[2],Fm);
+			dE=(Fp[0]-Fm[0])/(2*h);
+			g+=dE*dE;
+		}
+		if(g>0) tol=TMath::Min(tol,ClusterFrac*F[0]/TMath::Sqrt(g));
+
+		// nearest carrier in the 27 cubes around the deposit (the lower
+		// index if two are equally near)
+		P[0]=E.x[i]; P[1]=E.y[i]; P[2]=E.z[i];
+		for(a=0;a<3;a++) ix[a]=(Long64_t)TMath::Floor(P[a]*is);
+		k=-1; dmin=0;
+		for(q=0;q<27;q++)
+		{
+			key=cube(ix[0]+q%3-1,ix[1]+q/3%3-1,ix[2]+q/9-1);
+			std::unordered_map<Long64_t,std::vector<Int_t> >::const_iterator it=cell.find(key);
+			if(it==cell.end()) continue;
+			for(j=0;j<(Int_t)it->second.size();j++)
+			{
+				m=it->second[j];
+				d=(cx[m]-P[0])*(cx[m]-P[0])+(cy[m]-P[1])*(cy[m]-P[1])+(cz[m]-P[2])*(cz[m]-P[2]);
+				if(d>tol*tol || d>ctol[m]*ctol[m] || TMath::Abs(ct[m]-E.T[i])>dt) continue;
+				if(k<0 || d<dmin || (d==dmin && m<k)) {k=m; dmin=d;}
+			}
+		}
+		if(k<0)
+		{
+			key=cube(ix[0],ix[1],ix[2]);
+			cell[key].push_back(cx.size()); ckey.push_back(key);
+			cx.push_back(P[0]); cy.push_back(P[1]); cz.push_back(P[2]);
+			cq.push_back(E.Q[i]); ct.push_back(E.T[i]); ctol.push_back(tol);
+			continue;
+		}
+		// charge weighted centre (plain mean for zero charges)
+		w=cq[k]+E.Q[i]>0?E.Q[i]/(cq[k]+E.Q[i]):0.5;
+		cx[k]+=w*(P[0]-cx[k]); cy[k]+=w*(P[1]-cy[k]); cz[k]+=w*(P[2]-cz[k]);
+		ct[k]+=w*(E.T[i]-ct[k]);
+		cq[k]+=E.Q[i];
+		ctol[k]=TMath::Min(ctol[k],tol);
+		// the carrier moves to the cube of its new centre
+		key=cube((Long64_t)TMath::Floor(cx[k]*is),(Long64_t)TMath::Floor(cy[k]*is),(Long64_t)TMath::Floor(cz[k]*is));
+		if(key!=ckey[k])
+		{
+			std::vector<Int_t> &C=cell[ckey[k]];
+			C.erase(std::find(C.begin(),C.end(),k));
+			cell[key].push_back(k); ckey[k]=key;
+		}
+	}
+
+	n=cx.size();
+	E.x.resize(n); E.y.resize(n); E.z.resize(n); E.Q.resize(n); E.T.resize(n);
+	for(k=0;k<n;k++) {E.x[k]=cx[k]; E.y[k]=cy[k]; E.z[k]=cz[k]; E.Q[k]=cq[k]; E.T[k]=ct[k];}
+	return n;
+}
+
+void KDetector::SimEvent(KEvent &E, KStruct *seg, KRandom *rng, std::vector<std::pair<KCarrier,Int_t> > &T, KEventRecord &rec)
+{
+	// Drifts all buckets of E, and in avalanche mode (MTresh>1) their
+	// secondaries through the work stack T, into seg->Signal and fills
+	// the charge, collection time, gain and waveform of rec (its Wave
+	// must have the size of the drift histograms). Used by EventMC and
+	// DepositMC; everything random comes from the streams of E.Event.
+	Int_t j,c,nb=ClusterTol>0?Cluster(E):E.GetN(),nw=sum->GetNbinsX();
+	KSignal *S=seg->Signal;
+	Double_t q=0,gen=0;
+	KProfileTimer prof(KProfile::kEvent);
+
+	for(c=0;c<2;c++)
+	{
+		E.TTime[c].assign(nb,0); E.TCharge[c].assign(nb,0);
+		E.Steps[c].assign(nb,0); E.Stop[c].assign(nb,0);
+	}
+	S->Reset();
+	rec.Charge=0; rec.CTime=0; rec.BreakDown=0;
+	auto cascade=[&](ULong64_t key)
+	{
+		for(size_t k=0;k<seg->Sec.size();k++)
+		{
+			if(seg->Sec[k].q<1e-6*q) continue;
+			if(gen>BDTresh*q) {rec.BreakDown=1; break;}
+			gen+=seg->Sec[k].q;
+			for(Int_t c2=0;c2<2;c2++)
+			{
+				T.push_back(std::make_pair(seg->Sec[k],c2));
+				T.back().first.Key=KSeed(key,k,c2);
+			}
+		}
+	};
+
+	for(j=0;j<nb;j++) q+=E.Q[j];
+	for(j=0;j<nb;j++)
+		for(c=0;c<2;c++)
+		{
+			DriftBucket(E,j,c,seg,rng);
+			rec.Charge+=E.Q[j]*E.TCharge[c][j];
+			if(E.TTime[c][j]>rec.CTime) rec.CTime=E.TTime[c][j];
+			if(MTresh>1) cascade(KSeed(Seed,E.Event,j,c));
+			while(!T.empty())
+			{
+				KCarrier C=T.back().first;
+				Int_t c2=T.back().second;
+				T.pop_back();
+				rng->SetKey(C.Key);
+				seg->Weight=C.q;
+				Drift(C.x,C.y,C.z,c2?-1:1,seg,C.t,rng);
+				rec.Charge+=C.q*seg->TCharge;
+				if(seg->TTime>rec.CTime) rec.CTime=seg->TTime;
+				cascade(C.Key);
+			}
+		}
+	rec.Gain=q>0?1+gen/q:1;
+
+	for(j=0;j<nw;j++) rec.Wave[j]=(S->Pos[j]+S->Neg[j])*S->IdT;
+	if(Shaper!=NULL)
+	{
+		rng->SetKey(KSeed(Seed,E.Event,0xFFFFFFFFULL,4));
+		Shaper->Shape(nw,1/S->IdT,&rec.Wave[0],&rec.Wave[0],rng);
+		rec.Pulse=Shaper->Analyse(nw,S->T0,1/S->IdT,&rec.Wave[0]);
+	}
+}
+
+
+
+
+
+#include <chrono>
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KResponseMap                                                         //
+//                                                                      //
+// Without diffusion the drift from a point is deterministic, so it can //
+// be done once per voxel and carrier type instead of once per deposit. //
+// Build() drifts a unit hole and a unit electron from the center of    //
+// every bin of the geometry (in parallel, with the detector's drift   //
+// settings but no diffusion, position dependent trapping or            //
+// multiplication) and keeps the end time, the induced charge, the      //
+// stop code and the induced charge in the bins of the drift histograms //
+// (including the effective trapping taue/tauh). Only the bins between  //
+// the first and the last non-zero one are stored. A deposit then costs //
+// a voxel lookup and the addition of its response (Fill); deposits are //
+// taken at the center of their voxel, so the time resolution of the    //
+// tables is that of the mesh.                                          //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KResponseMap::KResponseMap(KDetector *det)
+{
+	Det=det;
+	Ax[0]=Det->EG->GetXaxis(); Ax[1]=Det->EG->GetYaxis(); Ax[2]=Det->EG->GetZaxis();
+	for(Int_t i=0;i<3;i++) Nv[i]=Ax[i]->GetNbins();
+	N=Det->sum->GetNbinsX();
+	T0=Det->sum->GetXaxis()->GetXmin();
+	IdT=N/(Det->sum->GetXaxis()->GetXmax()-T0);
+	BuildTime=0;
+}
+
+inline Int_t KResponseMap::Voxel(Float_t x, Float_t y, Float_t z) const
+{
+	// voxel of the point, -1 outside the detector
+	Double_t px=x,py=y,pz=z;
+	if(Det->RZ) Det->ToRZ(px,py,pz);
+	Int_t i=Ax[0]->FindFixBin(px), j=Ax[1]->FindFixBin(py), k=Ax[2]->FindFixBin(pz);
+	if(i<1 || i>Nv[0] || j<1 || j>Nv[1] || k<1 || k>Nv[2]) return -1;
+	return (i-1)+Nv[0]*((j-1)+Nv[1]*(k-1));
+}
+
+void KResponseMap::Build()
+{
+	Int_t c,nv=Nv[0]*Nv[1]*Nv[2];
+	std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+	KThreadPool pool(Det->NThreads);
+	std::vector<KStruct *> seg(pool.GetN());
+	std::vector<KSignal *> sig(pool.GetN());
+	std::vector<std::vector<Float_t> > resp[2];
+
+	if(Det->Integrator==1) Det->GetElectrodeDistance();
+
+	for(c=0;c<2;c++)
+	{
+		resp[c].resize(nv);
+		First[c].assign(nv,0); Len[c].assign(nv,0); Off[c].assign(nv,0);
+		CTime[c].assign(nv,0); QInd[c].assign(nv,0); Steps[c].assign(nv,0); Stop[c].assign(nv,0);
+	}
+	for(Int_t i=0;i<pool.GetN();i++)
+	{
+		seg[i]=new KStruct(); seg[i]->Track=0;
+		sig[i]=new KSignal(Det->sum); seg[i]->Signal=sig[i];
+	}
+
+	// one task per z slice
+	for(Int_t k=1;k<=Nv[2];k++)
+		pool.Submit([&,k](Int_t w)
+		{
+			Int_t i,j,b,e,v,cc;
+			for(j=1;j<=Nv[1];j++)
+				for(i=1;i<=Nv[0];i++)
+					for(cc=0;cc<2;cc++)
+					{
+						v=(i-1)+Nv[0]*((j-1)+Nv[1]*(k-1));
+						std::vector<Double_t> &q=cc?sig[w]->Neg:sig[w]->Pos;
+						sig[w]->Reset();
+						// deposits are stored as floats (KEvent), r-z ones around the axis
+						if(Det->RZ) Det->Drift((Float_t)Ax[0]->GetBinCenter(i),0,(Float_t)Ax[1]->GetBinCenter(j),cc?-1:1,seg[w],0,NULL,kTRUE);
+						else Det->Drift((Float_t)Ax[0]->GetBinCenter(i),(Float_t)Ax[1]->GetBinCenter(j),(Float_t)Ax[2]->GetBinCenter(k),cc?-1:1,seg[w],0,NULL,kTRUE);
+						CTime[cc][v]=seg[w]->TTime; QInd[cc][v]=seg[w]->TCharge;
+						Steps[cc][v]=seg[w]->Steps; Stop[cc][v]=seg[w]->Stop;
+						for(b=0;b<N && q[b]==0;b++);
+						for(e=N;e>b && q[e-1]==0;e--);
+						First[cc][v]=b;
+						resp[cc][v].assign(q.begin()+b,q.begin()+e);
+					}
+		});
+	pool.Wait();
+
+	// pack the responses
+	for(c=0;c<2;c++)
+	{
+		Long64_t n=0;
+		for(Int_t v=0;v<nv;v++) {Off[c][v]=n; Len[c][v]=(Int_t)resp[c][v].size(); n+=Len[c][v];}
+		Data[c].resize(n);
+		for(Int_t v=0;v<nv;v++) std::copy(resp[c][v].begin(),resp[c][v].end(),Data[c].begin()+Off[c][v]);
+		std::vector<std::vector<Float_t> >().swap(resp[c]);
+	}
+
+	for(Int_t i=0;i<pool.GetN();i++) {delete seg[i]; delete sig[i];}
+	BuildTime=std::chrono::duration<Double_t>(std::chrono::steady_clock::now()-t0).count();
+}
+
+void KResponseMap::Fill(Int_t v, Int_t c, Double_t w, KSignal *s, Double_t t0) const
+{
+	// adds the response of voxel v to a charge w of carrier type c,
+	// created at time t0 (rounded to whole bins), to s
+	if(v<0) return;
+	Int_t b,sh=(Int_t)TMath::Floor(t0*IdT+0.5);
+	Int_t lo=TMath::Max(0,-sh-First[c][v]),hi=TMath::Min(Len[c][v],N-sh-First[c][v]);
+	const Float_t *d=&Data[c][0]+Off[c][v];
+	Double_t *q=&(c?s->Neg:s->Pos)[0]+First[c][v]+sh;
+	for(b=lo;b<hi;b++) q[b]+=w*d[b];
+}
+
+Long64_t KResponseMap::GetSize() const
+{
+	// memory used by the tables [bytes]
+	Long64_t n=0;
+	for(Int_t c=0;c<2;c++) n+=Data[c].size()*sizeof(Float_t)+First[c].size()*(3*sizeof(Int_t)+sizeof(Long64_t)+2*sizeof(Float_t)+sizeof(Int_t));
+	return n;
+}
+
+void KResponseMap::Print() const
+{
+	printf("KResponseMap: %d voxels, %.1f MB, built in %.2f s\n",Nv[0]*Nv[1]*Nv[2],GetSize()/1048576.,BuildTime);
+}
+
+
+// KDriftBatch
+
+class KDriftBatch
+{
+	private:
+		KDetector *Det;
+		KFieldGrid *GReal;            // flat electric field
+		KFieldGrid *GRamo;            // flat weighting field
+		Int_t NeffConst;              // Neff is the same everywhere
+		Double_t Neff0;               // its value
+		Double_t Low[3],Up[3];        // detector edges
+		Int_t Nb[3];                  // bins of the material map
+		Double_t Min[3],Max[3];       // range of the material map
+		std::vector<Int_t> DMat;      // material map including under/overflow bins
+		TH3F *Trap[2];                // trapping rates of holes and electrons (KDetector::GetTrapMap)
+
+		// active carriers - structure of arrays, compacted after every step
+		Int_t NAct;
+		std::vector<Int_t> Id,St,Mat,Hit;
+		std::vector<Double_t> X,Y,Z,T,SumC,NX,NY,NZ,DX,DY,DZ,Em,Depth,Thr,G;
+		std::vector<ULong64_t> Key,Ctr;
+		std::vector<Float_t> Q,Ex,Ey,Ez,E,NEx,NEy,NEz,NE,W,NW,Path,Vel,Mu,Ef,Tmp,Tmp2;
+
+		void Resize(Int_t);
+		Int_t Material(Double_t, Double_t, Double_t) const;
+		void Velocity(Int_t);
+
+	public:
+		// results indexed by the carrier id returned by Add()
+		std::vector<Double_t> TTime;      // time at the end of the drift [s]
+		std::vector<Double_t> TCharge;    // induced charge
+		std::vector<Float_t> PathLen;     // drift length [um]
+		std::vector<Int_t> Steps;         // number of steps
+		std::vector<Int_t> Stop;          // stop code (ishit of KDetector::Drift)
+		std::vector<Double_t> Xend,Yend,Zend; // end point of the drift (on the mesh)
+		std::vector<ULong64_t> Keys;      // random stream (KRandom key) of the carrier
+
+		Bool_t Valid;                 // both fields are on a uniform mesh (KFieldGrid)
+		Long64_t NSteps;              // carrier-steps done
+		Double_t RealTime;            // time spent drifting [s]
+
+		KDriftBatch(KDetector *);
+		~KDriftBatch(){};
+		Int_t Add(Double_t, Double_t, Double_t, Float_t, Double_t = 0, ULong64_t = 0);
+		Int_t GetN() {return (Int_t)TTime.size();};
+		Int_t GetNActive() {return NAct;};
+		void Clear();
+		Bool_t Start();
+		Int_t Step();
+		void Run();
+		Double_t GetRate() {return RealTime>0?NSteps/RealTime:0;};
+		void Print();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KDriftBatch                                                          //
+//                                                                      //
+// Drifts many point charges in lockstep. The carriers are kept in      //
+// structure-of-arrays form and every step is a sequence of loops over  //
+// all active carriers: drift direction, field sampling (KFieldGrid),   //
+// velocity (KVelocityTable::Eval if VelTab=1), diffusion, boundary     //
+// handling and the termination tests. Finished carriers are compacted  //
+// out after each step. The physics follows KDetector::Drift step by    //
+// step - same stop codes, same induced charge - but only the summary   //
+// of each drift is kept. The weighting potential is sampled once per   //
+// step instead of three times. Each carrier has its own KRandom stream //
+// (Keys), so with diffusion and trapping a Drift given KRandom(key)    //
+// repeats it exactly.                                                  //
+//                                                                      //
+// Throughput is reported in carrier-steps per second (GetRate, Print). //
+// The target for the 3D cell in main with VelTab=1 is 1e7 steps/s on  //
+// one core, about two orders of magnitude above KDetector::Drift.      //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KDriftBatch::KDriftBatch(KDetector *det)
+{
+	Int_t i,j,k,q;
+	TAxis *ax[3];
+	Double_t xc,yc,zc,n0;
+
+	Det=det;
+	GReal=Det->Real->GetFieldGrid();
+	GRamo=Det->Ramo->GetFieldGrid();
+	Valid=GReal!=NULL && GRamo!=NULL && GReal->Valid && GRamo->Valid;
+	if(!Valid)
+		printf("KDriftBatch: fields must be calculated on a uniform mesh first!\n");
+
+	for(i=0;i<3;i++) {Low[i]=Det->GetLowEdge(i); Up[i]=Det->GetUpEdge(i);}
+
+	// material map with the same bin lookup as DM->FindBin
+	if(Det->DM!=NULL)
+	{
+		ax[0]=Det->DM->GetXaxis(); ax[1]=Det->DM->GetYaxis(); ax[2]=Det->DM->GetZaxis();
+		for(i=0;i<3;i++) {Nb[i]=ax[i]->GetNbins(); Min[i]=ax[i]->GetXmin(); Max[i]=ax[i]->GetXmax();}
+		DMat.resize((Nb[0]+2)*(Nb[1]+2)*(Nb[2]+2));
+		for(k=0;k<=Nb[2]+1;k++)
+			for(j=0;j<=Nb[1]+1;j++)
+				for(i=0;i<=Nb[0]+1;i++)
+				{
+					q=i+(Nb[0]+2)*(j+(Nb[1]+2)*k);
+					DMat[q]=(Int_t)Det->DM->GetBinContent(i,j,k);
+				}
+	}
+
+	// a constant doping profile needs no evaluation per step
+	NeffConst=1;
+	n0=Det->NeffF->Eval(Low[0],Low[1],Low[2]);
+	for(q=0;q<27 && NeffConst;q++)
+	{
+		xc=Low[0]+(Up[0]-Low[0])*(q%3)/2.;
+		yc=Low[1]+(Up[1]-Low[1])*((q/3)%3)/2.;
+		zc=Low[2]+(Up[2]-Low[2])*(q/9)/2.;
+		if(Det->NeffF->Eval(xc,yc,zc)!=n0) NeffConst=0;
+	}
+	Neff0=TMath::Abs(n0);
+
+	Trap[0]=Det->GetTrapMap(0); Trap[1]=Det->GetTrapMap(1);
+
+	Clear();
+}
+
+void KDriftBatch::Clear()
+{
+	// removes all carriers and results
+	NAct=0;
+	TTime.clear(); TCharge.clear(); PathLen.clear(); Steps.clear(); Stop.clear();
+	Xend.clear(); Yend.clear(); Zend.clear(); Keys.clear();
+	NSteps=0; RealTime=0;
+}
+
+void KDriftBatch::Resize(Int_t n)
+{
+	Id.resize(n); St.resize(n); Mat.resize(n); Hit.resize(n);
+	X.resize(n); Y.resize(n); Z.resize(n); T.resize(n); SumC.resize(n);
+	NX.resize(n); NY.resize(n); NZ.resize(n); DX.resize(n); DY.resize(n); DZ.resize(n); Em.resize(n);
+	Depth.resize(n); Thr.resize(n); G.resize(4*n); Key.resize(n); Ctr.resize(n);
+	Q.resize(n); Ex.resize(n); Ey.resize(n); Ez.resize(n); E.resize(n);
+	NEx.resize(n); NEy.resize(n); NEz.resize(n); NE.resize(n); W.resize(n); NW.resize(n);
+	Path.resize(n); Vel.resize(n); Mu.resize(n); Ef.resize(n); Tmp.resize(n); Tmp2.resize(n);
+}
+
+Int_t KDriftBatch::Add(Double_t sx, Double_t sy, Double_t sz, Float_t charg, Double_t t0, ULong64_t key)
+{
+	// Adds a point charge starting at (sx,sy,sz) at time t0 and returns its id.
+	// Its diffusion and trapping use the KRandom stream key (default:
+	// KSeed(Seed, id)); KDetector::Drift with a KRandom of the same key
+	// repeats the drift.
+	Int_t id=(Int_t)TTime.size();
+
+	if(Det->RZ) Det->ToRZ(sx,sy,sz);
+	if(key==0) key=KSeed(Det->Seed,id);
+	if(NAct>=(Int_t)X.size()) Resize(NAct<2048?4096:2*NAct);
+	Id[NAct]=id; St[NAct]=-1; Key[NAct]=key;
+	X[NAct]=sx; Y[NAct]=sy; Z[NAct]=sz; T[NAct]=t0; Q[NAct]=charg;
+	SumC[NAct]=0; Path[NAct]=0;
+	NAct++;
+
+	TTime.push_back(t0); TCharge.push_back(0); PathLen.push_back(0); Steps.push_back(0); Stop.push_back(0);
+	Xend.push_back(sx); Yend.push_back(sy); Zend.push_back(sz); Keys.push_back(key);
+	return id;
+}
+
+inline Int_t KDriftBatch::Material(Double_t x, Double_t y, Double_t z) const
+{
+	Int_t i,j,k;
+	if(DMat.empty()) return 0;
+	i=x<Min[0]?0:(x>=Max[0]?Nb[0]+1:1+(Int_t)(Nb[0]*(x-Min[0])/(Max[0]-Min[0])));
+	j=y<Min[1]?0:(y>=Max[1]?Nb[1]+1:1+(Int_t)(Nb[1]*(y-Min[1])/(Max[1]-Min[1])));
+	k=z<Min[2]?0:(z>=Max[2]?Nb[2]+1:1+(Int_t)(Nb[2]*(z-Min[2])/(Max[2]-Min[2])));
+	return DMat[i+(Nb[0]+2)*(j+(Nb[1]+2)*k)];
+}
+
+void KDriftBatch::Velocity(Int_t n)
+{
+	// Drift velocity at the mean field Em and, for the diffusion, the
+	// mobility at E. With VelTab=1 and one material for all carriers
+	// the batch interpolation is used, once per carrier type present.
+	Int_t m,c,mobmod,same=1,sign=0;
+	Float_t temp;
+	Double_t neff;
+	KVelocityTable *vt=NULL;
+
+	if(Det->VelTab && NeffConst)
+	{
+		mobmod=Det->MobMod(Mat[0]); temp=Det->GetTemperature(Mat[0]);
+		for(m=0;m<n && same;m++)
+		{
+			if(Det->MobMod(Mat[m])!=mobmod || Det->GetTemperature(Mat[m])!=temp) same=0;
+			sign|=Q[m]>0?1:2;
+		}
+		if(same)
+		{
+			for(c=1;c<=2;c++)
+			{
+				if(!(sign&c)) continue;
+				vt=Det->VTables->Get(mobmod,c==1?1:-1,temp,Neff0);
+				for(m=0;m<n;m++) Ef[m]=Em[m];
+				vt->Eval(n,&Ef[0],&Tmp[0]);
+				if(sign==3) for(m=0;m<n;m++) Vel[m]=((Q[m]>0)==(c==1))?Tmp[m]:Vel[m];
+				else for(m=0;m<n;m++) Vel[m]=Tmp[m];
+				if(Det->diff)
+				{
+					// same units as in KDetector::Drift
+					for(m=0;m<n;m++) Ef[m]=E[m]*1e-4;
+					vt->Eval(n,&Ef[0],&Tmp[0],&Tmp2[0]);
+					for(m=0;m<n;m++) Mu[m]=(sign!=3 || (Q[m]>0)==(c==1))?Tmp2[m]:Mu[m];
+				}
+			}
+			return;
+		}
+	}
+
+	for(m=0;m<n;m++)
+	{
+		mobmod=Det->MobMod(Mat[m]); temp=Det->GetTemperature(Mat[m]);
+		neff=NeffConst?Neff0:TMath::Abs(Det->NeffF->Eval(X[m],Y[m],Z[m]));
+		if(Det->VelTab)
+		{
+			vt=Det->VTables->Get(mobmod,Q[m],temp,neff);
+			Vel[m]=vt->Velocity(Em[m]);
+			if(Det->diff) Mu[m]=vt->Mobility(E[m]*1e-4);
+		}
+		else
+		{
+			Vel[m]=Det->Real->DriftVelocity(Em[m],Q[m],temp,neff,mobmod);
+			if(Det->diff) Mu[m]=Det->Real->Mobility(E[m],temp,Q[m],neff,mobmod);
+		}
+	}
+}
+
+Bool_t KDriftBatch::Start()
+{
+	// field and weighting potential at the starting points and the
+	// optical depths at which the new carriers get trapped. Returns
+	// kFALSE without fields, nothing can drift then.
+	Int_t m;
+	if(!Valid) return kFALSE;
+	for(m=0;m<NAct;m++) if(St[m]<0) break;
+	if(m==NAct) return kTRUE;
+	GReal->Field(NAct,&X[0],&Y[0],&Z[0],&Ex[0],&Ey[0],&Ez[0],&E[0]);
+	GRamo->Potential(NAct,&X[0],&Y[0],&Z[0],&W[0]);
+	for(m=0;m<NAct;m++)
+		if(St[m]<0)
+		{
+			St[m]=0; Depth[m]=0;
+			if(Trap[0]!=NULL) {KRandom r(Key[m]); Thr[m]=-TMath::Log(r.Rndm());}
+		}
+	return kTRUE;
+}
+
+Int_t KDriftBatch::Step()
+{
+	// One drift step of all active carriers. Returns the number of
+	// carriers still drifting, 0 if the fields are missing (Valid).
+	Int_t m,n=NAct,w;
+	Double_t fx,fy,fz,fm,bx,by,bz,mu,difx,dify,difz,sigma,Stime;
+	TH3F *tm;
+	Double_t SStep=Det->SStep;
+	Float_t muhe=1650, muhh=310;    // same magnetic field parametrization as Drift
+
+	if(n==0 || !Start()) return 0;
+	bx=Det->B[0]; by=Det->B[1]; bz=Det->B[2];
+
+	// drift direction along the (Lorentz deflected) field
+	for(m=0;m<n;m++)
+	{
+		mu=Q[m]>0?muhh:-muhe;
+		fx=Ex[m]+mu*(Ey[m]*bz-Ez[m]*by);
+		fy=Ey[m]+mu*(Ez[m]*bx-Ex[m]*bz);
+		fz=Ez[m]+mu*(Ex[m]*by-Ey[m]*bx);
+		fm=sqrt(fx*fx+fy*fy+fz*fz);
+		fm=fm!=0?-SStep*Q[m]/fm:0;
+		DX[m]=fm*fx; DY[m]=fm*fy; DZ[m]=fm*fz;
+		NX[m]=X[m]+DX[m]; NY[m]=Y[m]+DY[m]; NZ[m]=Z[m]+DZ[m];
+		Hit[m]=0; St[m]++;
+	}
+
+	for(m=0;m<n;m++) Mat[m]=Material(X[m],Y[m],Z[m]);
+
+	// field at the end of the step and velocity at the average field
+	GReal->Field(n,&NX[0],&NY[0],&NZ[0],&NEx[0],&NEy[0],&NEz[0],&NE[0]);
+	for(m=0;m<n;m++) Em[m]=((Double_t)NE[m]+E[m])/2;
+	Velocity(n);
+
+	for(m=0;m<n;m++)
+		if(Vel[m]==0) {DX[m]=0; DY[m]=0; DZ[m]=0; Hit[m]=9;}
+
+	// diffusion - normals of the carriers' streams at this step
+	if(Det->diff)
+	{
+		for(m=0;m<n;m++) Ctr[m]=St[m];
+		KRandom::Normal4(n,&Key[0],&Ctr[0],&G[0]);
+	}
+	for(m=0;m<n;m++)
+	{
+		difx=0; dify=0; difz=0;
+		if(Vel[m]!=0 && Det->diff && !(Det->DiffOffField<NE[m] && Det->MTresh>1))
+		{
+			Stime=SStep*1e-4/Vel[m];
+			sigma=TMath::Sqrt(2*Kboltz*Mu[m]*Det->GetTemperature(Mat[m])*Stime);
+			dify=sigma*G[4*m]*1e4;
+			difx=sigma*G[4*m+1]*1e4;
+			if(Det->nz!=1 || Det->RZ) difz=sigma*G[4*m+2]*1e4;
+		}
+		if(Det->RZ)
+		{
+			// r-z: the azimuthal step only changes the radius (see KDetector::Drift)
+			NX[m]=sqrt((X[m]+DX[m]+difx)*(X[m]+DX[m]+difx)+(DZ[m]+difz)*(DZ[m]+difz)); NX[m]=NX[m]>=Up[0]?Up[0]:NX[m];
+			NY[m]=Y[m]+DY[m]+dify; NY[m]=NY[m]>=Up[1]?Up[1]:(NY[m]<Low[1]?Low[1]:Y[m]+(DY[m]+dify));
+			NZ[m]=Z[m];
+			continue;
+		}
+		NX[m]=X[m]+DX[m]+difx; NX[m]=NX[m]>=Up[0]?Up[0]:(NX[m]<Low[0]?Low[0]:X[m]+(DX[m]+difx));
+		NY[m]=Y[m]+DY[m]+dify; NY[m]=NY[m]>=Up[1]?Up[1]:(NY[m]<Low[1]?Low[1]:Y[m]+(DY[m]+dify));
+		NZ[m]=Z[m]+DZ[m]+difz; NZ[m]=NZ[m]>=Up[2]?Up[2]:(NZ[m]<Low[2]?Low[2]:Z[m]+(DZ[m]+difz));
+	}
+
+	// induced charge
+	GRamo->Potential(n,&NX[0],&NY[0],&NZ[0],&NW[0]);
+	for(m=0;m<n;m++)
+	{
+		SumC[m]+=(Float_t)(Q[m]*(NW[m]-W[m]));
+		W[m]=NW[m];
+	}
+
+	// trapping - optical depth as in Drift
+	if(Trap[0]!=NULL)
+		for(m=0;m<n;m++)
+		{
+			if(Vel[m]==0) continue;
+			tm=Trap[Q[m]<0];
+			Depth[m]+=SStep*1e-4/Vel[m]*tm->GetBinContent(tm->FindBin((NX[m]+X[m])/2,(NY[m]+Y[m])/2,(NZ[m]+Z[m])/2));
+			if(Depth[m]>Thr[m]) Hit[m]=12;
+		}
+
+	for(m=0;m<n;m++)
+	{
+		if(Vel[m]!=0) {T[m]+=SStep*1e-4/Vel[m]; Path[m]+=SStep;}
+		X[m]=NX[m]; Y[m]=NY[m]; Z[m]=NZ[m];
+	}
+
+	GReal->Field(n,&X[0],&Y[0],&Z[0],&Ex[0],&Ey[0],&Ez[0],&E[0]);
+
+	// termination of the drift
+	for(m=0;m<n;m++)
+	{
+		if(W[m]>(1-Det->Deps)) Hit[m]=1;
+		if(X[m]<=Low[0] && !Det->RZ) Hit[m]=3;
+		if(X[m]>=Up[0])  Hit[m]=4;
+		if(Y[m]<=Low[1]) Hit[m]=5;
+		if(Y[m]>=Up[1])  Hit[m]=6;
+		if(Z[m]<=Low[2]) Hit[m]=7;
+		if(Z[m]>=Up[2])  Hit[m]=8;
+		if(Path[m]>Det->MaxDriftLen) Hit[m]=11;
+		if(Det->MaxSteps>0 && St[m]>=Det->MaxSteps) Hit[m]=20;
+	}
+	NSteps+=n;
+
+	// store the finished carriers and compact the rest
+	for(m=0,w=0;m<n;m++)
+	{
+		if(Hit[m])
+		{
+			TTime[Id[m]]=T[m]; TCharge[Id[m]]=SumC[m]; PathLen[Id[m]]=Path[m];
+			Steps[Id[m]]=St[m]; Stop[Id[m]]=Hit[m];
+			KProfile::AddStop(Hit[m],St[m]);
+			Xend[Id[m]]=X[m]; Yend[Id[m]]=Y[m]; Zend[Id[m]]=Z[m];
+			continue;
+		}
+		if(w!=m)
+		{
+			Id[w]=Id[m]; St[w]=St[m]; Q[w]=Q[m]; Key[w]=Key[m];
+			X[w]=X[m]; Y[w]=Y[m]; Z[w]=Z[m]; T[w]=T[m]; SumC[w]=SumC[m]; Path[w]=Path[m];
+			Depth[w]=Depth[m]; Thr[w]=Thr[m];
+			Ex[w]=Ex[m]; Ey[w]=Ey[m]; Ez[w]=Ez[m]; E[w]=E[m]; W[w]=W[m];
+		}
+		w++;
+	}
+	NAct=w;
+	return NAct;
+}
+
+void KDriftBatch::Run()
+{
+	// drifts all carriers to the end
+	KProfileTimer prof(KProfile::kBatch);
+	std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+	while(Step());
+	RealTime+=std::chrono::duration<Double_t>(std::chrono::steady_clock::now()-t0).count();
+}
+
+void KDriftBatch::Print()
+{
+	printf("KDriftBatch: %d carriers, %lld carrier-steps in %.3f s -> %.3e carrier-steps/s\n",
+			GetN(),(long long)NSteps,RealTime,GetRate());
+}
+
+
+// K3D 
+
+
+#include "TArray.h"
+#include "TArrayI.h"
+#include "TArrayF.h"
+#include "TGraph.h"
+#include <stdio.h>
+#include <stdlib.h>
+//#include "KStruct.h"
+#include "TMinuit.h"
+// #include "KDetector.h"
+
+
+class K3D : public KDetector
+{
+	private:
+	public:
+		Int_t Col;
+		Float_t CellZ;
+		Float_t CellX;
+		Float_t CellY;
+
+		Float_t *PosD; //[Col]
+		Float_t *PosX; //[Col]
+		Float_t *PosY; //[Col]
+		Float_t *PosR; //[Col]
+		Short_t *PosW; //[Col]
+		Short_t *PosM; //[Col]
+
+		K3D(Int_t, Float_t = 100, Float_t = 100, Float_t = 105);
+		~K3D();
+		void SetUpVolume(Float_t, Float_t);
+		void SetUpColumn(Int_t, Float_t, Float_t, Float_t, Float_t, Short_t, Short_t);
+		void SetUpElectrodes(Int_t = 0);
+		void SetUpCell(Float_t, Float_t);
+		static K3D *Cell(Float_t, Float_t, Float_t, Float_t);
+
+		// ClassDef(K3D, 1)
+};
+
+// ClassImp(K3D)
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// K3D                                                                  //
+//                                                                      //
+// Description of the 3D detector.                                      //
+// The geometry of the                                                  //
+// is defined by                                                        //
+// dasdasd                                                              //
+//////////////////////////////////////////////////////////////////////////
+
+K3D::~K3D()
+{
+	delete PosD;
+	delete PosX;
+	delete PosY;
+	delete PosR;
+	delete PosW;
+}
+
+K3D::K3D(Int_t x1, Float_t x, Float_t y, Float_t z)
+{
+	Col = x1;
+	PosD = new Float_t[Col];
+	PosX = new Float_t[Col];
+	PosY = new Float_t[Col];
+	PosR = new Float_t[Col];
+	PosW = new Short_t[Col];
+	PosM = new Short_t[Col];
+
+	for (Int_t i = 0; i < Col; i++) {
+		PosD[i] = 0;
+		PosX[i] = 0;
+		PosY[i] = 0;
+		PosR[i] = 0;
+		PosW[i] = 0;
+		PosM[i] = 0;
+	}
+
+	CellZ = z;
+	CellX = x;
+	CellY = y;
+}
+
+void K3D::SetUpVolume(Float_t St1, Float_t St2)
+{
+	nx = (int)(CellX / St1);
+	ny = (int)(CellY / St1);
+	nz = (int)(CellZ / St2);
+
+	EG = new TH3I("EG", "EG", nx, 0, CellX, ny, 0, CellY, nz, 0, CellZ);
+	EG->GetXaxis()->SetTitle("x [#mum]");
+	EG->GetYaxis()->SetTitle("y [#mum]");
+	EG->GetZaxis()->SetTitle("z [#mum]");
+
+	GetGrid(EG, 1);
+}
+
+void K3D::SetUpColumn(Int_t n, Float_t posX, Float_t posY, Float_t R, Float_t Depth, Short_t Wei, Short_t Mat)
+{
+	PosD[n] = Depth;
+	PosR[n] = R;
+	PosX[n] = posX;
+	PosY[n] = posY;
+	PosW[n] = Wei;
+	PosM[n] = Mat;
+}
+
+void K3D::SetUpElectrodes(Int_t back)
+{
+	Float_t Pos[3], L = 0;
+	Int_t i, j, k;
+	KProfileTimer prof(KProfile::kGeometry);
+	if (back) {
+		for (k = 1; k <= nz; k++)
+			for (j = 1; j <= ny; j++)
+				for (i = 1; i <= nx; i++)
+					if (k == 1)
+						EG->SetBinContent(i, j, k, 2);
+					else
+						EG->SetBinContent(i, j, k, 0);
+	}
+
+	for (Int_t i = 0; i < Col; i++) {
+		Pos[0] = PosX[i];
+		Pos[1] = PosY[i];
+		Pos[2] = PosD[i] >= 0 ? Pos[2] = PosD[i] / 2. : (2 * CellZ + PosD[i]) / 2.;
+		L = TMath::Abs(PosD[i] / 2.);
+		ElCylinder(Pos, PosR[i], L, 3, PosW[i], PosM[i]);
+	}
+}
+
+K3D *K3D::Cell(Float_t Pitch, Float_t Radius, Float_t Depth, Float_t Thickness)
+{
+	// The 3D cell of raser: a readout column in the middle of six bias
+	// columns at distance Pitch, in a square of side 3.2 Pitch
+	Float_t c = 3.2 * Pitch, h = Pitch * TMath::Sqrt(3.) / 2;
+	Float_t X[6] = {0, 0, h, h, -h, -h};
+	Float_t Y[6] = {-Pitch, Pitch, -Pitch / 2, Pitch / 2, -Pitch / 2, Pitch / 2};
+	K3D *det = new K3D(7, c, c, Thickness);
+	for (Int_t i = 0; i < 6; i++)
+		det->SetUpColumn(i, c / 2 + X[i], c / 2 + Y[i], Radius, Depth, 2, 1);
+	det->SetUpColumn(6, c / 2, c / 2, Radius, -Depth, 16385, 1);
+	return det;
+}
+
+void K3D::SetUpCell(Float_t St1, Float_t St2)
+{
+	// Mesh, back plane, columns and boundary conditions of a Cell
+	Float_t Pos[3] = {CellX, CellY, 1};
+	Float_t Size[3] = {CellX, CellY, 2};
+	SetUpVolume(St1, St2);
+	ElRectangle(Pos, Size, 0, 20);
+	SetUpElectrodes();
+	SetBoundaryConditions();
+}
+
+
+// KCyl
+
+class KCyl : public KDetector
+{
+	private:
+		void Fill(Float_t, Float_t, Float_t, Float_t, Short_t, Short_t);
+	public:
+		Int_t Col;
+		Float_t CellR;
+		Float_t CellZ;
+
+		Float_t *PosR1; //[Col]
+		Float_t *PosR2; //[Col]
+		Float_t *PosD;  //[Col]
+		Short_t *PosW;  //[Col]
+		Short_t *PosM;  //[Col]
+
+		KCyl(Int_t, Float_t = 50, Float_t = 300);
+		~KCyl();
+		void SetUpVolume(Float_t, Float_t);
+		void SetUpColumn(Int_t, Float_t, Float_t, Float_t, Short_t, Short_t);
+		void SetUpElectrodes();
+		void SetUpCell(Float_t, Float_t);
+		static KCyl *Cell(Float_t, Float_t, Float_t, Float_t);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KCyl                                                                 //
+//                                                                      //
+// Axisymmetric detector solved in the r-z plane (RZ=1): the x axis of  //
+// the mesh is the radius 0..CellR from the symmetry axis, the y axis   //
+// the depth 0..CellZ, z a single bin. The columns are rings R1..R2     //
+// around the axis (R1=0: a column on the axis) of depth Depth, from    //
+// the front (Depth>0) or from the back (Depth<0). Declaration uses the //
+// cylindrical Laplacian, so the solve and the field memory are those   //
+// of a 2D mesh. The drift takes 3D positions around the axis x=y=0     //
+// (KDetector::ToRZ) and follows the carriers in the r-z plane, where   //
+// the paths are stored.                                                //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+KCyl::~KCyl()
+{
+	delete [] PosR1;
+	delete [] PosR2;
+	delete [] PosD;
+	delete [] PosW;
+	delete [] PosM;
+}
+
+KCyl::KCyl(Int_t x1, Float_t r, Float_t z)
+{
+	Col = x1;
+	PosR1 = new Float_t[Col];
+	PosR2 = new Float_t[Col];
+	PosD = new Float_t[Col];
+	PosW = new Short_t[Col];
+	PosM = new Short_t[Col];
+
+	for (Int_t i = 0; i < Col; i++) {
+		PosR1[i] = 0;
+		PosR2[i] = 0;
+		PosD[i] = 0;
+		PosW[i] = 0;
+		PosM[i] = 0;
+	}
+
+	CellR = r;
+	CellZ = z;
+	RZ = 1;
+}
+
+void KCyl::SetUpVolume(Float_t St1, Float_t St2)
+{
+	nx = (int)(CellR / St1);
+	ny = (int)(CellZ / St2);
+	nz = 1;
+
+	EG = new TH3I("EG", "EG", nx, 0, CellR, ny, 0, CellZ, nz, 0, 1);
+	EG->GetXaxis()->SetTitle("r [#mum]");
+	EG->GetYaxis()->SetTitle("z [#mum]");
+	EG->GetZaxis()->SetTitle("");
+
+	GetGrid(EG, 1);
+}
+
+void KCyl::SetUpColumn(Int_t n, Float_t R1, Float_t R2, Float_t Depth, Short_t Wei, Short_t Mat)
+{
+	PosR1[n] = R1;
+	PosR2[n] = R2;
+	PosD[n] = Depth;
+	PosW[n] = Wei;
+	PosM[n] = Mat;
+}
+
+void KCyl::Fill(Float_t R1, Float_t R2, Float_t Z1, Float_t Z2, Short_t Wei, Short_t Mat)
+{
+	// bins with the centre in R1<=r<=R2, Z1<=z<=Z2
+	Float_t r, z;
+	Int_t i, j;
+	for (j = 1; j <= ny; j++)
+		for (i = 1; i <= nx; i++) {
+			r = EG->GetXaxis()->GetBinCenter(i);
+			z = EG->GetYaxis()->GetBinCenter(j);
+			if (r < R1 || r > R2 || z < Z1 || z > Z2) continue;
+			EG->SetBinContent(i, j, 1, Wei);
+			if (DM != NULL) DM->SetBinContent(i, j, 1, Mat);
+		}
+}
+
+void KCyl::SetUpElectrodes()
+{
+	KProfileTimer prof(KProfile::kGeometry);
+	for (Int_t i = 0; i < Col; i++) {
+		if (PosD[i] >= 0)
+			Fill(PosR1[i], PosR2[i], 0, PosD[i], PosW[i], PosM[i]);
+		else
+			Fill(PosR1[i], PosR2[i], CellZ + PosD[i], CellZ, PosW[i], PosM[i]);
+	}
+}
+
+KCyl *KCyl::Cell(Float_t Pitch, Float_t Radius, Float_t Depth, Float_t Thickness)
+{
+	// The 3D cell of raser (K3D::Cell) with the six bias columns around
+	// the readout column replaced by a ring at distance Pitch
+	KCyl *det = new KCyl(2, Pitch + Radius, Thickness);
+	det->SetUpColumn(0, Pitch - Radius, Pitch + Radius, Depth, 2, 1);
+	det->SetUpColumn(1, 0, Radius, -Depth, 16385, 1);
+	return det;
+}
+
+void KCyl::SetUpCell(Float_t St1, Float_t St2)
+{
+	// Mesh, front layer, columns and boundary conditions of a Cell
+	Float_t Pos[3] = {CellR, 1, 0.5};
+	Float_t Size[3] = {CellR, 2, 0.25};
+	SetUpVolume(St1, St2);
+	ElRectangle(Pos, Size, 0, 20);
+	SetUpElectrodes();
+	SetBoundaryConditions();
+}
+
+
+// KSweep
+
+class KSweepPoint
+{
+	public:
+		Float_t Radius;       // column radius [um]
+		Float_t Pitch;        // distance of the bias columns from the readout column [um]
+		Float_t Depth;        // column depth [um]
+		Float_t Voltage;      // bias [V]
+		Float_t Temperature;  // temperature [K]
+		Int_t Diff;           // diffusion in the drift (yes=1, no=0)
+
+		Double_t Charge;      // charge induced by the mip [e]
+		Double_t Peak;        // largest current [e/s]
+		Double_t T90;         // time at which 90% of the charge is collected [s]
+		Double_t Time;        // wall time used by the point [s]
+		Int_t Solved;         // fields solved for this point (0 = all from the cache)
+};
+
+class KSweepCache
+{
+	public:
+		TH3I *EG,*DM;         // geometry after the boundary conditions
+		TH3F *U;              // weighting potential of a geometry, potential of a field
+		std::once_flag Once;
+
+		KSweepCache() {EG=NULL; DM=NULL; U=NULL;};
+		~KSweepCache() {if(EG!=NULL) delete EG; if(DM!=NULL) delete DM; if(U!=NULL) delete U;};
+};
+
+class KSweep
+{
+	private:
+		std::vector<Float_t> Values[6];    // grid of every parameter (see Names)
+		std::map<std::string,std::shared_ptr<KSweepCache> > Cache;
+		std::mutex Lock;
+		std::condition_variable MemFree;
+		Long64_t MemUsed;
+		std::atomic<Int_t> NSolved;
+
+		std::shared_ptr<KSweepCache> GetCache(const std::string &);
+		K3D *Build(KSweepPoint &);
+		void Measure(K3D *, KSweepPoint &);
+
+	public:
+		static const char *Names[6];
+		std::vector<KSweepPoint> Points;   // the expanded grid and its results
+
+		Float_t Thickness;    // detector thickness [um]
+		Float_t Step[2];      // mesh steps in x,y and z [um] (K3D::SetUpVolume)
+		Float_t Neff;         // effective doping concentration
+		Float_t TMax;         // time range of the drift histograms [s]
+		Int_t NBins;          // their number of bins
+		Int_t Div;            // buckets of the mip track (MipIR)
+		Int_t NThreads;       // points (groups with one field) run at the same time (0 = all cores)
+		Long64_t MemLimit;    // memory the running points may use [bytes]
+
+		KSweep();
+		~KSweep(){};
+		Int_t Set(const char *, const char *);
+		Int_t SetGrid(const char *);
+		Int_t Expand();
+		Long64_t GetMemory(KSweepPoint &);
+		void Run();
+		void Print();
+		void Write(const char *);
+		void ClearCache() {Cache.clear();};
+};
 
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KSweep                                                               //
+//                                                                      //
+// Runs a design study of the 3D cell of raser: a readout column in    //
+// the middle of six bias columns at distance Pitch, all of radius      //
+// Radius and depth Depth. The grid of every parameter is given with    //
+// Set ("a,b,c" or "lo:hi:step"), Run() expands the grid and measures   //
+// the induced current of a mip for every point.                        //
+//                                                                      //
+// The points are grouped by the parameters the electric field depends //
+// on (geometry and Voltage); a group is solved once and its points,   //
+// which differ only in the drift settings, reuse the detector. Groups  //
+// run in parallel on NThreads cores, as many at a time as fit into     //
+// MemLimit. The geometry with its weighting field and every electric  //
+// field are kept in a cache keyed by the parameters they depend on, so //
+// a voltage scan solves the weighting field once and a second Run()   //
+// with other drift settings solves nothing.                            //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
-				b[n]-=kappa(i,j,k,dowhat);
-				if(val&1 || val&2 || val>=32768)   {U0 D0 L0 R0 C0 O0 I0 b[n]=V(val,dowhat);}   
-				//if(j<=2 && i<=2) printf("stevilki: i=%d, j=%d, k=%d X=(%f %f ::%f %f), Y(%f %f :: %f %f), Z(%f %f :: %f %f) y[2,3,4,5,6,7,8]=%f %f %f %f %f %f %f :: b[n]=%f :: %d\n",i,j,k,Xr,Xl,Ld,Rd,Yr,Yl,Dd,Ud,Zr,Zl,Id,Od,y2[n],y3[n],y4[n],y5[n],y6[n],y7[n],y8[n],b[n],Mat);
-				//      if(k==nz && (j==2 || j==ny-1)) printf("stevilki: i=%d, j=%d, k=%d X=(%f %f ::%f %f), Y(%f %f :: %f %f), Z(%f %f :: %f %f) y[2,3,4,5,6,7,8]=%f %f %f %f %f %f %f :: b[n]=%f\n",i,j,k,Xr,Xl,Ld,Rd,Yr,Yl,Dd,Ud,Zr,Zl,Id,Od,y2[n],y3[n],y4[n],y5[n],y6[n],y7[n],y8[n],b[n]);
-			}
+const char *KSweep::Names[6]={"radius","pitch","depth","voltage","temperature","diff"};
 
+KSweep::KSweep()
+{
+	Values[0].assign(1,4); Values[1].assign(1,25); Values[2].assign(1,280);
+	Values[3].assign(1,50); Values[4].assign(1,300); Values[5].assign(1,1);
+	Thickness=300; Step[0]=1; Step[1]=4; Neff=2;
+	TMax=1.2e-9; NBins=200; Div=150;
+	NThreads=0;
+	MemLimit=(Long64_t)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGE_SIZE)/2;
+	MemUsed=0; NSolved=0;
 }
 
-double KDetector::V(int val, int dowhat)
+Int_t KSweep::Set(const char *name, const char *val)
 {
-	double voltage;
-	int k=0;
-	if(dowhat==0) 
+	// Grid of parameter name: a list "a,b,c" or a range "lo:hi:step"
+	Int_t i,n;
+	Double_t lo,hi,st;
+	for(i=0;i<6;i++) if(!strcmp(name,Names[i])) break;
+	if(i==6) {printf("KSweep: unknown parameter %s\n",name); return -1;}
+	Values[i].clear();
+	if(sscanf(val,"%lf:%lf:%lf",&lo,&hi,&st)==3 && st>0)
 	{
-		if(val&1) voltage=0;  
-		if(val&2) voltage=Voltage;
-		if(val & 32768) 
-			//if bit 15 is on - many voltages
-			voltage=Voltages[val>>16];
+		n=(Int_t)TMath::Floor((hi-lo)/st+1e-6);
+		for(Int_t k=0;k<=n;k++) Values[i].push_back(lo+k*st);
 	}
 	else
 	{
-		// numerical calculation converges faster if 1000 is used instead of 1
-		// therefore the potential is scaled after calculation to 1
-		if(val&16384) voltage=10000; else voltage=0;
+		const char *p=val;
+		char *q;
+		while(*p)
+		{
+			Values[i].push_back(strtod(p,&q));
+			if(q==p) {printf("KSweep: bad value %s of %s\n",p,name); Values[i].clear(); return -1;}
+			p=q; while(*p==',' || *p==' ') p++;
+		}
 	}
-	return voltage;
+	if(Values[i].empty()) {printf("KSweep: no values for %s\n",name); return -1;}
+	return Values[i].size();
 }
 
-Double_t KDetector::kappa(int i,int j, int k,  int dowhat )
+Int_t KSweep::SetGrid(const char *spec)
 {
-	//Sets the effective space charge values for given point in the mesh!
-	Double_t x,y,z,ret;
+	// Several grids "name=values name=values ...", see Set
+	std::istringstream in(spec);
+	std::string tok;
+	size_t k;
+	while(in>>tok)
+	{
+		k=tok.find('=');
+		if(k==std::string::npos) {printf("KSweep: expected name=values, got %s\n",tok.c_str()); return -1;}
+		if(Set(tok.substr(0,k).c_str(),tok.substr(k+1).c_str())<0) return -1;
+	}
+	return Expand();
+}
 
-	//  if(NeffF!=NULL && NeffH!=NULL) printf("Warning:: Histogram values will be taken for Neff!\n");
+Int_t KSweep::Expand()
+{
+	// Points of the grid; the drift settings vary fastest so that the
+	// points of one field are neighbours
+	Int_t i,k,n=1,idx[6];
+	for(i=0;i<6;i++) n*=Values[i].size();
+	Points.resize(n);
+	for(k=0;k<n;k++)
+	{
+		Int_t r=k;
+		for(i=5;i>=0;i--) {idx[i]=r%Values[i].size(); r/=Values[i].size();}
+		KSweepPoint &P=Points[k];
+		P.Radius=Values[0][idx[0]]; P.Pitch=Values[1][idx[1]]; P.Depth=Values[2][idx[2]];
+		P.Voltage=Values[3][idx[3]]; P.Temperature=Values[4][idx[4]]; P.Diff=(Int_t)Values[5][idx[5]];
+		P.Charge=0; P.Peak=0; P.T90=0; P.Time=0; P.Solved=0;
+	}
+	return n;
+}
 
-	//Position in space
-	x=EG->GetXaxis()->GetBinCenter(i);
-	y=EG->GetYaxis()->GetBinCenter(j);
-	z=EG->GetZaxis()->GetBinCenter(k);
+Long64_t KSweep::GetMemory(KSweepPoint &P)
+{
+	// Estimate of the memory of a solved detector: the solver matrices
+	// (9 doubles per cell), both fields (2x5 floats), geometry and material
+	Double_t c=3.2*P.Pitch;
+	Long64_t cells=(Long64_t)(c/Step[0])*(Long64_t)(c/Step[0])*(Long64_t)(Thickness/Step[1]);
+	return cells*(9*8+10*4+2*4)+(16<<20);
+}
 
-	if(DM!=NULL) KMaterial::Mat=DM->GetBinContent(i,j,k); else KMaterial::Mat=0;
+std::shared_ptr<KSweepCache> KSweep::GetCache(const std::string &key)
+{
+	std::lock_guard<std::mutex> lk(Lock);
+	std::shared_ptr<KSweepCache> &c=Cache[key];
+	if(!c) c=std::make_shared<KSweepCache>();
+	return c;
+}
 
-	if (dowhat==0) 
+K3D *KSweep::Build(KSweepPoint &P)
+{
+	// Detector of point P with its fields, solved or from the cache
+	std::string gkey=Form("r%g p%g d%g",P.Radius,P.Pitch,P.Depth);
+	std::string fkey=gkey+Form(" v%g",P.Voltage);
+	std::shared_ptr<KSweepCache> G=GetCache(gkey),F=GetCache(fkey);
+	Int_t geo=0,fld=0;
+
+	K3D *det=K3D::Cell(P.Pitch,P.Radius,P.Depth,Thickness);
+	det->Voltage=P.Voltage;
+	det->NeffF=new TF3(Form("KSweepNeff%p",(void *)det),"x[0]*x[1]*x[2]*0+[0]",0,3000,0,3000,0,3000);
+	det->NeffF->SetParameter(0,Neff);
+	det->SetDriftHisto(TMax,NBins);
+
+	std::call_once(G->Once,[&]
 	{
-		if(NeffF!=NULL)  // Neff=v enotah [um-3]
-			//            ret=(NeffF->Eval(x,y,z)*1e6*e_0)/(KMaterial::Perm()*perm0); /*printf("i=%d,j=%d,y=%e\n",i,j,y);*/
-			ret=(NeffF->Eval(x,y,z)*1e6*e_0)/(perm0); /*printf("i=%d,j=%d,y=%e\n",i,j,y);*/
-
-		if(NeffH!=NULL)
-			//   ret=(NeffH->GetBinContent(i,j,k)*1e6*e_0)/(KMaterial::Perm()*perm0);
-			ret=(NeffH->GetBinContent(i,j,k)*1e6*e_0)/(perm0);
-
+		det->SetUpCell(Step[0],Step[1]);
+		det->CalField(1);
+		G->EG=new TH3I(); det->EG->Copy(*G->EG);
+		G->DM=new TH3I(); det->DM->Copy(*G->DM);
+		G->U=new TH3F(); det->Ramo->U->Copy(*G->U);
+		geo=1;
+	});
+	if(!geo)
+	{
+		det->GetGrid(G->EG,0); det->GetGrid(G->DM,1);
+		det->Ramo->U=new TH3F(); G->U->Copy(*det->Ramo->U);
+		det->Ramo->CalField();
 	}
 
-	//if (dowhat==0) if(j>nc) y=(Step*Step*1e-12)/(Si_mue*Ro*perm*perm0); else y=-(Step*Step*1e-12)/(Si_mue*Ro*perm*perm0);
-	else 
-		ret=0.;
-	return ret;
+	std::call_once(F->Once,[&]
+	{
+		det->CalField(0);
+		F->U=new TH3F(); det->Real->U->Copy(*F->U);
+		fld=1;
+	});
+	if(!fld)
+	{
+		det->Real->U=new TH3F(); F->U->Copy(*det->Real->U);
+		det->Real->CalField();
+	}
+	P.Solved=geo+fld;
+	NSolved+=geo+fld;
+	return det;
 }
 
-void KDetector::ShowMipIR(Int_t div, Int_t color,Int_t how)
+void KSweep::Measure(K3D *det, KSweepPoint &P)
 {
-	Float_t *x=new Float_t [div];
-	Float_t *y=new Float_t [div];
-	Float_t *z=new Float_t [div];
-	Float_t *Q=new Float_t [div];
-
-	for(Int_t i=0;i<div;i++) 
+	// Induced current of a mip crossing the cell between the readout
+	// column and a bias column
+	Int_t i,n=det->sum->GetNbinsX();
+	Double_t q=0,dt=det->sum->GetXaxis()->GetBinWidth(1);
+	Float_t c=3.2*P.Pitch;
+
+	det->Temperature=P.Temperature;
+	det->diff=P.Diff;
+	det->NThreads=1;
+	det->average=1;
+	det->enp[0]=c/2-0.6*P.Pitch; det->enp[1]=c/2; det->enp[2]=Thickness-40;
+	det->exp[0]=c/2-0.6*P.Pitch; det->exp[1]=c/2; det->exp[2]=40;
+	det->MipIR(Div);
+
+	P.Charge=0; P.Peak=0; P.T90=0;
+	for(i=1;i<=n;i++)
 	{
-		x[i]=((exp[0]-enp[0])/div)*i+enp[0]+(exp[0]-enp[0])/(2*div);
-		y[i]=((exp[1]-enp[1])/div)*i+enp[1]+(exp[1]-enp[1])/(2*div);
-		z[i]=((exp[2]-enp[2])/div)*i+enp[2]+(exp[2]-enp[2])/(2*div);
+		P.Charge+=det->sum->GetBinContent(i)*dt;
+		if(TMath::Abs(det->sum->GetBinContent(i))>TMath::Abs(P.Peak)) P.Peak=det->sum->GetBinContent(i);
+	}
+	for(i=1;i<=n;i++)
+	{
+		q+=det->sum->GetBinContent(i)*dt;
+		if(TMath::Abs(q)>=0.9*TMath::Abs(P.Charge)) {P.T90=det->sum->GetXaxis()->GetBinUpEdge(i); break;}
 	}
-	ShowUserIonization(div, x,y,z,Q,color,how);
 }
 
-void KDetector::ShowUserIonization(Int_t div, Float_t *x, Float_t *y, Float_t *z, Float_t *Q, Int_t color,Int_t how)
+void KSweep::Run()
 {
-	// The simulation of the drift for the minimum ionizing particles. 
-	// A track is devided into Int_ div buckets. Each bucket is drifted in the field. The
-	// induced currents for each carrier is calculated as the sum  all buckets. 
-
-	TGraph *gr;
-	TPolyLine3D *gr3D;
-	Float_t sp[3];
-	int i,j;
-	KStruct seg;
-	TLine *line;
-	TH3F *hh;
+	// Solves and drifts all points of the grid
+	Int_t i;
+	Bool_t adddir=TH1::AddDirectoryStatus();
+	std::map<std::string,std::vector<Int_t> > group;
+	std::vector<std::string> order;
+	auto t0=std::chrono::steady_clock::now();
 
-	// Draw histograms 
+	Expand();
+	for(i=0;i<(Int_t)Points.size();i++)
+	{
+		KSweepPoint &P=Points[i];
+		std::string key=Form("r%g p%g d%g v%g",P.Radius,P.Pitch,P.Depth,P.Voltage);
+		if(group.find(key)==group.end()) order.push_back(key);
+		group[key].push_back(i);
+	}
 
-	if(EG!=NULL) 
-	{ 
-		if(nz==1) KHisProject(EG,3,how)->Draw("COL");
-		else
+	// the histograms of the workers must not go to the current directory
+	ROOT::EnableThreadSafety();
+	TH1::AddDirectory(kFALSE);
+	NSolved=0;
+	KThreadPool pool(NThreads);
+	for(size_t g=0;g<order.size();g++)
+	{
+		std::vector<Int_t> *pts=&group[order[g]];
+		pool.Submit([this,pts](Int_t)
 		{
-			//TH3F *hh=GetGeom();
-			hh=GetGeom();
-			hh->SetFillColor(color);
-			hh->Draw("iso");
-		}
-	} 
+			Long64_t mem=GetMemory(Points[(*pts)[0]]);
+			{
+				std::unique_lock<std::mutex> lk(Lock);
+				MemFree.wait(lk,[&]{return MemUsed==0 || MemUsed+mem<=MemLimit;});
+				MemUsed+=mem;
+			}
+			auto t1=std::chrono::steady_clock::now();
+			K3D *det=Build(Points[(*pts)[0]]);
+			for(size_t k=0;k<pts->size();k++)
+			{
+				KSweepPoint &P=Points[(*pts)[k]];
+				Measure(det,P);
+				auto t2=std::chrono::steady_clock::now();
+				P.Time=std::chrono::duration<Double_t>(t2-t1).count();
+				t1=t2;
+			}
+			delete det;
+			{
+				std::lock_guard<std::mutex> lk(Lock);
+				MemUsed-=mem;
+			}
+			MemFree.notify_all();
+		});
+	}
+	pool.Wait();
+	TH1::AddDirectory(adddir);
+	printf("KSweep: %d points, %d groups, %d field solutions in %.1f s\n",(Int_t)Points.size(),(Int_t)order.size(),
+	       NSolved.load(),std::chrono::duration<Double_t>(std::chrono::steady_clock::now()-t0).count());
+}
 
-	// Draw drift paths
+void KSweep::Print()
+{
+	for(size_t i=0;i<Points.size();i++)
+	{
+		KSweepPoint &P=Points[i];
+		printf("%6.2f %6.2f %6.1f %7.1f %6.1f %d  %10.1f %11.4e %11.4e %7.2f %d\n",P.Radius,P.Pitch,P.Depth,P.Voltage,
+		       P.Temperature,P.Diff,P.Charge,P.Peak,P.T90,P.Time,P.Solved);
+	}
+}
 
-	for(i=0;i<div;i++) 
+void KSweep::Write(const char *name)
+{
+	// One line per point: the parameters and the results
+	FILE *f=fopen(name,"w");
+	if(f==NULL) {printf("KSweep: can not write %s\n",name); return;}
+	fprintf(f,"# radius pitch depth voltage temperature diff charge peak t90 time solved\n");
+	for(size_t i=0;i<Points.size();i++)
 	{
+		KSweepPoint &P=Points[i];
+		fprintf(f,"%g %g %g %g %g %d %.6g %.6g %.6g %.3f %d\n",P.Radius,P.Pitch,P.Depth,P.Voltage,
+		        P.Temperature,P.Diff,P.Charge,P.Peak,P.T90,P.Time,P.Solved);
+	}
+	fclose(f);
+	printf("KSweep: %d points written to %s\n",(Int_t)Points.size(),name);
+}
 
-		// hole drift
-		if(Debug)   printf("Entry Point: %f %f %f \n",x[i],y[i],z[i]);
-		Drift(x[i],y[i],z[i],1,&seg);
 
-		if(nz==1)
-			gr=new TGraph(seg.Steps,&seg.Xtrack[1],&seg.Ytrack[1]); 
-		else
-			gr3D=new TPolyLine3D(seg.Steps,&seg.Xtrack[1],&seg.Ytrack[1],&seg.Ztrack[1]); 	
+// KConfig
 
-		if(nz==1)
-		{
-			gr->SetLineColor(2);
-			gr->SetLineStyle(1);
-			gr->Draw("L");
-		}
-		else
-		{
-			gr3D->SetLineStyle(1);  
-			gr3D->SetLineColor(2); 
-			gr3D->Draw("SAME"); 
-		}
+class KConfig
+{
+	private:
+		std::map<std::string,std::string> Par;
 
-		// electron drift
+	public:
+		static const char *Keys[][2];
+
+		KConfig(){};
+		~KConfig(){};
+		Int_t Read(const char *);
+		Int_t Set(const char *);
+		Int_t Set(const char *, const char *);
+		Bool_t Has(const char *k) {return Par.find(k)!=Par.end();};
+		Double_t Get(const char *, Double_t);
+		const char *Get(const char *, const char *);
+		Int_t Get(const char *, Float_t *, Int_t);
+		KDetector *Detector();
+		void Apply(KDetector *);
+		void Apply(KSweep *);
+		void Print();
+};
 
-		Drift(x[i],y[i],z[i],-1,&seg);
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KConfig                                                              //
+//                                                                      //
+// Settings of a raser job: "key = value" lines of a config file (#    //
+// starts a comment) and key=value arguments, the later ones winning.   //
+// Detector() builds the 3D cell (K3D::Cell, or with rz=1 its r-z      //
+// version KCyl::Cell) with the fields not yet solved, Apply() passes   //
+// the drift settings to a detector or the grid and mesh to a KSweep    //
+// (there a value may be a list or a range). The known keys and their   //
+// meaning are in Keys.                                                 //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
-		if(nz==1)
-			gr=new TGraph(seg.Steps,&seg.Xtrack[1],&seg.Ytrack[1]); 
-		else
-		{
-			gr3D=new TPolyLine3D(seg.Steps,&seg.Xtrack[1],&seg.Ytrack[1],&seg.Ztrack[1]); 	
-		}
+const char *KConfig::Keys[][2]={
+	{"pitch","distance of the bias columns from the readout column [um] (25)"},
+	{"radius","column radius [um] (4)"},
+	{"depth","column depth [um] (280)"},
+	{"thickness","detector thickness [um] (300)"},
+	{"step_xy","mesh step in x and y [um] (1), in r with rz=1"},
+	{"step_z","mesh step in z [um] (4)"},
+	{"rz","axisymmetric r-z cell, the bias columns a ring at pitch (1) or the 3D cell (0)"},
+	{"neff","effective doping concentration (2)"},
+	{"voltage","bias voltage [V] (50)"},
+	{"temperature","temperature [K] (300)"},
+	{"time","time range of the induced current [s] (1.2e-9)"},
+	{"bins","bins of the induced current (36)"},
+	{"diff","diffusion (1) or not (0)"},
+	{"sstep","drift step [um]"},
+	{"integrator","0 fixed step, 1 adaptive Runge-Kutta"},
+	{"rktol","position error per adaptive step [um]"},
+	{"threads","threads (0 = all cores)"},
+	{"seed","seed of the random streams"},
+	{"veltab","tabulated drift velocities (1) or not (0)"},
+	{"fastsim","drift from the response tables (1) or not (0), ignored with diff or mtresh"},
+	{"mtresh","impact ionization threshold (-1 = off)"},
+	{"bdtresh","breakdown at this created / primary charge (1000)"},
+	{"taue","electron trapping time [s]"},
+	{"tauh","hole trapping time [s]"},
+	{"mipmpv","mip ionization [e/um]"},
+	{"mipsigma","width of the mip ionization [e/um]"},
+	{"cluster","merging distance of deposits [um] (0 = off)"},
+	{"enp","entry point of the track \"x y z\" [um]"},
+	{"exp","exit point of the track \"x y z\" [um]"},
+	{"events","events of the Monte Carlo (0 = one track, enp to exp)"},
+	{"div","buckets of a track (150)"},
+	{"input","file of energy deposits (KDepositReader)"},
+	{"qscale","e-h pairs per unit of deposited charge (1)"},
+	{"checkpoint","base name of the checkpoint files"},
+	{"interval","seconds between checkpoints (600)"},
+	{"memory","memory of the running sweep points [MB]"},
+	{"repeat","bench: samples of every benchmark (5)"},
+	{"mintime","bench: shortest sample [s] (0.1)"},
+	{"only","bench, regress: run only benchmarks or cases containing one of these words, e.g. linbcg,drift"},
+	{"meshes","bench: reference meshes step_xy:step_z,... (2:8,1:4)"},
+	{"golden","regress: directory of the golden outputs (golden)"},
+	{"tolerance","regress: scale of the tolerances of all quantities (1)"},
+	{"profile","print the timers and counters of the hot paths (1) or not (0)"},
+	{"trace","Chrome trace-event file of the profiled scopes"},
+	{"showtol","largest deviation of the drawn drift paths [pixels] (0.5)"},
+	{"showbins","largest number of bins per axis of the drawn geometry (100)"},
+	{NULL,NULL}};
+
+Int_t KConfig::Set(const char *key, const char *val)
+{
+	for(Int_t i=0;Keys[i][0]!=NULL;i++)
+		if(!strcmp(key,Keys[i][0])) {Par[key]=val; return 0;}
+	printf("KConfig: unknown key %s\n",key);
+	return -1;
+}
 
-		if(nz==1)
-		{
-			gr->SetLineColor(4);
-			gr->SetLineStyle(3); 
-			gr->Draw("L");
-		}
-		else
-		{
-			gr3D->SetLineStyle(1);  
-			gr3D->SetLineColor(4); 
-			gr3D->Draw("SAME"); 
-		}
+Int_t KConfig::Set(const char *kv)
+{
+	// "key=value"
+	std::string s(kv);
+	size_t k=s.find('=');
+	if(k==std::string::npos) {printf("KConfig: expected key=value, got %s\n",kv); return -1;}
+	return Set(s.substr(0,k).c_str(),s.substr(k+1).c_str());
+}
 
+Int_t KConfig::Read(const char *name)
+{
+	std::ifstream in(name);
+	std::string line,key;
+	Int_t n=0,err=0;
+	if(!in.is_open()) {printf("KConfig: can not open %s\n",name); return -1;}
+	while(std::getline(in,line))
+	{
+		n++;
+		size_t c=line.find('#');
+		if(c!=std::string::npos) line.erase(c);
+		size_t k=line.find('=');
+		size_t a=line.find_first_not_of(" \t\r");
+		if(a==std::string::npos) continue;
+		if(k==std::string::npos) {printf("KConfig: %s:%d: expected key = value\n",name,n); err=-1; continue;}
+		key=line.substr(a,k-a);
+		key.erase(key.find_last_not_of(" \t")+1);
+		std::string val=line.substr(k+1);
+		val.erase(0,val.find_first_not_of(" \t"));
+		val.erase(val.find_last_not_of(" \t\r")+1);
+		if(Set(key.c_str(),val.c_str())<0) err=-1;
 	}
+	return err;
 }
 
-void KDetector::Drift(Double_t sx, Double_t sy, Double_t sz, Float_t charg, KStruct *seg, Double_t t0)
+Double_t KConfig::Get(const char *key, Double_t def)
 {
-	//Drift simulation for a point charge (Float_t charg;)
-	//starting from ( sx,sy, sz)
-	//KStruct *seg is the structure where the  the drift paths, drift times and induced cahrges are stored
-
-	Double_t Stime=0;                       // Step time
-	Double_t difx=0,dify=0,difz=0;          // diffusion steps in all directions
-	Double_t sigma;                         // sigma of the diffusion step  
-	Float_t *xcv,*ycv,*zcv,*time,*charge;   // drift variables to be stored in KStruct
-	Double_t cx=0,cy=0,cz=0;                // current position of the charge bucket
-	Double_t vel=0;                         // drift velocity
-	Double_t vth2=0;                        // thermal velocity sqared
-	Double_t tfc;                           // trapped charge fraction   
-	Double_t t=0;                           // drift time
-	Double_t sumc=0;                        // total induced charge
-	Double_t ncx=0,ncy=0,ncz=0;             // next position of the charge bucket   
-	Double_t deltacx,deltacy,deltacz;       // drift step due to drift
-
-	Int_t st=0;                             // current step
-	Int_t ishit=0;                          // local counter of the step
-	TVector3 *EE;                           // Set up electric field vector
-	TVector3 *EEN;                          // Set up electric field vector
-	TVector3 FF;                            // Combined drift field
-	Float_t pathlen=0;                      // pathlength
-	Float_t WPot;                           // current ramo potential
-
-	// Inclusion of Magnetic field 28.8.2001 - revised 15.10.2012
-	TVector3 BB(B);                           // Create a magnetic field vector
-	Float_t muhe=1650;                        // parametrization of the magnetic field 
-	Float_t muhh=310;	                  // is based on simply this mobility parameters
-
-	// Start time in the  absolute domain (used for delayed charge generation in multiplication 
-
-	t=t0;
+	return Has(key)?atof(Par[key].c_str()):def;
+}
 
-	// Intitialize KStruct class and its members 
+const char *KConfig::Get(const char *key, const char *def)
+{
+	return Has(key)?Par[key].c_str():def;
+}
 
-	xcv=seg->Xtrack; 
-	ycv=seg->Ytrack;  
-	zcv=seg->Ztrack; 
-	time=seg->Time; 
-	charge=seg->Charge; 
-	seg->Clear();
-	seg->PCharge=(Int_t) charg;
+Int_t KConfig::Get(const char *key, Float_t *v, Int_t n)
+{
+	// up to n numbers of key, returns how many were given
+	Int_t i=0;
+	if(!Has(key)) return 0;
+	std::istringstream in(Par[key]);
+	while(i<n && in>>v[i]) i++;
+	return i;
+}
 
-	// start drift
+KDetector *KConfig::Detector()
+{
+	Float_t p=Get("pitch",25.),t=Get("thickness",300.),c=3.2*p;
+	KDetector *det;
+	if(Get("rz",0.)!=0)
+	{
+		KCyl *cyl=KCyl::Cell(p,Get("radius",4.),Get("depth",280.),t);
+		cyl->SetUpCell(Get("step_xy",1.),Get("step_z",4.));
+		det=cyl;
+	}
+	else
+	{
+		K3D *k3d=K3D::Cell(p,Get("radius",4.),Get("depth",280.),t);
+		k3d->SetUpCell(Get("step_xy",1.),Get("step_z",4.));
+		det=k3d;
+	}
+	det->NeffF=new TF3("neff","x[0]*x[1]*x[2]*0+[0]",0,3000,0,3000,0,3000);
+	det->NeffF->SetParameter(0,Get("neff",2.));
+	det->Voltage=Get("voltage",50.);
+	det->Temperature=Get("temperature",300.);
+	det->SetDriftHisto(Get("time",1.2e-9),(Int_t)Get("bins",36.));
+	det->diff=1;
+	// the track of the raser example, between the readout and a bias column
+	// (r-z: the readout column on the axis x=y=0)
+	if(det->RZ) c=0;
+	det->enp[0]=c/2-0.6*p; det->enp[1]=c/2; det->enp[2]=t-40;
+	det->exp[0]=c/2-0.6*p; det->exp[1]=c/2; det->exp[2]=40;
+	Apply(det);
+	return det;
+}
 
-	cx=sx; cy=sy; cz=sz;                   // set current coordinates
-	xcv[st]=cx; ycv[st]=cy; zcv[st]=cz;    // put the first point in the KStruct 
-	time[st]=t;  charge[st]=0; 
+void KConfig::Apply(KDetector *det)
+{
+	if(Has("voltage")) det->Voltage=Get("voltage",0.);
+	if(Has("temperature")) det->Temperature=Get("temperature",0.);
+	if(Has("diff")) det->diff=(Int_t)Get("diff",0.);
+	if(Has("sstep")) det->SStep=Get("sstep",0.);
+	if(Has("integrator")) det->Integrator=(Int_t)Get("integrator",0.);
+	if(Has("rktol")) det->RKTol=Get("rktol",0.);
+	if(Has("threads")) det->NThreads=(Int_t)Get("threads",0.);
+	if(Has("seed")) det->Seed=(UInt_t)Get("seed",0.);
+	if(Has("veltab")) det->VelTab=(Int_t)Get("veltab",0.);
+	if(Has("fastsim")) det->FastSim=(Int_t)Get("fastsim",0.);
+	if(Has("mtresh")) det->MTresh=Get("mtresh",0.);
+	if(Has("bdtresh")) det->BDTresh=Get("bdtresh",0.);
+	if(Has("taue")) det->taue=Get("taue",0.);
+	if(Has("tauh")) det->tauh=Get("tauh",0.);
+	if(Has("mipmpv")) det->MipMPV=Get("mipmpv",0.);
+	if(Has("mipsigma")) det->MipSigma=Get("mipsigma",0.);
+	if(Has("cluster")) det->ClusterTol=Get("cluster",0.);
+	if(Has("checkpoint")) det->CheckPoint=Get("checkpoint","");
+	if(Has("interval")) det->CheckInterval=Get("interval",0.);
+	Get("enp",det->enp,3);
+	Get("exp",det->exp,3);
+#ifndef RASER_BATCH
+	if(Has("showtol")) det->ShowTol=Get("showtol",0.);
+	if(Has("showbins")) det->ShowBins=(Int_t)Get("showbins",0.);
+#endif
+}
 
-	EE=Real->CalFieldXYZ(cx,cy,cz);         // Get the electric field vector 
-	EEN=Real->CalFieldXYZ(cx,cy,cz);       // Get the electric field vector for next step - here the default is the same 12.9.2018
-	seg->Efield[st]=EE->Mag();             // Store the magnitude of E field
+void KConfig::Apply(KSweep *sw)
+{
+	for(Int_t i=0;i<6;i++)
+		if(Has(KSweep::Names[i])) sw->Set(KSweep::Names[i],Par[KSweep::Names[i]].c_str());
+	if(Has("thickness")) sw->Thickness=Get("thickness",0.);
+	if(Has("step_xy")) sw->Step[0]=Get("step_xy",0.);
+	if(Has("step_z")) sw->Step[1]=Get("step_z",0.);
+	if(Has("neff")) sw->Neff=Get("neff",0.);
+	if(Has("time")) sw->TMax=Get("time",0.);
+	if(Has("bins")) sw->NBins=(Int_t)Get("bins",0.);
+	if(Has("div")) sw->Div=(Int_t)Get("div",0.);
+	if(Has("threads")) sw->NThreads=(Int_t)Get("threads",0.);
+	if(Has("memory")) sw->MemLimit=(Long64_t)(Get("memory",0.)*1048576);
+}
 
+void KConfig::Print()
+{
+	for(std::map<std::string,std::string>::iterator i=Par.begin();i!=Par.end();i++)
+		printf("%-12s = %s\n",i->first.c_str(),i->second.c_str());
+}
 
 
+// KIVLog
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits>
 
+class KIVLog
+{
+	public:
+		TString File;
+		Int_t NPoints;             // measured points
+		Double_t I100,I150;        // |I| at 100 V and 150 V [A]
+		Bool_t Has100,Has150;      // the 100 V and 150 V points were measured
+		Int_t Status;              // 0 pass, 1 fail, -1 no data (or no 100 V/150 V point)
+		TString Err;               // failed criteria
+		std::vector<Float_t> V,I;  // |V| [V] and |I| [A] of the points, only if kept
+
+		KIVLog() {NPoints=0; I100=0; I150=0; Has100=kFALSE; Has150=kFALSE; Status=-1;};
+		Int_t Read(const char *, Bool_t = kFALSE);
+		Int_t Check(Double_t, Double_t);
+		static const char *Number(const char *, const char *, Double_t &);
+};
 
-	//printf("%d %f : (%f %f %f)\n",st,charg,cx,cy,cz);
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KIVLog                                                               //
+//                                                                      //
+// One IV log of a sensor: lines of "voltage current" (more columns are //
+// ignored, # starts a comment line, the first other line that does    //
+// not start with two numbers ends the data). Files with _uA_ in the    //
+// name are in uA. The file is mapped into memory and the numbers are  //
+// parsed in place, the points themselves are kept only on request     //
+// (plots). Check() applies the QA criteria: I(150V) below a limit and //
+// I(150V)/I(100V) below a ratio. A log without the 100 V or the 150 V  //
+// point has no data for them.                                          //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
-	do 
+const char *KIVLog::Number(const char *p, const char *e, Double_t &v)
+{
+	// Parses a number starting at p (after blanks), returns the first
+	// character after it or NULL if there is none
+	static const Double_t p10[23]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+	                               1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+	ULong64_t m=0;
+	Int_t ex=0,nd=0,neg=0;
+
+	while(p<e && (*p==' ' || *p=='\t')) p++;
+	if(p<e && (*p=='-' || *p=='+')) neg=*p++=='-';
+	for(;p<e && *p>='0' && *p<='9';p++,nd++)
+		if(m<100000000000000000ULL) m=m*10+(*p-'0'); else ex++;
+	if(p<e && *p=='.')
+		for(p++;p<e && *p>='0' && *p<='9';p++,nd++)
+			if(m<100000000000000000ULL) {m=m*10+(*p-'0'); ex--;}
+	if(nd==0) return NULL;
+	if(p<e && (*p=='e' || *p=='E'))
 	{
-		//    printf("Calculate field\n");
-		st++;
-		if(charg>0)
-			FF=(*EE)+muhh*EE->Cross(BB); else 
-				FF=(*EE)-muhe*EE->Cross(BB); 
-		// "-muhe" stands for the fact that at the same 
-		// field the drift direction has changed due to different charge
-
-		//printf("Field : %f %f %f (%f %f %f)  ---- ",FF[0],FF[1],FF[2],(*EE)[0],(*EE)[1],(*EE)[2]);
-		if(FF.Mag()!=0)
+		const char *q=p+1;
+		Int_t es=1,x=0;
+		if(q<e && (*q=='-' || *q=='+')) es=*q++=='-'?-1:1;
+		if(q<e && *q>='0' && *q<='9')
 		{
-			deltacy=-SStep*charg*FF.y()/FF.Mag();   // deltay 
-			deltacx=-SStep*charg*FF.x()/FF.Mag();   // deltax
-			deltacz=-SStep*charg*FF.z()/FF.Mag();   // deltaz
+			for(;q<e && *q>='0' && *q<='9';q++) if(x<10000) x=x*10+(*q-'0');
+			ex+=es*x; p=q;
 		}
-		else { deltacx=0; deltacy=0; deltacz=0; }
-
-		//    printf("Calculate velocity \n");
-
-		if(DM!=NULL)
-			KMaterial::Mat=DM->GetBinContent(DM->FindBin(cx,cy,cz)); 
-		else KMaterial::Mat=0;
-
-		//      EEN=Real->CalFieldXYZ(cx+deltacx,cy+deltacy,cz+deltacz); // get field & velocity at new location //12.9.2018
-		Real->CalFieldXYZ(cx+deltacx,cy+deltacy,cz+deltacz,EEN); // get field & velocity at new location
-		vel=Real->DriftVelocity( (EEN->Mag()+EE->Mag())/2,charg,Temperature,TMath::Abs(NeffF->Eval(cx,cy,cz)),MobMod());
-
-		//printf("Calculate vel: %e EEN = %e ::: ",vel, EEN->Mag());
-		if(vel==0) {
-			deltacx=0; deltacy=0; deltacz=0; 
-			difx=0; dify=0; difz=0;
-			ishit=9;
-		} 
-		else 
-			if(diff && !(DiffOffField<EEN->Mag() && MTresh>1))  
-				// is diffusion ON - if yes then include it
-				// if multiplication is ON the diffusion must be switched 
-				// off when the field gets large enough
-			{
-				Stime=SStep*1e-4/vel; // calcualte step time  
-				sigma=TMath::Sqrt(2*Kboltz*Real->Mobility(EE->Mag(),Temperature,charg,TMath::Abs(NeffF->Eval(cx,cy,cz)),MobMod())*Temperature*Stime); 
-				dify=ran->Gaus(0,sigma)*1e4; 
-				difx=ran->Gaus(0,sigma)*1e4;
-				if(nz!=1) difz=ran->Gaus(0,sigma)*1e4; else difz=0;
-			} else {difx=0; dify=0; difz=0;}
+	}
+	if(p<e && *p!=' ' && *p!='\t' && *p!='\r' && *p!='\n' && *p!=',' && *p!=';') return NULL;
+
+	// exact up to 15 digits and |ex|<=22
+	if(ex==0) v=(Double_t)m;
+	else if(ex>0 && ex<=22) v=(Double_t)m*p10[ex];
+	else if(ex<0 && ex>=-22) v=(Double_t)m/p10[-ex];
+	else v=(Double_t)m*pow(10.,ex);
+	if(neg) v=-v;
+	return p;
+}
 
-		if((cx+deltacx+difx)>=GetUpEdge(0)) ncx=GetUpEdge(0); else
-			if((cx+deltacx+difx)<GetLowEdge(0)) ncx=GetLowEdge(0); else
-				ncx=cx+(deltacx+difx);;
+Int_t KIVLog::Read(const char *name, Bool_t keep)
+{
+	// Reads the log, returns the number of points (-1 if it can not be read)
+	struct stat st;
+	Double_t x,y,factor=1;
+	const char *p,*e,*q;
+	void *m;
+	Int_t fd;
+
+	File=name; NPoints=0; I100=0; I150=0; Has100=kFALSE; Has150=kFALSE; Status=-1; Err="";
+	V.clear(); I.clear();
+	if(File.Contains("_uA_")) factor=1e-6;
+
+	fd=open(name,O_RDONLY);
+	if(fd<0) {Err="can not open"; return -1;}
+	if(fstat(fd,&st)<0 || st.st_size==0) {close(fd); Err="no data"; return 0;}
+	m=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(m==MAP_FAILED) {Err="can not map"; return -1;}
+	madvise(m,st.st_size,MADV_SEQUENTIAL);
+
+	p=(const char *)m; e=p+st.st_size;
+	while(p<e)
+	{
+		const char *l=(const char *)memchr(p,'\n',e-p);
+		if(l==NULL) l=e;
+		if(*p!='#')
+		{
+			if((q=Number(p,l,x))==NULL || Number(q,l,y)==NULL) break;
+			x=fabs(x); y=fabs(y)*factor;
+			if(keep) {V.push_back(x); I.push_back(y);}
+			// pick up values like: -100.043
+			if(fabs(x-150)<1) {I150=y; Has150=kTRUE;}
+			if(fabs(x-100)<1) {I100=y; Has100=kTRUE;}
+			NPoints++;
+		}
+		p=l+1;
+	}
+	munmap(m,st.st_size);
+	if(NPoints==0) Err="no data";
+	return NPoints;
+}
 
-		if((cy+deltacy+dify)>=GetUpEdge(1)) ncy=GetUpEdge(1); else
-			if((cy+deltacy+dify)<GetLowEdge(1)) ncy=GetLowEdge(1); else
-				ncy=cy+(deltacy+dify);
+Int_t KIVLog::Check(Double_t imax, Double_t rmax)
+{
+	// QA criteria: I(150V) < imax and I(150V)/I(100V) < rmax, returns Status
+	if(NPoints==0) return Status=-1;
+	Status=0; Err="";
+	if(!Has100 || !Has150)
+	{
+		Err=!Has150?(!Has100?"no I(100V), no I(150V)":"no I(150V)"):"no I(100V)";
+		return Status=-1;
+	}
+	if(!(I150<imax)) {Status=1; Err=Form("I(150V) >= %guA (%.1e) ",imax*1e6,I150);}
+	if(!(I150<rmax*I100)) {Status=1; Err+=I100>0?Form("I(150V)/I(100V) >= %g (%.1f)",rmax,I150/I100):"I(100V)=0";}
+	return Status;
+}
 
-		if((cz+deltacz+difz)>=GetUpEdge(2)) ncz=GetUpEdge(2); else
-			if((cz+deltacz+difz)<GetLowEdge(2)) ncz=GetLowEdge(2); else
-				ncz=cz+(deltacz+difz);
 
-		if(Debug) printf("%d %f E=%e (%e %e %e): x:%f->%f y:%f->%f z:%f->%f (%f %f %f)(%f %f %f) : Mat=%d :: ",st,charg,EEN->Mag(),EEN->x(),EEN->y(),EEN->z(),cx,ncx,cy,ncy,cz,ncz,deltacx,deltacy,deltacz,dify,dify,difz,KMaterial::Mat);
+// KIVQA
 
-		charge[st]=charg*(Ramo->CalPotXYZ(ncx,ncy,ncz)-Ramo->CalPotXYZ(cx,cy,cz));
-		cx=ncx; cy=ncy; cz=ncz;
+class KIVQA
+{
+	public:
+		std::vector<KIVLog> Logs;
+		Double_t IMax;        // limit of I(150V) [A]
+		Double_t RMax;        // limit of I(150V)/I(100V)
+		Int_t NThreads;       // files read at the same time (0 = all cores)
+		Bool_t Keep;          // keep the points of every log (plots)
+		Int_t NPass,NFail,NBad;
+
+		KIVQA() {IMax=2e-6; RMax=2; NThreads=0; Keep=kFALSE; NPass=0; NFail=0; NBad=0;};
+		void Add(const char *name) {Logs.push_back(KIVLog()); Logs.back().File=name;};
+		void Run();
+		void Print();
+		void Write(const char *);
+};
 
-		//////////////////// calculate strict trapping, e.g. depending on position ///////////////////////
-		if(TauE!=NULL && TauH!=NULL)
-		{
-			if(charg<0) {
-				// vth2=3*Kboltz*Temperature*Clight*Clight/(511e3*EmeC(KMaterial::Mat))*1e4*0;
-				tfc=1e4*(TauE->Eval((ncx+cx)/2,(ncy+cy)/2,(ncz+cz)/2)*TMath::Sqrt(vel*vel+vth2));	              
-			}
-			else
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KIVQA                                                                //
+//                                                                      //
+// Quality assurance of a batch of sensors from their IV logs. Run()   //
+// reads and checks the logs in parallel (see KIVLog), Print() gives   //
+// the totals and the sensors that fail, Write() one line per sensor. //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
+
+void KIVQA::Run()
+{
+	auto t0=std::chrono::steady_clock::now();
+	{
+		KThreadPool pool(TMath::Min(NThreads>0?NThreads:KThreadPool::Cores(),(Int_t)Logs.size()));
+		for(size_t i=0;i<Logs.size();i++)
+			pool.Submit([this,i](Int_t)
 			{
-				//   vth2=3*Kboltz*Temperature*Clight*Clight/(511e3*EmhC(KMaterial::Mat))*1e4*0;
-				tfc=1e4*(TauH->Eval((ncx+cx)/2,(ncy+cy)/2,(ncz+cz)/2)*TMath::Sqrt(vel*vel+vth2));
-			}	    
-			if(ran->Rndm()>TMath::Exp(-SStep/tfc)) ishit=12;
-		}
-		/////////////////////////////////////////////////////////////////////////////////////////////////////
+				KIVLog &L=Logs[i];
+				L.Read(L.File,Keep);
+				L.Check(IMax,RMax);
+			});
+		pool.Wait();
+	}
+	NPass=0; NFail=0; NBad=0;
+	for(size_t i=0;i<Logs.size();i++)
+	{
+		if(Logs[i].Status==0) NPass++;
+		else if(Logs[i].Status==1) NFail++;
+		else NBad++;
+	}
+	printf("KIVQA: %d files, %d pass, %d fail, %d without data or 100 V/150 V point in %.2f s\n",(Int_t)Logs.size(),NPass,NFail,NBad,
+	       std::chrono::duration<Double_t>(std::chrono::steady_clock::now()-t0).count());
+}
 
-		sumc+=charge[st];
+void KIVQA::Print()
+{
+	for(size_t i=0;i<Logs.size();i++)
+	{
+		KIVLog &L=Logs[i];
+		if(L.Status!=0) printf("%-40s %s %s\n",L.File.Data(),L.Status>0?"FAIL":"NODATA",L.Err.Data());
+	}
+}
 
+void KIVQA::Write(const char *name)
+{
+	// One line per sensor: points, I(100V), I(150V), their ratio and the
+	// result, nan for a point that was not measured
+	FILE *f=fopen(name,"w");
+	if(f==NULL) {printf("KIVQA: can not write %s\n",name); return;}
+	fprintf(f,"# file points i100 i150 ratio status\n");
+	for(size_t i=0;i<Logs.size();i++)
+	{
+		KIVLog &L=Logs[i];
+		Double_t nan=std::numeric_limits<Double_t>::quiet_NaN();
+		fprintf(f,"%s %d %.4g %.4g %.4g %s\n",L.File.Data(),L.NPoints,L.Has100?L.I100:nan,L.Has150?L.I150:nan,
+		        L.Has100 && L.Has150 && L.I100>0?L.I150/L.I100:nan,
+		        L.Status==0?"PASS":L.Status>0?"FAIL":"NODATA");
+	}
+	fclose(f);
+	printf("KIVQA: %d files written to %s\n",(Int_t)Logs.size(),name);
+}
 
-		if(vel!=0) 
-		{
-			t=t+SStep*1e-4/vel; //else t+=Stime;
-			pathlen+=SStep;
-		}
 
-		xcv[st]=cx;
-		ycv[st]=cy;
-		zcv[st]=cz;
-		time[st]=t;
+// KBench
 
-		//    EE=Real->CalFieldXYZ(cx,cy,cz);     //12.9.2018
-		Real->CalFieldXYZ(cx,cy,cz,EE);     //12.9.2018
-		seg->Efield[st]=EE->Mag();
+#include <algorithm>
+#include "TRandom3.h"
 
-		// Checking for termination of the drift //// 
+class KBenchResult
+{
+	public:
+		std::string Name;     // benchmark/mesh
+		std::string Unit;     // unit of the throughput
+		Double_t Items;       // work of one call in Unit (cells, points, steps ...)
+		Long64_t Loops;       // calls per sample
+		Double_t Best;        // fastest sample [s per call]
+		Double_t Median;      // median sample [s per call]
+		Double_t Extra;       // benchmark specific number (solver iterations, drift steps)
+};
 
-		WPot=Ramo->CalPotXYZ(cx,cy,cz);
-		if(WPot>(1-Deps)) ishit=1;
-		// if(TMath::Abs(WPot)<Deps) ishit=2;
-		if(cx<= GetLowEdge(0)) ishit=3;
-		if(cx>=  GetUpEdge(0)) ishit=4;
-		if(cy<= GetLowEdge(1)) ishit=5;
-		if(cy>= GetUpEdge(1))  ishit=6;
-		if(cz<= GetLowEdge(2)) ishit=7;
-		if(cz>= GetUpEdge(2))  ishit=8;
-		if(pathlen>MaxDriftLen) ishit=11;
-		if(st>=MAXPOINT-1) ishit=20;   
+class KBench
+{
+	private:
+		KConfig Cfg;
+		static volatile Double_t Sink;   // results of the timed loops are stored here, so they are not optimized away
+		void Measure(const char *, const char *, Double_t, std::function<void()>, Double_t = 0);
+		Bool_t Selected(const char *);
 
-		if(Debug) printf("(t=%e, vel=%e, velth=%e) [Ch=%f ChInt=%f TFC=%f] Ishit=%d \n",t,vel,TMath::Sqrt(vth2),charge[st],sumc,tfc,ishit);
+	public:
+		std::vector<KBenchResult> Results;
+		std::vector<std::pair<Float_t,Float_t> > Meshes;  // reference meshes (step_xy, step_z) of the solver benchmarks
+		Int_t Repeat;         // samples of every benchmark
+		Double_t MinTime;     // shortest sample [s], fast calls are repeated up to it
+		TString Only;         // run only the benchmarks whose name contains one of these words ("" = all)
+
+		KBench(KConfig &);
+		~KBench(){};
+		Int_t SetMeshes(const char *);
+		void Run();
+		void Print();
+		void Write(const char *);
+};
 
-	} while (!ishit); // Do until the end of drift
+//////////////////////////////////////////////////////////////////////////
+//                                                                      //
+// KBench                                                               //
+//                                                                      //
+// Benchmarks of the hot paths of raser on the cell of KConfig:         //
+// atimes, linbcg (the field solution from x=1), Declaration and        //
+// KField::CalField on every reference mesh, CalFieldXYZ/CalPotXYZ at   //
+// fixed random points, Mobility, single hole and electron drifts and   //
+// a full mip event (MipIR). Every benchmark is sampled Repeat times    //
+// after a warm up call; the best and median time per call and the      //
+// throughput are written as JSON, so runs of different commits and    //
+// machines can be compared.                                            //
+//                                                                      //
+//////////////////////////////////////////////////////////////////////////
 
+volatile Double_t KBench::Sink=0;
 
-	(*seg).Xlenght=pathlen; (*seg).Ylenght=pathlen; 
-	(*seg).TTime=t; (*seg).TCharge=sumc; (*seg).Steps=st;
-	delete EE; delete EEN;
+KBench::KBench(KConfig &cfg) : Cfg(cfg)
+{
+	Repeat=(Int_t)cfg.Get("repeat",5.);
+	MinTime=cfg.Get("mintime",0.1);
+	Only=cfg.Get("only","");
+	SetMeshes(cfg.Get("meshes","2:8,1:4"));
+}
 
-	return;
+Int_t KBench::SetMeshes(const char *list)
+{
+	// "xy:z,xy:z,..."
+	Float_t a,b;
+	std::stringstream in(list);
+	std::string m;
+	Meshes.clear();
+	while(std::getline(in,m,','))
+	{
+		if(sscanf(m.c_str(),"%f:%f",&a,&b)!=2 || a<=0 || b<=0) {printf("KBench: bad mesh %s\n",m.c_str()); return -1;}
+		Meshes.push_back(std::make_pair(a,b));
+	}
+	return 0;
 }
 
+Bool_t KBench::Selected(const char *name)
+{
+	// name contains one of the comma separated words of Only
+	std::stringstream in(Only.Data());
+	std::string w;
+	if(Only=="") return kTRUE;
+	while(std::getline(in,w,','))
+		if(w!="" && strstr(name,w.c_str())!=NULL) return kTRUE;
+	return kFALSE;
+}
 
+void KBench::Measure(const char *name, const char *unit, Double_t items, std::function<void()> f, Double_t extra)
+{
+	// Samples f Repeat times, every sample calls f until MinTime is reached
+	std::vector<Double_t> t;
+	Long64_t loops=1;
+	KBenchResult R;
+
+	if(!Selected(name)) return;
+	f();
+	for(Int_t r=0;r<(Repeat>0?Repeat:1);r++)
+	{
+		Long64_t n=0;
+		Double_t dt;
+		auto t0=std::chrono::steady_clock::now();
+		do {f(); n++; dt=std::chrono::duration<Double_t>(std::chrono::steady_clock::now()-t0).count();}
+		while(r==0 && dt<MinTime);
+		if(r==0) loops=n;
+		else for(;n<loops;n++) f();
+		dt=std::chrono::duration<Double_t>(std::chrono::steady_clock::now()-t0).count();
+		t.push_back(dt/loops);
+	}
+	std::sort(t.begin(),t.end());
+	R.Name=name; R.Unit=unit; R.Items=items; R.Loops=loops;
+	R.Best=t[0]; R.Median=t[t.size()/2]; R.Extra=extra;
+	Results.push_back(R);
+	printf("%-28s %12.4g %-10s (%.3g s per call, %lld calls)\n",name,items/R.Median,unit,R.Median,loops);
+}
 
+void KBench::Run()
+{
+	Int_t i,k,num,it=0;
+	Double_t err;
+	Bool_t adddir=TH1::AddDirectoryStatus();
+	TH1::AddDirectory(kFALSE);
 
+	for(size_t m=0;m<Meshes.size();m++)
+	{
+		KConfig cfg(Cfg);
+		cfg.Set("step_xy",Form("%g",Meshes[m].first));
+		cfg.Set("step_z",Form("%g",Meshes[m].second));
+		KDetector *det=cfg.Detector();
+		TString mesh=Form("%gx%g",Meshes[m].first,Meshes[m].second);
+		Int_t dim[3]={det->nx,det->ny,det->nz};
+		num=det->nx*det->ny*det->nz;
+
+		// the matrix of the electric field, as in CalField
+		b=dvector(1,num); y2=dvector(1,num); y3=dvector(1,num); y4=dvector(1,num);
+		y5=dvector(1,num); y6=dvector(1,num); y7=dvector(1,num); y8=dvector(1,num);
+		Double_t *x=dvector(1,num),*r=dvector(1,num);
+		for(k=1;k<=num;k++) x[k]=1.;
+		det->Declaration(0);
+
+		Measure("declaration/"+mesh,"cells/s",num,[&]{det->Declaration(0);});
+		Measure("atimes/"+mesh,"cells/s",num,[&]{atimes(num,dim,x,r,0);});
+		Measure("linbcg/"+mesh,"solves/s",1,[&]{for(k=1;k<=num;k++) r[k]=1.; linbcg(num,dim,b,r,1,1e-6,100000,&it,&err);});
+		if(Selected("linbcg/"+mesh)) Results.back().Extra=it;   // iterations of a solution
+		if(Selected("calfield/"+mesh))
+		{
+			for(k=1;k<=num;k++) x[k]=1.;
+			linbcg(num,dim,b,x,1,1e-6,100000,&it,&err);
+			det->Real->U=det->MapToGeometry(x);
+			Measure("calfield/"+mesh,"cells/s",num,[&]{det->Real->CalField();});
+		}
 
-// K3D 
+		free_dvector(x,1,num); free_dvector(r,1,num); free_dvector(b,1,num);
+		free_dvector(y2,1,num); free_dvector(y3,1,num); free_dvector(y4,1,num);
+		free_dvector(y5,1,num); free_dvector(y6,1,num); free_dvector(y7,1,num); free_dvector(y8,1,num);
 
+		if(m>0 || (!Selected("interpolation") && !Selected("mobility") && !Selected("drift") && !Selected("mip"))) {delete det; continue;}
 
-#include "TArray.h"
-#include "TArrayI.h"
-#include "TArrayF.h"
-#include "TGraph.h"
-#include <stdio.h>
-#include <stdlib.h>
-//#include "KStruct.h"
-#include "TMinuit.h"
-// #include "KDetector.h"
+		// the rest on the fields of the first mesh
+		det->CalField(0);
+		det->CalField(1);
+		const Int_t np=100000;
+		std::vector<Float_t> px(np),py(np),pz(np);
+		TRandom3 rnd(4357);
+		TAxis *ax[3]={det->EG->GetXaxis(),det->EG->GetYaxis(),det->EG->GetZaxis()};   // inside the outer bin centers
+		for(i=0;i<np;i++)
+		{
+			px[i]=rnd.Uniform(ax[0]->GetBinCenter(1),ax[0]->GetBinCenter(ax[0]->GetNbins()));
+			py[i]=rnd.Uniform(ax[1]->GetBinCenter(1),ax[1]->GetBinCenter(ax[1]->GetNbins()));
+			pz[i]=rnd.Uniform(ax[2]->GetBinCenter(1),ax[2]->GetBinCenter(ax[2]->GetNbins()));
+		}
+		Float_t E[4];
+		Double_t s=0;
+		Int_t mob=det->MobMod(0);
+		Measure("interpolation/field","points/s",np,[&]{for(i=0;i<np;i++) {det->Real->CalFieldXYZ(px[i],py[i],pz[i],E); s+=E[0];}});
+		Measure("interpolation/potential","points/s",np,[&]{for(i=0;i<np;i++) s+=det->Ramo->CalPotXYZ(px[i],py[i],pz[i]);});
+		Measure("mobility","calls/s",2*np,[&]{for(i=0;i<np;i++) s+=det->Real->Mobility(i*1e6/np,det->Temperature,1,2e12,mob)+
+		                                                         det->Real->Mobility(i*1e6/np,det->Temperature,-1,2e12,mob);});
+
+		// drifts without diffusion always take the same path
+		Int_t diff=det->diff,steps=0;
+		KStruct seg;
+		det->diff=0;
+		Float_t c[3];
+		for(k=0;k<3;k++) c[k]=(det->enp[k]+det->exp[k])/2;   // middle of the mip track
+		for(Int_t q=1;q>=-1;q-=2)
+		{
+			det->Drift(c[0],c[1],c[2],q,&seg);
+			steps+=seg.Steps;
+		}
+		Measure("drift","steps/s",steps,[&]{for(Int_t q=1;q>=-1;q-=2) det->Drift(c[0],c[1],c[2],q,&seg);},steps);
+		det->diff=diff;
+		Measure("mip","events/s",1,[&]{det->MipIR((Int_t)Cfg.Get("div",150.));});
+		Sink=s;
+		delete det;
+	}
+	TH1::AddDirectory(adddir);
+}
 
+void KBench::Print()
+{
+	for(size_t i=0;i<Results.size();i++)
+	{
+		KBenchResult &R=Results[i];
+		printf("%-28s %12.4g %-10s best %.4g s median %.4g s\n",R.Name.c_str(),R.Items/R.Median,R.Unit.c_str(),R.Best,R.Median);
+	}
+}
 
-class K3D : public KDetector
+void KBench::Write(const char *name)
 {
-	private:
-	public:
-		Int_t Col;
-		Float_t CellZ;
-		Float_t CellX;
-		Float_t CellY;
+	// JSON: the machine and build, then one record per benchmark
+	FILE *f=fopen(name,"w");
+	char host[256]="";
+	time_t now=time(NULL);
+	char date[64];
+	if(f==NULL) {printf("KBench: can not write %s\n",name); return;}
+	gethostname(host,sizeof(host)-1);
+	strftime(date,sizeof(date),"%Y-%m-%dT%H:%M:%S",localtime(&now));
+	fprintf(f,"{\n  \"commit\": \"%s\",\n",getenv("RASER_COMMIT")!=NULL?getenv("RASER_COMMIT"):"");
+	fprintf(f,"  \"host\": \"%s\",\n  \"date\": \"%s\",\n  \"cores\": %d,\n",host,date,KThreadPool::Cores());
+	fprintf(f,"  \"threads\": %d,\n  \"compiler\": \"%s\",\n  \"repeat\": %d,\n",(Int_t)Cfg.Get("threads",0.),__VERSION__,Repeat);
+	fprintf(f,"  \"benchmarks\": [\n");
+	for(size_t i=0;i<Results.size();i++)
+	{
+		KBenchResult &R=Results[i];
+		fprintf(f,"    {\"name\": \"%s\", \"unit\": \"%s\", \"throughput\": %.6g, \"items\": %.6g, \"best\": %.6g, \"median\": %.6g, \"calls\": %lld, \"extra\": %.6g}%s\n",
+		        R.Name.c_str(),R.Unit.c_str(),R.Items/R.Median,R.Items,R.Best,R.Median,R.Loops,R.Extra,i+1<Results.size()?",":"");
+	}
+	fprintf(f,"  ]\n}\n");
+	fclose(f);
+	printf("KBench: %d benchmarks written to %s\n",(Int_t)Results.size(),name);
+}
 
-		Float_t *PosD; //[Col]
-		Float_t *PosX; //[Col]
-		Float_t *PosY; //[Col]
-		Float_t *PosR; //[Col]
-		Short_t *PosW; //[Col]
-		Short_t *PosM; //[Col]
 
-		K3D(Int_t, Float_t = 100, Float_t = 100, Float_t = 105);
-		~K3D();
-		void SetUpVolume(Float_t, Float_t);
-		void SetUpColumn(Int_t, Float_t, Float_t, Float_t, Float_t, Short_t, Short_t);
-		void SetUpElectrodes(Int_t = 0);
+// KRegress
 
-		// ClassDef(K3D, 1)
+class KRegress
+{
+	private:
+		std::map<std::string,std::vector<Double_t> > Values;    // quantities of the running case
+		KDetector *Build(const char *);
+		void Measure(KDetector *);
+		void Sample(const char *, TH3F *);
+		Int_t Compare(const char *, std::map<std::string,std::vector<Double_t> > &);
+		Bool_t Selected(const char *);
+
+	public:
+		static const char *Cases[];
+		static const char *Names[];
+		static const Double_t Tol[];
+		TString Dir;          // directory of the golden outputs
+		Double_t TolScale;    // scale of all tolerances
+		TString Only;         // run only the cases whose name contains one of these words ("" = all)
+		Int_t NFail;          // quantities out of tolerance (or missing) in the last Run
+
+		KRegress(KConfig &);
+		~KRegress(){};
+		Int_t Run(Bool_t = kFALSE);
+		static Int_t Read(const char *, std::map<std::string,std::vector<Double_t> > &);
+		static Int_t Write(const char *, std::map<std::string,std::vector<Double_t> > &);
 };
 
-// ClassImp(K3D)
 //////////////////////////////////////////////////////////////////////////
 //                                                                      //
-// K3D                                                                  //
+// KRegress                                                             //
+//                                                                      //
+// Numerical regression test of raser against stored golden outputs.    //
+// Every case (the 7 column K3D cell of the raser example, a planar 2D  //
+// pad with nz==1 and the r-z cell KCyl::Cell) is solved and drifted    //
+// without diffusion, then the potential, field and weighting potential //
+// on a fixed subgrid, the end points, times, charges and stop codes of //
+// drifts from fixed points and the induced current of a mip are        //
+// compared with Dir/<case>.txt.                                        //
+// A quantity passes if its largest deviation, relative to the largest  //
+// golden value, is within its tolerance (Tol times TolScale; the stop  //
+// codes must be equal). A case without golden output fails.            //
+// Run(kTRUE) writes the golden outputs instead.                        //
 //                                                                      //
-// Description of the 3D detector.                                      //
-// The geometry of the                                                  //
-// is defined by                                                        //
-// dasdasd                                                              //
 //////////////////////////////////////////////////////////////////////////
 
-K3D::~K3D()
+const char *KRegress::Cases[]={"k3d","planar2d","rz",NULL};
+const char *KRegress::Names[]={"potential","field","weighting","endpoints","times","charges","stops","waveform",NULL};
+const Double_t KRegress::Tol[]={1e-5,1e-4,1e-5,1e-3,1e-3,1e-3,0,1e-3};
+
+KRegress::KRegress(KConfig &cfg)
 {
-	delete PosD;
-	delete PosX;
-	delete PosY;
-	delete PosR;
-	delete PosW;
+	Dir=cfg.Get("golden","golden");
+	TolScale=cfg.Get("tolerance",1.);
+	Only=cfg.Get("only","");
+	NFail=0;
 }
 
-K3D::K3D(Int_t x1, Float_t x, Float_t y, Float_t z)
+KDetector *KRegress::Build(const char *name)
 {
-	Col = x1;
-	PosD = new Float_t[Col];
-	PosX = new Float_t[Col];
-	PosY = new Float_t[Col];
-	PosR = new Float_t[Col];
-	PosW = new Short_t[Col];
-	PosM = new Short_t[Col];
-
-	for (Int_t i = 0; i < Col; i++) {
-		PosD[i] = 0;
-		PosX[i] = 0;
-		PosY[i] = 0;
-		PosR[i] = 0;
-		PosW[i] = 0;
-		PosM[i] = 0;
+	KDetector *det;
+	if(!strcmp(name,"k3d"))
+	{
+		// the detector of the raser example
+		K3D *k3d=new K3D(7,80,80,300);
+		k3d->Voltage=50;
+		k3d->SetUpVolume(1,4);
+		k3d->SetUpColumn(0,40,15,4,280,2,1);
+		k3d->SetUpColumn(1,40,65,4,280,2,1);
+		k3d->SetUpColumn(2,61.65,27.5,4,280,2,1);
+		k3d->SetUpColumn(3,61.65,52.5,4,280,2,1);
+		k3d->SetUpColumn(4,18.35,27.5,4,280,2,1);
+		k3d->SetUpColumn(5,18.35,52.5,4,280,2,1);
+		k3d->SetUpColumn(6,40,40,4,-280,16385,1);
+		Float_t Pos[3]={80,80,1},Size[3]={80,80,2};
+		k3d->ElRectangle(Pos,Size,0,20);
+		k3d->SetUpElectrodes();
+		k3d->enp[0]=25; k3d->enp[1]=40; k3d->enp[2]=260;
+		k3d->exp[0]=25; k3d->exp[1]=40; k3d->exp[2]=40;
+		det=k3d;
+	}
+	else if(!strcmp(name,"planar2d"))
+	{
+		// planar pad in 2D: readout strip on top, bias plane at the bottom
+		K3D *pad=new K3D(0,100,150,1);
+		pad->Voltage=100;
+		pad->SetUpVolume(1,1);
+		Float_t Pos[3]={50,0.25,0.5},Size[3]={20,0.25,0.25};
+		pad->ElRectangle(Pos,Size,16385,20);
+		Float_t PosB[3]={50,149.75,0.5},SizeB[3]={49.75,0.25,0.25};
+		pad->ElRectangle(PosB,SizeB,2,20);
+		pad->enp[0]=40; pad->enp[1]=140; pad->enp[2]=0.5;
+		pad->exp[0]=40; pad->exp[1]=10; pad->exp[2]=0.5;
+		det=pad;
+	}
+	else
+	{
+		// the raser cell in r-z, the track 15 um from the readout column
+		KCyl *cyl=KCyl::Cell(25,4,280,300);
+		cyl->Voltage=50;
+		cyl->SetUpVolume(1,4);
+		Float_t Pos[3]={cyl->CellR,1,0.5},Size[3]={cyl->CellR,2,0.25};
+		cyl->ElRectangle(Pos,Size,0,20);
+		cyl->SetUpElectrodes();
+		cyl->enp[0]=15; cyl->enp[1]=0; cyl->enp[2]=260;
+		cyl->exp[0]=15; cyl->exp[1]=0; cyl->exp[2]=40;
+		det=cyl;
 	}
+	det->SetBoundaryConditions();
+	det->NeffF=new TF3("neff","x[0]*x[1]*x[2]*0+[0]",0,3000,0,3000,0,3000);
+	det->NeffF->SetParameter(0,2);
+	det->Temperature=300;
+	det->SetDriftHisto(1.2e-9,36);
+	det->diff=0;
+	return det;
+}
 
-	CellZ = z;
-	CellX = x;
-	CellY = y;
+Bool_t KRegress::Selected(const char *name)
+{
+	// name contains one of the comma separated words of Only
+	std::stringstream in(Only.Data());
+	std::string w;
+	if(Only=="") return kTRUE;
+	while(std::getline(in,w,','))
+		if(w!="" && strstr(name,w.c_str())!=NULL) return kTRUE;
+	return kFALSE;
 }
 
-void K3D::SetUpVolume(Float_t St1, Float_t St2)
+void KRegress::Sample(const char *name, TH3F *h)
 {
-	nx = (int)(CellX / St1);
-	ny = (int)(CellY / St1);
-	nz = (int)(CellZ / St2);
+	// values on a subgrid of at most 16 bins per axis, the edges included
+	Int_t n[3]={h->GetNbinsX(),h->GetNbinsY(),h->GetNbinsZ()},s[3],i,j,k;
+	std::vector<Double_t> &v=Values[name];
+	for(i=0;i<3;i++) s[i]=n[i]>16?(n[i]-1)/15:1;
+	for(k=1;k<=n[2];k+=s[2])
+		for(j=1;j<=n[1];j+=s[1])
+			for(i=1;i<=n[0];i+=s[0])
+				v.push_back(h->GetBinContent(i,j,k));
+}
 
-	EG = new TH3I("EG", "EG", nx, 0, CellX, ny, 0, CellY, nz, 0, CellZ);
-	EG->GetXaxis()->SetTitle("x [#mum]");
-	EG->GetYaxis()->SetTitle("y [#mum]");
-	EG->GetZaxis()->SetTitle("z [#mum]");
+void KRegress::Measure(KDetector *det)
+{
+	Int_t i,c;
+	KStruct seg;
 
-	GetGrid(EG, 1);
+	Values.clear();
+	Sample("potential",det->Real->U);
+	Sample("field",det->Real->E);
+	Sample("weighting",det->Ramo->U);
+
+	// drifts of holes and electrons from 20 points of the mip track
+	for(i=0;i<20;i++)
+		for(c=1;c>=-1;c-=2)
+		{
+			Double_t f=(i+0.5)/20;
+			det->Drift(det->enp[0]+f*(det->exp[0]-det->enp[0]),det->enp[1]+f*(det->exp[1]-det->enp[1]),
+			           det->enp[2]+f*(det->exp[2]-det->enp[2]),c,&seg);
+			Values["endpoints"].push_back(seg.Xtrack[seg.Steps]);
+			Values["endpoints"].push_back(seg.Ytrack[seg.Steps]);
+			Values["endpoints"].push_back(seg.Ztrack[seg.Steps]);
+			Values["times"].push_back(seg.TTime);
+			Values["charges"].push_back(seg.TCharge);
+			Values["stops"].push_back(seg.Stop);
+		}
+
+	det->MipIR(50);
+	for(i=1;i<=det->sum->GetNbinsX();i++) Values["waveform"].push_back(det->sum->GetBinContent(i));
 }
 
-void K3D::SetUpColumn(Int_t n, Float_t posX, Float_t posY, Float_t R, Float_t Depth, Short_t Wei, Short_t Mat)
+Int_t KRegress::Compare(const char *name, std::map<std::string,std::vector<Double_t> > &gold)
 {
-	PosD[n] = Depth;
-	PosR[n] = R;
-	PosX[n] = posX;
-	PosY[n] = posY;
-	PosW[n] = Wei;
-	PosM[n] = Mat;
+	Int_t nf=0;
+	for(Int_t q=0;Names[q]!=NULL;q++)
+	{
+		std::vector<Double_t> &v=Values[Names[q]],&g=gold[Names[q]];
+		Double_t scale=0,dev=0,tol=Tol[q]*TolScale;
+		Bool_t ok=v.size()==g.size() && v.size()>0;
+		for(size_t i=0;ok && i<g.size();i++) scale=TMath::Max(scale,TMath::Abs(g[i]));
+		for(size_t i=0;ok && i<g.size();i++) dev=TMath::Max(dev,TMath::Abs(v[i]-g[i])/(scale>0?scale:1));
+		if(ok) ok=dev<=tol;
+		if(!ok) nf++;
+		if(v.size()!=g.size())
+			printf("KRegress: %-9s %-10s %6d values, golden %d  FAIL\n",name,Names[q],(Int_t)v.size(),(Int_t)g.size());
+		else
+			printf("KRegress: %-9s %-10s %6d values, deviation %9.3e (tolerance %7.1e)  %s\n",name,Names[q],(Int_t)v.size(),dev,tol,ok?"PASS":"FAIL");
+	}
+	return nf;
 }
 
-void K3D::SetUpElectrodes(Int_t back)
+Int_t KRegress::Run(Bool_t update)
 {
-	Float_t Pos[3], L = 0;
-	Int_t i, j, k;
-	if (back) {
-		for (k = 1; k <= nz; k++)
-			for (j = 1; j <= ny; j++)
-				for (i = 1; i <= nx; i++)
-					if (k == 1)
-						EG->SetBinContent(i, j, k, 2);
-					else
-						EG->SetBinContent(i, j, k, 0);
+	// Runs all cases, returns the number of failed quantities
+	Bool_t adddir=TH1::AddDirectoryStatus();
+	TH1::AddDirectory(kFALSE);
+	NFail=0;
+	if(update) gSystem->mkdir(Dir,kTRUE);
+	for(Int_t i=0;Cases[i]!=NULL;i++)
+	{
+		if(!Selected(Cases[i])) continue;
+		TString file=Form("%s/%s.txt",Dir.Data(),Cases[i]);
+		std::map<std::string,std::vector<Double_t> > gold;
+		if(!update && Read(file,gold)<0)
+		{
+			// a missing golden output is a failure of every quantity of the case
+			fprintf(stderr,"KRegress: ERROR golden output %s of case %s is missing\n",file.Data(),Cases[i]);
+			printf("KRegress: %-9s %-10s missing golden output  FAIL\n",Cases[i],"all");
+			for(Int_t q=0;Names[q]!=NULL;q++) NFail++;
+			continue;
+		}
+
+		KDetector *det=Build(Cases[i]);
+		det->CalField(0);
+		det->CalField(1);
+		Measure(det);
+		delete det;
+
+		if(update) {if(Write(file,Values)<0) NFail++;}
+		else NFail+=Compare(Cases[i],gold);
 	}
+	TH1::AddDirectory(adddir);
+	if(!update) printf("KRegress: %s\n",NFail?"FAILED":"all quantities within tolerance");
+	return NFail;
+}
 
-	for (Int_t i = 0; i < Col; i++) {
-		Pos[0] = PosX[i];
-		Pos[1] = PosY[i];
-		Pos[2] = PosD[i] >= 0 ? Pos[2] = PosD[i] / 2. : (2 * CellZ + PosD[i]) / 2.;
-		L = TMath::Abs(PosD[i] / 2.);
-		ElCylinder(Pos, PosR[i], L, 3, PosW[i], PosM[i]);
+Int_t KRegress::Read(const char *name, std::map<std::string,std::vector<Double_t> > &val)
+{
+	// "name n" followed by n values, # starts a comment line
+	FILE *f=fopen(name,"r");
+	char line[256],key[64];
+	Int_t n;
+	if(f==NULL) return -1;
+	while(fgets(line,sizeof(line),f)!=NULL)
+	{
+		if(line[0]=='#' || sscanf(line,"%63s %d",key,&n)!=2) continue;
+		std::vector<Double_t> &v=val[key];
+		v.resize(n>0?n:0);
+		for(Int_t i=0;i<n;i++)
+			if(fscanf(f,"%lf",&v[i])!=1) {printf("KRegress: %s: %s is short\n",name,key); fclose(f); return -1;}
+	}
+	fclose(f);
+	return (Int_t)val.size();
+}
+
+Int_t KRegress::Write(const char *name, std::map<std::string,std::vector<Double_t> > &val)
+{
+	FILE *f=fopen(name,"w");
+	if(f==NULL) {printf("KRegress: can not write %s\n",name); return -1;}
+	fprintf(f,"# raser golden output (raser regress --update)\n");
+	for(std::map<std::string,std::vector<Double_t> >::iterator i=val.begin();i!=val.end();i++)
+	{
+		fprintf(f,"%s %d\n",i->first.c_str(),(Int_t)i->second.size());
+		for(size_t k=0;k<i->second.size();k++)
+			fprintf(f,"%.10g%s",i->second[k],(k%8==7 || k+1==i->second.size())?"\n":" ");
 	}
+	fclose(f);
+	printf("KRegress: golden output written to %s\n",name);
+	return 0;
 }
 
 
 
 
+#ifndef RASER_BATCH
 void set_root_style(int stat=1110, int grid=0){
 	gROOT->Reset();
 
@@ -2065,55 +7355,23 @@ void set_root_style(int stat=1110, int grid=0){
 }
 
 
-TGraph * get_graph_from_log(TString inputFile, TString& err_msg) {
-	std::ifstream in;
-	in.open(inputFile); 
-	Float_t x, y; 
-	Float_t factor_I(1.0);
-	if (inputFile.Contains("_uA_") ) {
-		factor_I = 1e-6;
-		std::cout << "Using current factor: " << factor_I << " for " << inputFile << std::endl;  
-	} 
-	std::vector<Float_t> voltages; 
-	std::vector<Float_t> currents; 
+#endif
 
-	std::string line;
-	int nlines = 0;
-
-	// float i_v150, i_v100;
-	double i_v150, i_v100;
-	bool pass1(false), pass2(false); 
-
-	while (getline(in, line)) {
-		std::istringstream iss(line);
-		if ( line.find("#") == 0 ) continue; 
-		if (!(iss >> x >> y )) break; 
-		if (!in.good()) break;
-		voltages.push_back(fabs(x));
-		currents.push_back(fabs(y)*factor_I);
-		// Pick up values like: -100.043	
-		if ( fabs(fabs(x)-150) < 1) i_v150 = fabs(y); 
-		if ( fabs(fabs(x)-100) < 1) i_v100 = fabs(y); 
-		nlines ++; 
-	}
-
-	if (nlines < 1) {
+
+TGraph * get_graph_from_log(TString inputFile, TString& err_msg) {
+	KIVLog log;
+	if (log.Read(inputFile, kTRUE) < 1) {
 		std::cerr << "No valid data found in : " << inputFile << std::endl;
 		return NULL; 
 	}
-
-	if ( i_v150 < 2E-6) pass1 = true;
-	if ( i_v150/i_v100 < 2 ) pass2 = true;
-
-	if (!pass1) err_msg = Form("I(150V) >= 2uA (%.1e)",i_v150) ;
-	if (!pass2) err_msg += Form("I(150V)/I(100V) >= 2 (%.1f)", i_v150/i_v100) ;
-
-	in.close();
-	TGraph *gr = new TGraph(nlines, &voltages[0], &currents[0]);
+	log.Check(2E-6, 2);
+	err_msg = log.Err;
+	TGraph *gr = new TGraph(log.NPoints, &log.V[0], &log.I[0]);
 	return gr; 
 }
 
-TCanvas* drawIV(std::vector<TString> inputFiles){
+#ifndef RASER_BATCH
+TCanvas* drawIV(KIVQA &qa){
 	set_root_style();
 
 	TCanvas *c = new TCanvas("c", "IV scan", 800, 800);
@@ -2128,18 +7386,18 @@ TCanvas* drawIV(std::vector<TString> inputFiles){
 	leg->SetTextSize(0.02);
 	leg->SetTextSizePixels(25);
 
-	for (std::vector<int>:: size_type i = 0; i != inputFiles.size(); i++) {
-		TString err_msg = "";  
-		TGraph *gr = get_graph_from_log(inputFiles[i], err_msg);
-		if (gr == NULL) continue; 
+	for (std::vector<int>:: size_type i = 0; i != qa.Logs.size(); i++) {
+		KIVLog &log = qa.Logs[i];
+		if (log.NPoints < 1 || log.V.empty()) continue; 
+		TGraph *gr = new TGraph(log.NPoints, &log.V[0], &log.I[0]);
 		gr->SetMarkerStyle(20+i);
 		gr->SetMarkerSize(0.9);
 		int color = i+1;
 		if (color >= 5) color ++; // bypass the yellow  
 		if (color >= 10) color = color % 10 + 1 ; // reuse the first 9 colors
 		gr->SetMarkerColor(color);
-		leg->AddEntry(gr, Form("%s %s", inputFiles[i].Data(),
-					err_msg.Data()), "p"); 
+		leg->AddEntry(gr, Form("%s %s", log.File.Data(),
+					log.Err.Data()), "p"); 
 		mg->Add(gr); 
 	}
 
@@ -2154,57 +7412,173 @@ TCanvas* drawIV(std::vector<TString> inputFiles){
 	return c;
 }
 
+TCanvas* drawIV(std::vector<TString> inputFiles){
+	KIVQA qa;
+	qa.Keep = kTRUE;
+	for (size_t i = 0; i < inputFiles.size(); i++) qa.Add(inputFiles[i]);
+	qa.Run();
+	return drawIV(qa);
+}
+#endif
+
 
 #ifndef __CINT__ 
 
 void print_usage(){
-	printf("NAME\n\tdrawIV - draw IV curves from log files\n");
-	printf("\nSYNOPSIS\n\tdrawIV [-b] [-h] file1 file2 ...\n");
+	printf("NAME\n\traser - RAdiation SEmiconductoR simulation\n");
+	printf("\nSYNOPSIS\n\traser <command> [options] [key=value ...]\n");
+	printf("\traser                   3D example with drift paths (graphics build only)\n");
+	printf("\nCOMMANDS\n");
+	printf("\t%-7s  %-40s\n", "solve", "Solve the fields and write them (raser_fields.root)");
+	printf("\t%-7s  %-40s\n", "drift", "Drift a track, events or deposits (raser_drift.root, raser_events.root)");
+	printf("\t%-7s  %-40s\n", "scan", "Parameter sweep, e.g. radius=4,5 voltage=50:150:50 (raser_sweep.txt)");
+	printf("\t%-7s  %-40s\n", "bench", "Benchmarks of the solver, interpolation and drift (raser_bench.json)");
+	printf("\t%-7s  %-40s\n", "regress", "Compare fields, drifts and signals of reference cases with golden outputs");
+	printf("\t%-7s  %-40s\n", "iv", "QA summary of IV log files, I(150V) < 2uA and I(150V)/I(100V) < 2 (raser_iv.txt)");
 	printf("\nOPTIONS\n");
-	printf("\t%-5s  %-40s\n", "-h", "Print this message");
-	printf("\t%-5s  %-40s\n", "-b", "Batch mode, save to pdf file directly");
+	printf("\t%-10s  %-40s\n", "-h", "Print this message");
+	printf("\t%-10s  %-40s\n", "-f <file>", "Config file of key = value lines");
+	printf("\t%-10s  %-40s\n", "-o <file>", "Output file");
+	printf("\t%-10s  %-40s\n", "-n <n>", "Events of the Monte Carlo (events=n)");
+	printf("\t%-10s  %-40s\n", "-i <file>", "Energy deposits to drift (input=file)");
+	printf("\t%-10s  %-40s\n", "-c <name>", "Checkpoints, a pre-empted job continues (checkpoint=name)");
+	printf("\t%-10s  %-40s\n", "-p <file>", "Plot the IV curves or the drift paths to file, e.g. paths.png (graphics build only)");
+	printf("\t%-10s  %-40s\n", "-u", "regress: write the golden outputs instead of comparing (--update)");
+	printf("\t%-10s  %-40s\n", "-b", "Batch mode, no windows");
+	printf("\nKEYS\n");
+	for (int i = 0; KConfig::Keys[i][0] != NULL; i++)
+		printf("\t%-12s  %s\n", KConfig::Keys[i][0], KConfig::Keys[i][1]);
 	printf("\nAUTHOR\n\tXin Shi <Xin.Shi@cern.ch>\n");
 }
 
+int raser_iv(std::vector<TString> &files, const char *out, const char *plot, Int_t nthreads) {
+	// QA summary of all IV logs, the curves only on request
+	KIVQA qa;
+	qa.NThreads = nthreads;
+	qa.Keep = plot != NULL;
+	for (size_t i = 0; i < files.size(); i++) qa.Add(files[i]);
+	qa.Run();
+	qa.Print();
+	qa.Write(out);
+	if (plot != NULL) {
+#ifndef RASER_BATCH
+		TCanvas *c = drawIV(qa);
+		c->SaveAs(plot);
+		delete c;
+#else
+		printf("raser iv: no plots in the batch build\n");
+#endif
+	}
+	return qa.NFail + qa.NBad > 0;
+}
+
+void raser_profile(KConfig &cfg) {
+	// summary and trace of a profiled run
+	if (!KProfile::IsOn()) return;
+	KProfile::Stop();
+	KProfile::Print();
+	if (cfg.Has("trace")) KProfile::WriteTrace(cfg.Get("trace", ""));
+}
+
 int main(int argc, char** argv) {
 
-	/*
-	if (argc < 2) {
-		print_usage() ;  
-		return -1; 
+	// raser <command> [options] [key=value ...]; the compute commands
+	// never open a window or load the graphics
+	const char *cmd = argc > 1 ? argv[1] : "";
+	if (!strcmp(cmd, "-h") || !strcmp(cmd, "help")) {
+		print_usage();
+		return 0;
 	}
+	if (!strcmp(cmd, "solve") || !strcmp(cmd, "drift") || !strcmp(cmd, "scan") || !strcmp(cmd, "iv") || !strcmp(cmd, "bench") || !strcmp(cmd, "regress")) {
+		KConfig cfg;
+		std::vector<TString> args;
+		const char *out = NULL;
+		const char *plot = NULL;
+		bool update = false;
+		for (int i = 2; i < argc; i++) {
+			if (!strcmp(argv[i], "-h")) { print_usage(); return 0; }
+			else if (!strcmp(argv[i], "-b")) gROOT->SetBatch(kTRUE);
+			else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--update")) update = true;
+			else if (i + 1 < argc && !strcmp(argv[i], "-f")) { if (cfg.Read(argv[++i]) < 0) return 1; }
+			else if (i + 1 < argc && !strcmp(argv[i], "-o")) out = argv[++i];
+			else if (i + 1 < argc && !strcmp(argv[i], "-p")) plot = argv[++i];
+			else if (i + 1 < argc && !strcmp(argv[i], "-n")) cfg.Set("events", argv[++i]);
+			else if (i + 1 < argc && !strcmp(argv[i], "-i")) cfg.Set("input", argv[++i]);
+			else if (i + 1 < argc && !strcmp(argv[i], "-c")) cfg.Set("checkpoint", argv[++i]);
+			else if (argv[i][0] != '-' && strchr(argv[i], '=') != NULL) { if (cfg.Set(argv[i]) < 0) return 1; }
+			else if (argv[i][0] != '-') args.push_back(argv[i]);
+			else { printf("raser: unknown option %s\n", argv[i]); print_usage(); return 1; }
+		}
 
-	//    K3D *det = new K3D(7, 80, 80, 300);
+		if (cfg.Get("profile", 0.) > 0 || cfg.Has("trace"))
+			KProfile::Start(cfg.Has("trace"));
 
-	bool doBatch(false);
-	std::vector<TString> inputFiles(argv+1, argv+argc);
-	TString outFile = "test.pdf";
+		if (!strcmp(cmd, "iv"))
+			return raser_iv(args, out != NULL ? out : "raser_iv.txt", plot, (Int_t)cfg.Get("threads", 0.));
 
-	for (int i = 0; i < argc; i++){
-		if (!strcmp(argv[i], "-h")) {
-			print_usage();
-			break; 
+		gROOT->SetBatch(kTRUE);
+		if (!strcmp(cmd, "bench")) {
+			KBench bench(cfg);
+			bench.Run();
+			bench.Write(out != NULL ? out : "raser_bench.json");
+			raser_profile(cfg);
+			return 0;
 		}
-
-		if (!strcmp(argv[i], "-b")) {
-			doBatch = true;
-			inputFiles.erase(inputFiles.begin()+i-1);
+		if (!strcmp(cmd, "regress")) {
+			KRegress regress(cfg);
+			regress.Run(update);
+			raser_profile(cfg);
+			return regress.NFail > 0;
+		}
+		if (!strcmp(cmd, "scan")) {
+			KSweep sweep;
+			cfg.Apply(&sweep);
+			sweep.Run();
+			sweep.Write(out != NULL ? out : "raser_sweep.txt");
+			raser_profile(cfg);
+			return 0;
 		}
-	}
 
-	if (doBatch) { 
-		std::cout << "Run in batch mode ... " << std::endl;
-		TCanvas *c = drawIV(inputFiles);
-		c->SaveAs(outFile);
-		delete c;
-		gSystem->Exit(0);
+		KDetector *det = cfg.Detector();
+		det->CalField(0);
+		det->CalField(1);
+		if (!strcmp(cmd, "solve")) {
+			out = out != NULL ? out : "raser_fields.root";
+			TFile f(out, "RECREATE");
+			det->Real->U->Write("potential");
+			det->Real->E->Write("field");
+			det->Ramo->U->Write("weighting");
+			det->EG->Write("geometry");
+			f.Close();
+			printf("raser: fields written to %s\n", out);
+		}
+		else if (cfg.Has("input"))
+			det->DepositMC(cfg.Get("input", ""), out != NULL ? out : "raser_events.root", cfg.Get("qscale", 1.));
+		else if (cfg.Get("events", 0.) > 0)
+			det->EventMC((Int_t)cfg.Get("events", 0.), (Int_t)cfg.Get("div", 150.), out != NULL ? out : "raser_events.root");
+		else {
+			out = out != NULL ? out : "raser_drift.root";
+#ifndef RASER_BATCH
+			if (plot != NULL) det->ShowToFile(plot, (Int_t)cfg.Get("div", 150.));
+			else
+#endif
+			det->MipIR((Int_t)cfg.Get("div", 150.));
+			TFile f(out, "RECREATE");
+			det->pos->Write();
+			det->neg->Write();
+			det->sum->Write();
+			f.Close();
+			printf("raser: induced current written to %s\n", out);
+		}
+		delete det;
+		raser_profile(cfg);
+		return 0;
 	}
-	*/
-
-	//TApplication theApp("App", 0, 0);
-	//theApp.SetReturnFromRun(true);
-	//drawIV(inputFiles); 
 
+#ifdef RASER_BATCH
+	print_usage();
+	return argc > 1;
+#else
 	// Start the Test3D_SiC_One
 	gStyle->SetCanvasPreferGL(kTRUE);
 	// define a 3D detector with 5 electrodes
@@ -2239,6 +7613,7 @@ int main(int argc, char** argv) {
 	// calculate electric field
 	det->CalField(0);
 	det->CalField(1);
+
 	// set entry points of the track
 	det->enp[0] = 25;
 	det->enp[1] = 40;
@@ -2256,6 +7631,7 @@ int main(int argc, char** argv) {
 
 
 	//theApp.Run();
+#endif
 }
 
 #endif